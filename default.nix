@@ -14,6 +14,7 @@ in rec {
       pkgs.cmake
       pkgs.openssl_1_1
       pkgs.gperftools
+      pkgs.libsystemtap # <sys/sdt.h>, for the USDT probes
     ];
     #cmakeFlags = [
       #"-DCMAKE_BUILD_TYPE=Debug"
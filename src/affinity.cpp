@@ -0,0 +1,208 @@
+#include "affinity.hpp"
+#include "common.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+static bool ParseCpuList(const std::string& str, std::vector<int>& cpus) {
+    size_t pos(0);
+
+    cpus.clear();
+
+    while (pos < str.size()) {
+        size_t end(str.find(',', pos));
+
+        if (end == std::string::npos) {
+            end = str.size();
+        }
+
+        const std::string token(str.substr(pos, end - pos));
+        const size_t dash(token.find('-'));
+        char* tail(nullptr);
+
+        pos = end + 1;
+
+        if (token.empty() || (token == "\n")) {
+            continue;
+        }
+
+        const long first(strtol(token.c_str(), &tail, 10));
+        long last(first);
+
+        if ((tail == token.c_str()) || (first < 0)) {
+            return false;
+        }
+
+        if (dash != std::string::npos) {
+            last = strtol(token.c_str() + dash + 1, &tail, 10);
+
+            if (last < first) {
+                return false;
+            }
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return !cpus.empty();
+}
+
+static bool ReadLine(const std::string& path, std::string& out) {
+    std::ifstream in(path);
+
+    return (bool)std::getline(in, out);
+}
+
+static int FindNumaNode(const stdfs::path& sysPath, const size_t depth = 0) {
+    std::error_code ec;
+    stdfs::path path(stdfs::canonical(sysPath, ec));
+
+    if (ec || (depth > 4)) {
+        return -1;
+    }
+
+    // Stacked devices (dm, md) have no node of their own, follow the first
+    // underlying device instead.
+    const auto slaves = path / "slaves";
+
+    if (stdfs::is_directory(slaves, ec)) {
+        for (const auto& it : stdfs::directory_iterator(slaves, ec)) {
+            return FindNumaNode(it.path(), depth + 1);
+        }
+    }
+
+    while (path.has_relative_path() && (path != "/sys/devices")) {
+        std::string value;
+
+        if (ReadLine((path / "numa_node").string(), value)) {
+            return atoi(value.c_str());
+        }
+
+        path = path.parent_path();
+    }
+
+    return -1;
+}
+
+static int DeviceNumaNode(const TDevice& dev) {
+    struct stat st;
+
+    if (fstat(dev.GetFd(), &st) != 0) {
+        return -1;
+    }
+
+    const dev_t id(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+
+    return FindNumaNode("/sys/dev/block/" + std::to_string(major(id)) + ":" + std::to_string(minor(id)));
+}
+
+bool TAffinity::Init(const std::string& spec, const TDevice& dev) {
+    std::error_code ec;
+    size_t nodes(0);
+
+    for (const auto& it : stdfs::directory_iterator("/sys/devices/system/node", ec)) {
+        const std::string name(it.path().filename().string());
+        std::string list;
+        std::vector<int> cpus;
+
+        if ((name.compare(0, 4, "node") != 0) || !ReadLine((it.path() / "cpulist").string(), list) || !ParseCpuList(list, cpus)) {
+            continue;
+        }
+
+        const int node(atoi(name.c_str() + 4));
+
+        ++nodes;
+
+        for (const int cpu : cpus) {
+            if (cpu >= CpuNodes.size()) {
+                CpuNodes.resize(cpu + 1, -1);
+            }
+
+            CpuNodes[cpu] = node;
+        }
+    }
+
+    Node = DeviceNumaNode(dev);
+
+    if (spec == "none") {
+        return true;
+    }
+
+    if (spec != "auto") {
+        if (!ParseCpuList(spec, Cpus)) {
+            std::cerr << "Invalid CPU list: " << spec << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    if ((Node < 0) || (nodes < 2)) {
+        return true;
+    }
+
+    std::string list;
+
+    if (!ReadLine("/sys/devices/system/node/node" + std::to_string(Node) + "/cpulist", list) || !ParseCpuList(list, Cpus)) {
+        Cpus.clear();
+        return true;
+    }
+
+    std::cerr << "Target is on NUMA node " << Node << ", pinning workers to CPUs " << list << std::endl;
+
+    return true;
+}
+
+void TAffinity::Pin() const {
+    if (Cpus.empty()) {
+        return;
+    }
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+
+    for (const int cpu : Cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    const int rv(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+
+    if (rv != 0) {
+        std::cerr << "Can't set thread affinity: " << strerror(rv) << std::endl;
+    }
+}
+
+void TAffinity::Account(const uint64_t size) {
+    if (Node < 0) {
+        return;
+    }
+
+    const int cpu(sched_getcpu());
+
+    if ((cpu >= 0) && (cpu < CpuNodes.size()) && (CpuNodes[cpu] >= 0) && (CpuNodes[cpu] != Node)) {
+        RemoteBytes += size;
+
+    } else {
+        LocalBytes += size;
+    }
+}
+
+void TAffinity::Report() const {
+    if (Node < 0) {
+        return;
+    }
+
+    std::cerr << "NUMA node " << Node << ": " << LocalBytes << " byte(s) local, " << RemoteBytes << " byte(s) cross-node" << std::endl;
+}
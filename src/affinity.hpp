@@ -0,0 +1,28 @@
+#pragma once
+
+#include "device.hpp"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Keeps I/O and cipher threads, and the buffers they first touch, on the
+// NUMA node the target is attached to.
+class TAffinity {
+public:
+    // Spec is "auto" (pin to the CPUs of the target's NUMA node, if there is
+    // more than one node), "none", or an explicit CPU list like "0-7,16".
+    bool Init(const std::string& spec, const TDevice& dev);
+
+    void Pin() const;
+    void Account(const uint64_t size);
+    void Report() const;
+
+private:
+    int Node = -1;
+    std::vector<int> Cpus;
+    std::vector<int> CpuNodes;
+    std::atomic<uint64_t> LocalBytes{0};
+    std::atomic<uint64_t> RemoteBytes{0};
+};
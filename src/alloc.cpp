@@ -0,0 +1,208 @@
+#include "alloc.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+static bool ParseNumber(const std::string& str, uint64_t& out) {
+    const bool hex((str.size() > 2) && (str[0] == '0') && ((str[1] == 'x') || (str[1] == 'X')));
+    char* end(nullptr);
+
+    errno = 0;
+    out = strtoull(str.c_str(), &end, (hex ? 16 : 10));
+
+    return ((errno == 0) && !str.empty() && (*end == '\0'));
+}
+
+static bool LoadExtentList(const std::string& path, const uint64_t unit, const std::function<void(uint64_t, uint64_t)>& add) {
+    std::ifstream file(path);
+
+    if (!file) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    size_t number(0);
+    bool header(true);
+
+    // A line that can't be parsed would silently drop allocated data from
+    // the map, so anything but blank lines, comments and a leading
+    // "offset length [type]" header is fatal.
+    auto invalid = [&]() {
+        std::cerr << path << ":" << number << ": invalid extent: " << line << std::endl;
+        return false;
+    };
+
+    while (std::getline(file, line)) {
+        ++number;
+
+        std::string spaced(line);
+
+        std::replace(spaced.begin(), spaced.end(), ',', ' ');
+
+        std::istringstream fields(spaced);
+        std::string offset;
+        std::string length;
+        std::string type;
+        std::string tail;
+        uint64_t begin(0);
+        uint64_t size(0);
+
+        fields >> offset >> length >> type >> tail;
+
+        if (offset.empty() || (offset[0] == '#')) {
+            continue;
+        }
+
+        if (header && (strcasecmp(offset.c_str(), "offset") == 0)) {
+            header = false;
+            continue;
+        }
+
+        header = false;
+
+        if (!ParseNumber(offset, begin) || !ParseNumber(length, size) || !tail.empty()) {
+            return invalid();
+        }
+
+        if ((type == "zero") || (type == "hole") || (type == "unallocated")) {
+            continue;
+        }
+
+        if (!type.empty() && (type != "data") && (type != "allocated")) {
+            return invalid();
+        }
+
+        if ((begin > (UINT64_MAX / unit)) || (size > (UINT64_MAX / unit))) {
+            return invalid();
+        }
+
+        add(begin * unit, size * unit);
+    }
+
+    if (file.bad()) {
+        std::cerr << "Can't read " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool LoadBitmap(const std::string& path, const uint64_t block, const uint64_t size, const std::function<void(uint64_t, uint64_t)>& add) {
+    FILE* file(fopen(path.c_str(), "rb"));
+
+    if (!file) {
+        perror("fopen");
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned char> buf(1 << 20);
+    uint64_t bit(0);
+    uint64_t runBegin(0);
+    bool inRun(false);
+    size_t len(0);
+
+    while ((len = fread(buf.data(), 1, buf.size(), file)) > 0) {
+        for (size_t i = 0; i < len; ++i) {
+            const unsigned char byte(buf[i]);
+
+            // Whole bytes that neither start nor end a run.
+            if (byte == (inRun ? 0xFF : 0x00)) {
+                bit += 8;
+                continue;
+            }
+
+            for (size_t j = 0; j < 8; ++j, ++bit) {
+                const bool set(byte & (1 << j));
+
+                if (set && !inRun) {
+                    runBegin = bit;
+                    inRun = true;
+
+                } else if (!set && inRun) {
+                    add(runBegin * block, (bit - runBegin) * block);
+                    inRun = false;
+                }
+            }
+        }
+    }
+
+    const bool ok(!ferror(file));
+
+    fclose(file);
+
+    if (!ok) {
+        std::cerr << "Can't read " << path << std::endl;
+        return false;
+    }
+
+    // Blocks past the end of a short bitmap would count as unallocated.
+    const uint64_t blocks(size / block + ((size % block) ? 1 : 0));
+
+    if (bit < blocks) {
+        std::cerr << path << " covers " << bit << " of " << blocks << " block(s)" << std::endl;
+        return false;
+    }
+
+    if (inRun) {
+        add(runBegin * block, (bit - runBegin) * block);
+    }
+
+    return true;
+}
+
+bool LoadAllocationMap(const std::string& spec, const uint64_t size, const size_t chunkSize, TExtentMap& map) {
+    static const std::string extentsPrefix("extents:");
+    static const std::string bitmapPrefix("bitmap:");
+
+    std::string path(spec);
+    uint64_t unit(1);
+    bool bitmap(false);
+
+    for (const std::string& prefix : {extentsPrefix, bitmapPrefix}) {
+        if (spec.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+
+        const size_t colon(spec.find(':', prefix.size()));
+
+        if ((colon == std::string::npos) || !ParseSize(spec.substr(prefix.size(), colon - prefix.size()).c_str(), unit) || (unit == 0)) {
+            std::cerr << "Invalid allocation map: " << spec << std::endl;
+            return false;
+        }
+
+        path = spec.substr(colon + 1);
+        bitmap = (prefix == bitmapPrefix);
+    }
+
+    // A chunk is allocated if any of its bytes is.
+    auto add = [&](const uint64_t begin, const uint64_t length) {
+        if ((begin >= size) || (length == 0)) {
+            return;
+        }
+
+        const uint64_t end(std::min(size, begin + std::min(length, size - begin)));
+
+        map.Add(begin / chunkSize * chunkSize, std::min(size, (end + chunkSize - 1) / chunkSize * chunkSize));
+    };
+
+    if (!(bitmap ? LoadBitmap(path, unit, size, add) : LoadExtentList(path, unit, add))) {
+        return false;
+    }
+
+    map.Finish();
+
+    std::cerr << "Allocation map: " << map.Bytes() << " of " << size << " byte(s) allocated in " << map.Count() << " extent(s)" << std::endl;
+
+    return true;
+}
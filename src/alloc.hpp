@@ -0,0 +1,24 @@
+#pragma once
+
+#include "extents.hpp"
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// Loads an allocation map exported by rbd diff and the like. The spec is
+// one of
+//
+//     /path                  extent list, offsets and lengths in bytes
+//     extents:UNIT:/path     extent list, in UNIT-byte blocks
+//     bitmap:BLOCK:/path     one bit per BLOCK bytes, LSB first
+//
+// An extent list has one "OFFSET LENGTH [TYPE]" line per extent, numbers in
+// decimal or 0x-hex, TYPE one of "data" or "allocated" (the default), or
+// "zero", "hole" or "unallocated" for extents that are skipped. Blank lines,
+// "#" comments and a leading "Offset Length Type" header are allowed, and
+// anything else is an error. A bitmap has to cover the whole target. The
+// file is read as a stream and extents are rounded out to whole chunks and
+// merged as they come, so memory grows with the number of allocated runs,
+// not with the map's size.
+bool LoadAllocationMap(const std::string& spec, const uint64_t size, const size_t chunkSize, TExtentMap& map);
@@ -0,0 +1,134 @@
+#include "badblocks.hpp"
+
+#include <ac-common/utils/htonll.hpp>
+
+#include <algorithm>
+#include <string.h>
+
+bool TBadBlocks::Open(const stdfs::path& path) {
+    Path = path;
+
+    if (!stdfs::exists(Path) || stdfs::is_empty(Path)) {
+        return true;
+    }
+
+    NAC::TFile file(Path.string());
+
+    if (!file || ((file.Size() % (2 * sizeof(uint64_t))) != 0)) {
+        std::cerr << "Can't load " << Path.string() << std::endl;
+        return false;
+    }
+
+    for (size_t pos = 0; pos < file.Size(); pos += 2 * sizeof(uint64_t)) {
+        uint64_t begin;
+        uint64_t size;
+
+        memcpy(&begin, file.Data() + pos, sizeof(begin));
+        memcpy(&size, file.Data() + pos + sizeof(begin), sizeof(size));
+
+        begin = NAC::ntoh(begin);
+        size = NAC::ntoh(size);
+
+        Insert(begin, begin + size);
+    }
+
+    std::cerr << "Skipping " << Extents.size() << " known bad extent(s) from " << Path.string() << std::endl;
+
+    return true;
+}
+
+bool TBadBlocks::Overlaps(const uint64_t begin, const uint64_t end) const {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    if (Extents.empty()) {
+        return false;
+    }
+
+    auto it = Extents.upper_bound(begin);
+
+    if (it != Extents.begin()) {
+        auto prev = it;
+
+        --prev;
+
+        if (prev->second > begin) {
+            return true;
+        }
+    }
+
+    return ((it != Extents.end()) && (it->first < end));
+}
+
+bool TBadBlocks::Add(const uint64_t begin, const uint64_t size) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    if (!File) {
+        if (!stdfs::exists(Path) && !CreateFile(Path.string(), 0, nullptr)) {
+            return false;
+        }
+
+        File.reset(new NAC::TFile(Path.string(), NAC::TFile::ACCESS_WRONLY));
+        File->SeekToEnd();
+    }
+
+    const uint64_t tmp[2] = {NAC::hton(begin), NAC::hton(size)};
+
+    File->Append(sizeof(tmp), (const char*)tmp);
+    File->FSync();
+
+    if (!*File) {
+        std::cerr << "Failed at " << std::to_string(begin) << ": can't save " << Path.string() << std::endl;
+        return false;
+    }
+
+    std::cerr << "Unrecoverable: " << size << " byte(s) at " << begin << std::endl;
+
+    Insert(begin, begin + size);
+    ++NewExtents;
+    NewBytes += size;
+
+    return true;
+}
+
+void TBadBlocks::Skip(const uint64_t size) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    SkippedBytes += size;
+}
+
+void TBadBlocks::Report() const {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    if (Extents.empty()) {
+        return;
+    }
+
+    std::cerr
+        << "Bad blocks: " << NewExtents << " new extent(s), " << NewBytes << " byte(s) found in this run; "
+        << SkippedBytes << " byte(s) skipped; "
+        << Extents.size() << " extent(s) recorded in " << Path.string()
+        << std::endl;
+}
+
+void TBadBlocks::Insert(uint64_t begin, uint64_t end) {
+    auto it = Extents.upper_bound(begin);
+
+    if (it != Extents.begin()) {
+        auto prev = it;
+
+        --prev;
+
+        if (prev->second >= begin) {
+            begin = prev->first;
+            end = std::max(end, prev->second);
+            it = Extents.erase(prev);
+        }
+    }
+
+    while ((it != Extents.end()) && (it->first <= end)) {
+        end = std::max(end, it->second);
+        it = Extents.erase(it);
+    }
+
+    Extents[begin] = end;
+}
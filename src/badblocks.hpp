@@ -0,0 +1,36 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <ac-common/file.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+// Unrecoverable extents of the target, kept in <workdir>/badblocks as
+// big-endian (offset, size) pairs. Every run honours the extents recorded
+// so far, so enc and dec leave exactly the same chunks alone.
+class TBadBlocks {
+public:
+    bool Open(const stdfs::path& path);
+
+    bool Overlaps(const uint64_t begin, const uint64_t end) const;
+    bool Add(const uint64_t begin, const uint64_t size);
+
+    void Skip(const uint64_t size);
+    void Report() const;
+
+private:
+    void Insert(uint64_t begin, uint64_t end);
+
+private:
+    mutable std::mutex Lock;
+    stdfs::path Path;
+    std::map<uint64_t, uint64_t> Extents;
+    std::unique_ptr<NAC::TFile> File;
+    uint64_t NewExtents = 0;
+    uint64_t NewBytes = 0;
+    uint64_t SkippedBytes = 0;
+};
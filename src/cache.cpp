@@ -0,0 +1,132 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+TChunkCache::TChunkCache(const uint64_t capacity, const size_t chunkSize, const size_t shards)
+    : ChunkSize(chunkSize)
+{
+    const uint64_t chunks(capacity / chunkSize);
+
+    if ((chunks == 0) || (shards == 0)) {
+        return;
+    }
+
+    const size_t count(std::min<uint64_t>(shards, chunks));
+
+    for (size_t i = 0; i < count; ++i) {
+        const size_t slots(chunks / count + ((i < (chunks % count)) ? 1 : 0));
+        std::unique_ptr<TShard> shard(new TShard);
+
+        shard->Meta.resize(slots);
+        shard->Data.reset(new char[slots * ChunkSize]);
+        shard->Slots.reserve(slots);
+        Shards.emplace_back(std::move(shard));
+    }
+}
+
+bool TChunkCache::Get(const uint64_t index, char* out, uint64_t& ticket) {
+    if (Shards.empty()) {
+        ++Misses;
+        return false;
+    }
+
+    TShard& shard(ShardOf(index));
+    std::unique_lock<std::mutex> guard(shard.Lock);
+    auto it = shard.Slots.find(index);
+
+    if (it == shard.Slots.end()) {
+        ticket = shard.Generation;
+        ++Misses;
+
+        return false;
+    }
+
+    shard.Meta[it->second].Referenced = true;
+    memcpy(out, shard.Data.get() + it->second * ChunkSize, ChunkSize);
+    ++Hits;
+
+    return true;
+}
+
+void TChunkCache::Put(const uint64_t index, const char* data, const uint64_t ticket) {
+    if (Shards.empty()) {
+        return;
+    }
+
+    TShard& shard(ShardOf(index));
+    std::unique_lock<std::mutex> guard(shard.Lock);
+
+    if ((ticket != shard.Generation) || (shard.Slots.count(index) > 0)) {
+        return;
+    }
+
+    const size_t slot(Evict(shard));
+
+    shard.Meta[slot].Index = index;
+    shard.Meta[slot].Used = true;
+    shard.Meta[slot].Referenced = false;
+    shard.Slots[index] = slot;
+    memcpy(shard.Data.get() + slot * ChunkSize, data, ChunkSize);
+}
+
+void TChunkCache::Invalidate(const uint64_t index) {
+    if (Shards.empty()) {
+        return;
+    }
+
+    TShard& shard(ShardOf(index));
+    std::unique_lock<std::mutex> guard(shard.Lock);
+    auto it = shard.Slots.find(index);
+
+    // Bumped even when the chunk isn't cached, since a reader may be
+    // decrypting it right now.
+    ++shard.Generation;
+
+    if (it == shard.Slots.end()) {
+        return;
+    }
+
+    shard.Meta[it->second].Used = false;
+    shard.Slots.erase(it);
+    ++Invalidations;
+}
+
+size_t TChunkCache::Evict(TShard& shard) {
+    while (true) {
+        TSlot& slot(shard.Meta[shard.Hand]);
+        const size_t pos(shard.Hand);
+
+        shard.Hand = (shard.Hand + 1) % shard.Meta.size();
+
+        if (!slot.Used) {
+            return pos;
+        }
+
+        if (slot.Referenced) {
+            slot.Referenced = false;
+            continue;
+        }
+
+        shard.Slots.erase(slot.Index);
+        slot.Used = false;
+        ++Evictions;
+
+        return pos;
+    }
+}
+
+std::string TChunkCache::Stats() const {
+    size_t slots(0);
+
+    for (const auto& shard : Shards) {
+        slots += shard->Meta.size();
+    }
+
+    return "hits=" + std::to_string(Hits.load())
+        + " misses=" + std::to_string(Misses.load())
+        + " evictions=" + std::to_string(Evictions.load())
+        + " invalidations=" + std::to_string(Invalidations.load())
+        + " chunks=" + std::to_string(slots)
+        + " shards=" + std::to_string(Shards.size());
+}
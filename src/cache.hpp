@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+// Size-bounded cache of decrypted chunks keyed by chunk index. Chunks are
+// spread over shards by index, each with its own lock and CLOCK hand, so
+// that readers of different chunks rarely contend. A zero capacity disables
+// caching but still counts misses.
+class TChunkCache {
+public:
+    TChunkCache(const uint64_t capacity, const size_t chunkSize, const size_t shards);
+
+    TChunkCache(const TChunkCache&) = delete;
+    TChunkCache& operator=(const TChunkCache&) = delete;
+
+    explicit operator bool() const {
+        return !Shards.empty();
+    }
+
+    // Copies the chunk to `out` on a hit. On a miss fills `ticket`, which has
+    // to be handed to Put() so that a chunk decrypted from data that was
+    // overwritten in the meantime is not cached.
+    bool Get(const uint64_t index, char* out, uint64_t& ticket);
+    void Put(const uint64_t index, const char* data, const uint64_t ticket);
+
+    // Must be called before the chunk is written to the target.
+    void Invalidate(const uint64_t index);
+
+    uint64_t GetHits() const {
+        return Hits;
+    }
+
+    uint64_t GetMisses() const {
+        return Misses;
+    }
+
+    std::string Stats() const;
+
+private:
+    struct TSlot {
+        uint64_t Index = 0;
+        bool Used = false;
+        bool Referenced = false;
+    };
+
+    struct TShard {
+        std::mutex Lock;
+        std::unordered_map<uint64_t, size_t> Slots;
+        std::vector<TSlot> Meta;
+        std::unique_ptr<char[]> Data;
+        size_t Hand = 0;
+        uint64_t Generation = 0;
+    };
+
+    TShard& ShardOf(const uint64_t index) {
+        return *Shards[index % Shards.size()];
+    }
+
+    // Called with the shard's lock held.
+    size_t Evict(TShard& shard);
+
+private:
+    const size_t ChunkSize;
+    std::vector<std::unique_ptr<TShard>> Shards;
+
+    std::atomic<uint64_t> Hits{0};
+    std::atomic<uint64_t> Misses{0};
+    std::atomic<uint64_t> Evictions{0};
+    std::atomic<uint64_t> Invalidations{0};
+};
@@ -0,0 +1,234 @@
+#include "cipher.hpp"
+
+#include <ac-common/file.hpp>
+#include <ac-common/utils/htonll.hpp>
+
+#include <openssl/sha.h>
+
+#include <string.h>
+
+TChunkCipher::TChunkCipher(const TMode mode, const TKeyMaterial& keys)
+    : Mode(mode)
+    , IVMode(keys.IVMode)
+{
+    const char* key(keys.Key.data());
+    const char* iv(keys.IV.data());
+
+    Ctx = EVP_CIPHER_CTX_new();
+
+    if (!Ctx) {
+        ERR_print_errors_fp(stderr);
+        return;
+    }
+
+    if (1 != EVPInitWrapper(Mode, Ctx, EVP_aes_256_cbc(), nullptr, (const unsigned char*)key, (const unsigned char*)iv)) {
+        ERR_print_errors_fp(stderr);
+        return;
+    }
+
+    if (1 != EVP_CIPHER_CTX_set_padding(Ctx, 0)) {
+        ERR_print_errors_fp(stderr);
+        return;
+    }
+
+    {
+        const auto detectedBlockSize = EVP_CIPHER_CTX_block_size(Ctx);
+
+        if (detectedBlockSize != BlockSize) {
+            std::cerr << "Detected block size (" << detectedBlockSize << ") is not equal to expected block size (" << BlockSize << ")" << std::endl;
+            return;
+        }
+    }
+
+    if (IVMode == IV_MODE_ESSIV) {
+        unsigned char salt[SHA256_DIGEST_LENGTH];
+
+        {
+            unsigned char material[KeySize + BlockSize];
+
+            memcpy(material, key, KeySize);
+            memcpy(material + KeySize, iv, BlockSize);
+
+            SHA256(material, sizeof(material), salt);
+        }
+
+        EssivCtx = EVP_CIPHER_CTX_new();
+
+        if (!EssivCtx) {
+            ERR_print_errors_fp(stderr);
+            return;
+        }
+
+        if (1 != EVP_EncryptInit_ex(EssivCtx, EVP_aes_256_ecb(), nullptr, salt, nullptr)) {
+            ERR_print_errors_fp(stderr);
+            return;
+        }
+
+        if (1 != EVP_CIPHER_CTX_set_padding(EssivCtx, 0)) {
+            ERR_print_errors_fp(stderr);
+            return;
+        }
+    }
+
+    Ok = true;
+}
+
+TChunkCipher::~TChunkCipher() {
+    if (Ctx) {
+        EVP_CIPHER_CTX_free(Ctx);
+    }
+
+    if (EssivCtx) {
+        EVP_CIPHER_CTX_free(EssivCtx);
+    }
+}
+
+bool TChunkCipher::Process(const uint64_t offset, const size_t size, const char* in, char* out) {
+    if (IVMode == IV_MODE_ESSIV) {
+        unsigned char sector[BlockSize];
+        unsigned char iv[BlockSize];
+        int len(0);
+
+        {
+            const uint64_t tmp(NAC::hton(offset));
+
+            memset(sector, 0, sizeof(sector));
+            memcpy(sector, &tmp, sizeof(tmp));
+        }
+
+        if (1 != EVP_EncryptUpdate(EssivCtx, iv, &len, sector, sizeof(sector))) {
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+
+        if (1 != EVPInitWrapper(Mode, Ctx, nullptr, nullptr, nullptr, iv)) {
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+    }
+
+    int len(0);
+
+    if (1 != EVPUpdateWrapper(Mode, Ctx, (unsigned char*)out, &len, (const unsigned char*)in, size)) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+
+    if (len != size) {
+        std::cerr << "Chunk size mismatch for offset " << offset << ": " << len << " != " << size << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool TChunkCipher::Final(char* out, int& len) {
+    len = 0;
+
+    if (1 != EVPFinalWrapper(Mode, Ctx, (unsigned char*)out, &len)) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+
+    return true;
+}
+
+const char* IVModeName(const TIVMode ivMode) {
+    return ((ivMode == IV_MODE_ESSIV) ? "essiv" : "chain");
+}
+
+bool ParseIVMode(const char* name, TIVMode& ivMode) {
+    if (strcmp(name, "chain") == 0) {
+        ivMode = IV_MODE_CHAIN;
+
+    } else if (strcmp(name, "essiv") == 0) {
+        ivMode = IV_MODE_ESSIV;
+
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool LoadIVMode(const stdfs::path& wd, const TIVMode requested, const bool create, TIVMode& ivMode) {
+    const auto ivModePath = wd / ".ivmode";
+
+    if (create) {
+        ivMode = ((requested == IV_MODE_DEFAULT) ? IV_MODE_CHAIN : requested);
+
+        const std::string name(IVModeName(ivMode));
+
+        return CreateFile(ivModePath.string(), name.size(), name.data());
+    }
+
+    ivMode = IV_MODE_CHAIN;
+
+    if (stdfs::exists(ivModePath)) {
+        NAC::TFile file(ivModePath.string());
+
+        if (!file || !ParseIVMode(std::string(file.Data(), file.Size()).c_str(), ivMode)) {
+            std::cerr << "Can't load " << ivModePath.string() << std::endl;
+            return false;
+        }
+    }
+
+    if ((requested != IV_MODE_DEFAULT) && (requested != ivMode)) {
+        std::cerr << "Workdir uses IV mode " << IVModeName(ivMode) << ", not " << IVModeName(requested) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool LoadKeyMaterial(const stdfs::path& wd, const TMode mode, const TIVMode requested, TKeyMaterial& keys) {
+    const auto ivPath = wd / ".iv";
+    const auto keyPath = wd / ".key";
+    bool created(false);
+
+    if (
+        !stdfs::exists(ivPath)
+        || !stdfs::exists(keyPath)
+    ) {
+        if (mode == MODE_DECRYPT) {
+            std::cerr << "Key and/or iv absent" << std::endl;
+            return false;
+        }
+
+        if (!CreateRandomFile(BlockSize, ivPath.string())) {
+            return false;
+        }
+
+        if (!CreateRandomFile(KeySize, keyPath.string())) {
+            return false;
+        }
+
+        created = true;
+    }
+
+    NAC::TFile iv(ivPath.string());
+    NAC::TFile key(keyPath.string());
+
+    if (!iv || !key || (iv.Size() != BlockSize) || (key.Size() != KeySize)) {
+        std::cerr << "Can't load key and/or iv" << std::endl;
+        return false;
+    }
+
+    keys.Key.assign(key.Data(), key.Size());
+    keys.IV.assign(iv.Data(), iv.Size());
+
+    return LoadIVMode(wd, requested, created, keys.IVMode);
+}
+
+bool MakeScratchKeyMaterial(const stdfs::path& wd, const TIVMode requested, TKeyMaterial& keys) {
+    keys.Key.assign(KeySize, '\x5a');
+    keys.IV.assign(BlockSize, '\xa5');
+
+    if (stdfs::exists(wd / ".ivmode")) {
+        return LoadIVMode(wd, requested, false, keys.IVMode);
+    }
+
+    keys.IVMode = ((requested == IV_MODE_DEFAULT) ? IV_MODE_CHAIN : requested);
+
+    return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <openssl/conf.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+
+#include <string>
+#include <stdint.h>
+
+static const size_t BlockSize(16);
+static const size_t KeySize(32);
+
+enum TIVMode {
+    IV_MODE_CHAIN,
+    IV_MODE_ESSIV,
+
+    IV_MODE_DEFAULT,
+};
+
+template<typename... TArgs>
+int EVPInitWrapper(const TMode mode, TArgs&&... args) {
+    if (mode == MODE_ENCRYPT) {
+        return EVP_EncryptInit_ex(std::forward<TArgs>(args)...);
+
+    } else {
+        return EVP_DecryptInit_ex(std::forward<TArgs>(args)...);
+    }
+}
+
+template<typename... TArgs>
+int EVPUpdateWrapper(const TMode mode, TArgs&&... args) {
+    if (mode == MODE_ENCRYPT) {
+        return EVP_EncryptUpdate(std::forward<TArgs>(args)...);
+
+    } else {
+        return EVP_DecryptUpdate(std::forward<TArgs>(args)...);
+    }
+}
+
+template<typename... TArgs>
+int EVPFinalWrapper(const TMode mode, TArgs&&... args) {
+    if (mode == MODE_ENCRYPT) {
+        return EVP_EncryptFinal_ex(std::forward<TArgs>(args)...);
+
+    } else {
+        return EVP_DecryptFinal_ex(std::forward<TArgs>(args)...);
+    }
+}
+
+// IV_MODE_CHAIN runs the whole target through a single CBC stream, so chunks
+// have to be processed strictly in order by a single context.
+// IV_MODE_ESSIV derives a per-chunk IV from the chunk offset
+// (IV = AES-256-ECB(SHA-256(key || iv), offset)), which makes every chunk
+// independent and lets any number of contexts work on the target at once.
+struct TKeyMaterial {
+    std::string Key;
+    std::string IV;
+    TIVMode IVMode = IV_MODE_CHAIN;
+};
+
+class TChunkCipher {
+public:
+    TChunkCipher(const TMode mode, const TKeyMaterial& keys);
+    ~TChunkCipher();
+
+    TChunkCipher(const TChunkCipher&) = delete;
+    TChunkCipher& operator=(const TChunkCipher&) = delete;
+
+    explicit operator bool() const {
+        return Ok;
+    }
+
+    bool Process(const uint64_t offset, const size_t size, const char* in, char* out);
+    bool Final(char* out, int& len);
+
+private:
+    const TMode Mode;
+    const TIVMode IVMode;
+    EVP_CIPHER_CTX* Ctx = nullptr;
+    EVP_CIPHER_CTX* EssivCtx = nullptr;
+    bool Ok = false;
+};
+
+const char* IVModeName(const TIVMode ivMode);
+bool ParseIVMode(const char* name, TIVMode& ivMode);
+bool LoadKeyMaterial(const stdfs::path& wd, const TMode mode, const TIVMode requested, TKeyMaterial& keys);
+
+// Throwaway keys for dry runs and benchmarks, in the IV mode the workdir
+// would use. Never creates anything.
+bool MakeScratchKeyMaterial(const stdfs::path& wd, const TIVMode requested, TKeyMaterial& keys);
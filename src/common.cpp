@@ -0,0 +1,237 @@
+#include "common.hpp"
+
+#include <ac-common/str.hpp>
+#include <ac-common/utils/htonll.hpp>
+
+#include <random>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+
+bool CreateRandomFile(const size_t size, const std::string& path) {
+    static std::random_device rd;
+    static std::mt19937 g(rd());
+    static std::uniform_int_distribution<unsigned char> dis(0, 255);
+
+    NAC::TBlob content;
+
+    for (size_t i = 0; i < size; ++i) {
+        char chr(dis(g));
+
+        content.Append(1, &chr);
+    }
+
+    return CreateFile(path, content.Size(), content.Data());
+}
+
+TWorkdirLock::~TWorkdirLock() {
+    if (Fd != -1) {
+        close(Fd);
+    }
+}
+
+bool TWorkdirLock::Acquire(const stdfs::path& wd) {
+    const auto path = wd / "lock";
+
+    Fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (Fd == -1) {
+        perror("open");
+        std::cerr << "Can't create " << path.string() << std::endl;
+        return false;
+    }
+
+    if (flock(Fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            std::cerr << "Another run is using " << wd.string() << std::endl;
+
+        } else {
+            perror("flock");
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+void DropCache(const std::string& path) {
+    const int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+
+    if (fd < 0) {
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+TProgress::TProgress(const size_t toProcess)
+    : ToProcess(toProcess)
+    , Processed(0)
+    , PrevProcessed(0)
+    , T0(time(nullptr))
+    , PrevTime(T0)
+{
+}
+
+void TProgress::Add(const size_t size) {
+    static const size_t Step(1 * 1024 * 1024 * 1024);
+
+    const size_t processed(Processed += size);
+
+    // A racy early-out; another worker may have reported a later total
+    // since, so PrevProcessed can be ahead of `processed`.
+    if (processed < (PrevProcessed + Step)) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(Lock, std::try_to_lock);
+
+    if (!guard || (processed < (PrevProcessed + Step))) {
+        return;
+    }
+
+    PrevProcessed = processed;
+
+    const time_t t1(time(nullptr));
+
+    if ((t1 >= PrevTime) && ((t1 - PrevTime) >= 60)) {
+        PrevTime = t1;
+
+        long double left((long double)(ToProcess - processed) / ((long double)processed / (long double)(t1 - T0)));
+        std::string unit("second(s)");
+
+        if (left > 100) {
+            left /= 60;
+            unit = "minute(s)";
+
+            if (left > 90) {
+                left /= 60;
+                unit = "hour(s)";
+
+                if (left > 30) {
+                    left /= 24;
+                    unit = "day(s)";
+                }
+            }
+        }
+
+        std::cerr << left << " " << unit << " left" << std::endl;
+    }
+}
+
+bool FindSparse(const NAC::TFile& sparseFile, const uint64_t offset) {
+    if (!sparseFile) {
+        return false;
+    }
+
+    size_t lo(0);
+    size_t hi(sparseFile.Size() / sizeof(uint64_t));
+
+    while (lo < hi) {
+        const size_t mid((lo + hi) / 2);
+        uint64_t tmp;
+
+        memcpy(&tmp, sparseFile.Data() + mid * sizeof(tmp), sizeof(tmp));
+        tmp = NAC::ntoh(tmp);
+
+        if (tmp < offset) {
+            lo = mid + 1;
+
+        } else if (tmp > offset) {
+            hi = mid;
+
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint64_t Checksum(const char* data, const size_t size, const uint64_t seed) {
+    uint64_t hash(seed ^ 0x9e3779b97f4a7c15ull ^ size);
+    size_t pos(0);
+
+    auto mix = [&hash](const uint64_t word) {
+        hash ^= word * 0x87c37b91114253d5ull;
+        hash = ((hash << 31) | (hash >> 33)) * 0x4cf5ad432745937full;
+    };
+
+    for (; (pos + sizeof(uint64_t)) <= size; pos += sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, data + pos, sizeof(word));
+        mix(word);
+    }
+
+    if (pos < size) {
+        uint64_t word(0);
+
+        memcpy(&word, data + pos, size - pos);
+        mix(word);
+    }
+
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+
+    return hash ^ (hash >> 31);
+}
+
+bool ParseSize(const char* str, uint64_t& out) {
+    char* end(nullptr);
+
+    errno = 0;
+    out = strtoull(str, &end, 10);
+
+    if ((errno != 0) || (end == str)) {
+        return false;
+    }
+
+    switch (*end) {
+        case '\0':
+            return true;
+
+        case 'T':
+        case 't':
+            out *= 1024;
+            [[fallthrough]];
+
+        case 'G':
+        case 'g':
+            out *= 1024;
+            [[fallthrough]];
+
+        case 'M':
+        case 'm':
+            out *= 1024;
+            [[fallthrough]];
+
+        case 'K':
+        case 'k':
+            out *= 1024;
+            break;
+
+        default:
+            return false;
+    }
+
+    return (end[1] == '\0');
+}
+
+void RunThreads(const size_t count, const std::function<void(size_t)>& worker) {
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < count; ++i) {
+        threads.emplace_back(worker, i);
+    }
+
+    for (auto& it : threads) {
+        it.join();
+    }
+}
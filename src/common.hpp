@@ -0,0 +1,125 @@
+#pragma once
+
+#include <ac-common/file.hpp>
+
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef RELEASE_FILESYSTEM
+#include <filesystem>
+
+namespace stdfs = std::filesystem;
+
+#else
+#include <experimental/filesystem>
+
+namespace stdfs = std::experimental::filesystem;
+#endif
+
+enum TMode {
+    MODE_ENCRYPT,
+    MODE_DECRYPT,
+
+    MODE_DEFAULT,
+};
+
+// Workdir files are written once and rarely read back; drop their clean
+// pages so that they don't evict useful data on shared hosts.
+void DropCache(const std::string& path);
+
+template<typename TWriter>
+bool CreateFileWith(const std::string& path, TWriter&& writer) {
+    const std::string tmpPath(path + ".tmp.XXXXXXXXXX");
+
+    NAC::TFile file(tmpPath, NAC::TFile::ACCESS_TMP);
+
+    if (!file) {
+        std::cerr << "Can't create " << path << std::endl;
+        return false;
+    }
+
+    if (!writer(file)) {
+        unlink(file.Path().c_str());
+        std::cerr << "Can't create " << path << std::endl;
+        return false;
+    }
+
+    file.FSync();
+
+    if (!file) {
+        std::cerr << "Can't create " << path << std::endl;
+        return false;
+    }
+
+    DropCache(file.Path());
+
+    if (rename(file.Path().c_str(), path.c_str()) != 0) {
+        perror("rename");
+        std::cerr << "Can't create " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+template<typename... TArgs>
+bool CreateFile(const std::string& path, TArgs&&... args) {
+    return CreateFileWith(path, [&](NAC::TFile& file) {
+        file.Append(std::forward<TArgs>(args)...);
+
+        return (bool)file;
+    });
+}
+
+bool CreateRandomFile(const size_t size, const std::string& path);
+
+class TProgress {
+public:
+    explicit TProgress(const size_t toProcess);
+
+    void Add(const size_t size);
+
+private:
+    const size_t ToProcess;
+    std::atomic<size_t> Processed;
+    std::atomic<size_t> PrevProcessed;
+    const time_t T0;
+    time_t PrevTime;
+    std::mutex Lock;
+};
+
+// An exclusive flock() on a file in the workdir, held until destruction, so
+// that only one run at a time touches the workdir's state.
+class TWorkdirLock {
+public:
+    TWorkdirLock() = default;
+    ~TWorkdirLock();
+
+    TWorkdirLock(const TWorkdirLock&) = delete;
+    TWorkdirLock& operator=(const TWorkdirLock&) = delete;
+
+    bool Acquire(const stdfs::path& wd);
+
+private:
+    int Fd = -1;
+};
+
+// The sparse file is a sorted list of big-endian chunk offsets.
+bool FindSparse(const NAC::TFile& sparseFile, const uint64_t offset);
+
+// Fast non-cryptographic checksum, for telling torn or stale metadata writes
+// from good ones.
+uint64_t Checksum(const char* data, const size_t size, const uint64_t seed = 0);
+
+// Accepts plain byte counts as well as K, M, G and T (binary) suffixes.
+bool ParseSize(const char* str, uint64_t& out);
+
+void RunThreads(const size_t count, const std::function<void(size_t)>& worker);
@@ -0,0 +1,221 @@
+#include "control.hpp"
+
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const size_t ControlLineMax(4096);
+
+TControlServer::~TControlServer() {
+    Stop();
+}
+
+bool TControlServer::Start(const stdfs::path& path, THandler handler) {
+    sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.string().size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Control socket path is too long: " << path.string() << std::endl;
+        return false;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+
+    Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (Fd == -1) {
+        perror("socket");
+        return false;
+    }
+
+    // A socket left behind by a killed run has nobody listening on it; one
+    // that answers belongs to another run on the same workdir.
+    if (connect(Fd, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+        std::cerr << "Another run is listening on " << path.string() << std::endl;
+        return false;
+
+    } else if (errno == ECONNREFUSED) {
+        unlink(path.c_str());
+    }
+
+    close(Fd);
+    Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (Fd == -1) {
+        perror("socket");
+        return false;
+    }
+
+    // The socket is created owner-only, rather than chmod()ed after the
+    // fact. The umask is process-wide, but nothing else creates files at
+    // this point of the run.
+    const mode_t mask(umask(0177));
+    const int rv(bind(Fd, (const sockaddr*)&addr, sizeof(addr)));
+
+    umask(mask);
+
+    if (rv != 0) {
+        perror("bind");
+        std::cerr << "Can't create " << path.string() << std::endl;
+        return false;
+    }
+
+    Path = path;
+
+    if ((listen(Fd, 4) != 0) || (pipe2(StopPipe, O_CLOEXEC) != 0)) {
+        perror("listen");
+        return false;
+    }
+
+    Handler = std::move(handler);
+    Thread = std::thread([this]() {
+        Loop();
+    });
+
+    return true;
+}
+
+void TControlServer::Stop() {
+    if (Thread.joinable()) {
+        const char chr(0);
+
+        if (write(StopPipe[1], &chr, sizeof(chr)) != sizeof(chr)) {
+            perror("write");
+        }
+
+        Thread.join();
+    }
+
+    auto closeFd = [](int& fd) {
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    };
+
+    closeFd(Fd);
+    closeFd(StopPipe[0]);
+    closeFd(StopPipe[1]);
+
+    if (!Path.empty()) {
+        unlink(Path.c_str());
+        Path.clear();
+    }
+}
+
+void TControlServer::Loop() {
+    while (true) {
+        pollfd fds[2] = {{Fd, POLLIN, 0}, {StopPipe[0], POLLIN, 0}};
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            return;
+        }
+
+        if (fds[1].revents) {
+            return;
+        }
+
+        const int client(accept4(Fd, nullptr, nullptr, SOCK_CLOEXEC));
+
+        if (client == -1) {
+            continue;
+        }
+
+        Serve(client);
+        close(client);
+    }
+}
+
+void TControlServer::Serve(const int fd) {
+    std::string buf;
+
+    while (true) {
+        pollfd fds[2] = {{fd, POLLIN, 0}, {StopPipe[0], POLLIN, 0}};
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        if (fds[1].revents) {
+            return;
+        }
+
+        char chunk[512];
+        const ssize_t rv(read(fd, chunk, sizeof(chunk)));
+
+        if (rv <= 0) {
+            return;
+        }
+
+        buf.append(chunk, rv);
+
+        size_t pos;
+
+        while ((pos = buf.find('\n')) != std::string::npos) {
+            std::string line(buf, 0, pos);
+
+            buf.erase(0, pos + 1);
+
+            if (!line.empty() && (line.back() == '\r')) {
+                line.pop_back();
+            }
+
+            const std::string reply(Handler(line) + "\n");
+
+            if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) != (ssize_t)reply.size()) {
+                return;
+            }
+        }
+
+        if (buf.size() > ControlLineMax) {
+            return;
+        }
+    }
+}
+
+void ParseControlCommand(const std::string& line, std::string& command, std::string& arg) {
+    const size_t begin(line.find_first_not_of(' '));
+
+    command.clear();
+    arg.clear();
+
+    if (begin == std::string::npos) {
+        return;
+    }
+
+    const size_t end(line.find(' ', begin));
+
+    if (end == std::string::npos) {
+        command = line.substr(begin);
+        return;
+    }
+
+    command = line.substr(begin, end - begin);
+
+    const size_t argBegin(line.find_first_not_of(' ', end));
+
+    if (argBegin != std::string::npos) {
+        arg = line.substr(argBegin);
+
+        while (!arg.empty() && (arg.back() == ' ')) {
+            arg.pop_back();
+        }
+    }
+}
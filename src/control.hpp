@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <functional>
+#include <string>
+#include <thread>
+
+// Serves a line-based protocol on a unix socket: every request line gets
+// exactly one reply line from the handler. Clients are served one at a time,
+// e.g. with `socat - UNIX-CONNECT:/path/to/workdir/control.sock`.
+class TControlServer {
+public:
+    using THandler = std::function<std::string(const std::string&)>;
+
+    TControlServer() = default;
+    ~TControlServer();
+
+    bool Start(const stdfs::path& path, THandler handler);
+    void Stop();
+
+private:
+    void Loop();
+    void Serve(const int fd);
+
+private:
+    stdfs::path Path;
+    THandler Handler;
+    int Fd = -1;
+    int StopPipe[2] = {-1, -1};
+    std::thread Thread;
+};
+
+// Splits a control request into a command and its argument.
+void ParseControlCommand(const std::string& line, std::string& command, std::string& arg);
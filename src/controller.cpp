@@ -0,0 +1,145 @@
+#include "controller.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+static const std::chrono::seconds ControllerInterval(2);
+static const size_t ControllerProbeInterval(5);
+
+TConcurrencyController::TConcurrencyController(const size_t min, const size_t max, const size_t initial, const bool adaptive)
+    : Min(min)
+    , Max(max)
+    , Limit(std::min(max, std::max(min, initial)))
+    , Adaptive(adaptive)
+{
+}
+
+TConcurrencyController::~TConcurrencyController() {
+    Stop();
+}
+
+void TConcurrencyController::Acquire() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    Changed.wait(guard, [this]() {
+        return (Active < Limit);
+    });
+
+    ++Active;
+}
+
+void TConcurrencyController::Release(const uint64_t size, const std::chrono::steady_clock::duration latency) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    --Active;
+
+    if (size > 0) {
+        Bytes += size;
+        ++Batches;
+        Latency += latency;
+    }
+
+    Changed.notify_all();
+}
+
+void TConcurrencyController::Start() {
+    if (Adaptive) {
+        Thread = std::thread([this]() {
+            Loop();
+        });
+    }
+}
+
+void TConcurrencyController::Stop() {
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        Stopped = true;
+        Changed.notify_all();
+    }
+
+    if (Thread.joinable()) {
+        Thread.join();
+    }
+}
+
+size_t TConcurrencyController::GetLimit() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    return Limit;
+}
+
+void TConcurrencyController::SetLimit(const size_t limit) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    // Without --adaptive the bounds are both -t, and any limit up to it
+    // goes; with it, overrides stay within the user's bounds.
+    Limit = std::min(Max, std::max<size_t>((Adaptive ? Min : 1), limit));
+    Changed.notify_all();
+}
+
+void TConcurrencyController::Loop() {
+    auto prev = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> guard(Lock);
+
+    while (!Changed.wait_for(guard, ControllerInterval, [this]() { return Stopped; })) {
+        const auto now = std::chrono::steady_clock::now();
+        const double seconds(std::chrono::duration<double>(now - prev).count());
+
+        prev = now;
+
+        if (Batches == 0) {
+            continue;
+        }
+
+        const double throughput(Bytes / seconds);
+        const double latency(std::chrono::duration<double, std::milli>(Latency).count() / Batches);
+
+        Bytes = 0;
+        Batches = 0;
+        Latency = std::chrono::steady_clock::duration::zero();
+
+        Adjust(throughput, latency);
+    }
+}
+
+void TConcurrencyController::Adjust(const double throughput, const double latency) {
+    const size_t prevLimit(Limit);
+    const char* reason("hold");
+
+    // Once the target is saturated, batch latency grows linearly with the
+    // number of batches in flight; per-slot latency growing past that means
+    // the target is thrashing (e.g. seek storms on rotating disks).
+    const double slotLatency(latency / Limit);
+
+    if ((MinLatency == 0) || (slotLatency < MinLatency)) {
+        MinLatency = slotLatency;
+    }
+
+    if (throughput > (PrevThroughput * 1.05)) {
+        Limit = std::min(Max, Limit + 1);
+        reason = "throughput up";
+        Holds = 0;
+
+    } else if ((throughput < (PrevThroughput * 0.9)) || (slotLatency > (MinLatency * 2))) {
+        Limit = std::max(Min, Limit - std::max<size_t>(1, Limit / 4));
+        reason = "throughput down";
+        Holds = 0;
+
+    } else if (++Holds >= ControllerProbeInterval) {
+        Limit = std::min(Max, Limit + 1);
+        reason = "probe";
+        Holds = 0;
+    }
+
+    PrevThroughput = throughput;
+
+    if (Limit != prevLimit) {
+        std::cerr
+            << "Concurrency " << prevLimit << " -> " << Limit << " (" << reason << "): "
+            << (throughput / (1024 * 1024)) << " MiB/s, " << latency << " ms per batch"
+            << std::endl;
+
+        Changed.notify_all();
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+
+// Limits how many workers carry a batch at once. Each worker reads, converts
+// and writes its batch itself, so this is both the number of in-flight I/Os
+// and the number of active cipher workers.
+//
+// When adaptive, the limit is steered AIMD-style: it grows by one while
+// throughput keeps improving, is cut by a quarter once throughput drops or
+// batch latency balloons without a throughput gain, and otherwise holds at
+// the knee, probing upwards now and then. Decisions are logged to stderr.
+class TConcurrencyController {
+public:
+    TConcurrencyController(const size_t min, const size_t max, const size_t initial, const bool adaptive);
+    ~TConcurrencyController();
+
+    void Acquire();
+    void Release(const uint64_t size, const std::chrono::steady_clock::duration latency);
+
+    void Start();
+    void Stop();
+
+    size_t GetLimit();
+    void SetLimit(const size_t limit);
+
+private:
+    void Loop();
+    void Adjust(const double throughput, const double latency);
+
+private:
+    std::mutex Lock;
+    std::condition_variable Changed;
+    const size_t Min;
+    const size_t Max;
+    size_t Limit;
+    size_t Active = 0;
+    const bool Adaptive;
+    bool Stopped = false;
+    std::thread Thread;
+
+    uint64_t Bytes = 0;
+    uint64_t Batches = 0;
+    std::chrono::steady_clock::duration Latency = std::chrono::steady_clock::duration::zero();
+
+    double PrevThroughput = 0;
+    double MinLatency = 0;
+    size_t Holds = 0;
+};
@@ -0,0 +1,2088 @@
+#include "convert.hpp"
+#include "affinity.hpp"
+#include "alloc.hpp"
+#include "badblocks.hpp"
+#include "control.hpp"
+#include "controller.hpp"
+#include "device.hpp"
+#include "extents.hpp"
+#include "partitions.hpp"
+#include "perf.hpp"
+#include "probes.hpp"
+#include "qcow2.hpp"
+#include "ratelimit.hpp"
+#include "schedule.hpp"
+#include "signals.hpp"
+#include "state.hpp"
+#include "trace.hpp"
+#include "verify.hpp"
+
+#include <ac-common/file.hpp>
+#include <ac-common/utils/htonll.hpp>
+#include <ac-common/utils/string.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace {
+    static const size_t SectorRetries(3);
+
+    // Consecutive batches a worker claims into its own deque at once.
+    static const size_t StealGrain(4);
+
+    // Batches are about 1 MiB, on the chunk grid.
+    size_t BatchSizeFor(const size_t chunkSize) {
+        return (std::max<size_t>(1, (1 << 20) / chunkSize) * chunkSize);
+    }
+
+    struct TBatch {
+        uint64_t Begin = 0;
+        uint64_t End = 0;
+        std::vector<uint64_t> Zeroes;
+        std::vector<uint64_t> Journal;
+        bool Cloned = false;
+    };
+
+    class TRangeState;
+
+    // A claimed batch waiting in a worker's deque.
+    struct TQueued {
+        TRangeState* Range = nullptr;
+        TBatch Batch;
+    };
+
+    struct TPrefetched {
+        TAlignedBuffer Buffer;
+        bool Ready = false;
+        bool Ok = false;
+    };
+
+    class TScratchDir {
+    public:
+        ~TScratchDir() {
+            if (!Path_.empty()) {
+                std::error_code ec;
+
+                stdfs::remove_all(Path_, ec);
+            }
+        }
+
+        bool Create(const stdfs::path& parent) {
+            std::string path((parent / ".bench.XXXXXX").string());
+
+            if (!mkdtemp(&path[0])) {
+                perror("mkdtemp");
+                std::cerr << "Can't create scratch directory in " << parent.string() << std::endl;
+                return false;
+            }
+
+            Path_ = path;
+
+            return true;
+        }
+
+        const stdfs::path& Path() const {
+            return Path_;
+        }
+
+    private:
+        stdfs::path Path_;
+    };
+
+    // Batches of a range complete out of order. The persisted offset is the
+    // watermark below which every batch is complete, and journal files are
+    // kept until the watermark passes them, so that a restart replays every
+    // chunk that might have been written but is not yet covered by the offset.
+    class TRangeState {
+    public:
+        TRangeState(const TRange& range, const TOptions& options, const TKeyMaterial& keys, TTargetState* target)
+            : Range(range)
+            , Options(options)
+            , Keys(keys)
+            , Target(target)
+            , ModeName((options.Mode == MODE_ENCRYPT) ? "enc" : "dec")
+        {
+        }
+
+        bool Open() {
+            std::error_code ec;
+
+            stdfs::create_directories(Range.StateDir, ec);
+
+            if (ec) {
+                std::cerr << "Can't create " << Range.StateDir.string() << ": " << ec.message() << std::endl;
+                return false;
+            }
+
+            uint64_t offset(Range.Begin);
+            const auto offsetPath = Range.StateDir / (ModeName + "_offset");
+
+            if (Target) {
+                offset = Target->GetOffset(Options.Mode);
+
+            } else {
+                if (!stdfs::exists(offsetPath)) {
+                    uint64_t tmp(NAC::hton(offset));
+
+                    if (!CreateFile(offsetPath.string(), sizeof(tmp), (const char*)&tmp)) {
+                        return false;
+                    }
+                }
+
+                OffsetFile.reset(new NAC::TFile(offsetPath.string(), NAC::TFile::ACCESS_RDWR));
+
+                if (!*OffsetFile || (OffsetFile->Size() != sizeof(offset))) {
+                    std::cerr << "Can't load offset file" << std::endl;
+                    return false;
+                }
+
+                memcpy(&offset, OffsetFile->Data(), OffsetFile->Size());
+                offset = NAC::ntoh(offset);
+            }
+
+            if ((offset < Range.Begin) || (((offset - Range.Begin) % Options.ChunkSize) != 0)) {
+                std::cerr << "Invalid offset " << offset << " in " << (Target ? "state area" : offsetPath.string()) << std::endl;
+                return false;
+            }
+
+            Cursor = Watermark = std::min(offset, Range.End);
+
+            if (Done()) {
+                return true;
+            }
+
+            if (Target) {
+                return OpenCipher();
+            }
+
+            const auto sparsePath = Range.StateDir / "enc_sparse";
+
+            if (!stdfs::exists(sparsePath)) {
+                if (!CreateFile(sparsePath.string(), 0, nullptr)) {
+                    return false;
+                }
+            }
+
+            SparseFile.reset(new NAC::TFile(sparsePath.string(), ((Options.Mode == MODE_ENCRYPT) ? NAC::TFile::ACCESS_WRONLY : NAC::TFile::ACCESS_RDONLY)));
+
+            if (!*SparseFile && ((Options.Mode == MODE_ENCRYPT) || (stdfs::exists(sparsePath) && !stdfs::is_empty(sparsePath)))) {
+                std::cerr << "Can't load sparse file" << std::endl;
+                return false;
+            }
+
+            if (Options.Mode == MODE_ENCRYPT) {
+                SparseFile->SeekToEnd();
+            }
+
+            return OpenCipher();
+        }
+
+        bool Done() const {
+            return (Watermark >= Range.End);
+        }
+
+        uint64_t Left() const {
+            return (Range.End - Watermark);
+        }
+
+        const TRange& GetRange() const {
+            return Range;
+        }
+
+        // Chained ranges share one cipher context, so only one of their
+        // batches may be queued or in flight at a time.
+        bool Claimable() const {
+            return ((Cursor < Range.End) && ((Cursor - Watermark) < Window) && (!Cipher || ((Queued + InFlight) == 0)));
+        }
+
+        // Completed batches keep their journal slot on the target until the
+        // watermark passes them, so claims may run at most a ring ahead of
+        // it; otherwise the batch that advances it could wait for a slot
+        // forever.
+        void SetWindow(const uint64_t window) {
+            Window = window;
+        }
+
+        size_t GetInFlight() const {
+            return InFlight;
+        }
+
+        // Claimed batches, whether still queued or being processed.
+        size_t GetPending() const {
+            return (Queued + InFlight);
+        }
+
+        bool Exhausted() const {
+            return (Cursor >= Range.End);
+        }
+
+        // Next batch for the prefetcher; it stays on the same grid as Claim().
+        bool PrefetchNext(const uint64_t size, uint64_t& begin, uint64_t& end) {
+            Ahead = std::max(Ahead, Cursor);
+
+            if (Ahead >= Range.End) {
+                return false;
+            }
+
+            begin = Ahead;
+            end = std::min(Range.End, Ahead + size);
+            Ahead = end;
+
+            return true;
+        }
+
+        bool CanPrefetch() const {
+            return (std::max(Ahead, Cursor) < Range.End);
+        }
+
+        uint64_t Lookahead() const {
+            return (std::max(Ahead, Cursor) - Cursor);
+        }
+
+        TBatch Claim(const uint64_t size) {
+            TBatch batch;
+
+            batch.Begin = Cursor;
+            batch.End = std::min(Range.End, Cursor + size);
+
+            Cursor = batch.End;
+            ++Queued;
+
+            return batch;
+        }
+
+        // A queued batch is taken by a worker.
+        void Start() {
+            --Queued;
+            ++InFlight;
+        }
+
+        void Release() {
+            --InFlight;
+        }
+
+        TChunkCipher* GetCipher() const {
+            return Cipher.get();
+        }
+
+        stdfs::path JournalPath(const uint64_t offset) const {
+            return Range.StateDir / (ModeName + "_chunk-" + std::to_string(offset));
+        }
+
+        // A journal file is the converted chunk followed by a big-endian
+        // checksum of it, seeded with the offset; older files have no
+        // checksum.
+        bool WriteJournal(const uint64_t offset, const char* block) const {
+            const uint64_t sum(NAC::hton(Checksum(block, Options.ChunkSize, offset)));
+
+            return CreateFileWith(JournalPath(offset).string(), [&](NAC::TFile& file) {
+                file.Append(Options.ChunkSize, block);
+                file.Append(sizeof(sum), (const char*)&sum);
+
+                return (bool)file;
+            });
+        }
+
+        bool LoadJournal(const uint64_t offset, char* block) const {
+            const auto path = JournalPath(offset);
+            const size_t size(Options.ChunkSize);
+            NAC::TFile file(path.string());
+
+            if (!file || ((file.Size() != size) && (file.Size() != (size + sizeof(uint64_t))))) {
+                std::cerr << "Can't load " << path.string() << std::endl;
+                return false;
+            }
+
+            if (file.Size() > size) {
+                uint64_t sum(0);
+
+                memcpy(&sum, file.Data() + size, sizeof(sum));
+
+                if (NAC::ntoh(sum) != Checksum(file.Data(), size, offset)) {
+                    std::cerr << "Checksum mismatch in " << path.string() << std::endl;
+                    return false;
+                }
+            }
+
+            memcpy(block, file.Data(), size);
+
+            return true;
+        }
+
+        // Finds every journaled chunk in one pass over the state directory.
+        // Journal files below the watermark belong to batches whose offset
+        // was saved just before a crash, and are removed.
+        void ScanJournal() {
+            const std::string prefix(ModeName + "_chunk-");
+
+            for (const auto& entry : stdfs::directory_iterator(Range.StateDir)) {
+                const std::string name(entry.path().filename().string());
+
+                if (name.compare(0, prefix.size(), prefix) != 0) {
+                    continue;
+                }
+
+                // Half-written files; the ".final" tail of a chain stays.
+                if (name.find('.') != std::string::npos) {
+                    if (name.find(".tmp.") != std::string::npos) {
+                        unlink(entry.path().c_str());
+                    }
+
+                    continue;
+                }
+
+                uint64_t offset(0);
+
+                NAC::NStringUtils::FromString(name.size() - prefix.size(), name.data() + prefix.size(), offset);
+
+                if (offset < Watermark) {
+                    if (unlink(entry.path().c_str()) != 0) {
+                        perror("unlink");
+                    }
+
+                } else if (offset < Range.End) {
+                    Recovered.push_back(offset);
+                }
+            }
+
+            std::sort(Recovered.begin(), Recovered.end());
+        }
+
+        const std::vector<uint64_t>& GetRecovered() const {
+            return Recovered;
+        }
+
+        // The chunk was replayed from the journal at startup.
+        bool IsRecovered(const uint64_t offset) const {
+            return std::binary_search(Recovered.begin(), Recovered.end(), offset);
+        }
+
+        // Reflink of a batch's data as it was before the batch was written.
+        stdfs::path ClonePath(const uint64_t offset) const {
+            return Range.StateDir / (ModeName + "_clone-" + std::to_string(offset));
+        }
+
+        // Puts back the old data of every batch that may have been partly
+        // written, so that it is converted again from scratch. Clones below
+        // the watermark are leftovers of completed batches.
+        bool RecoverClones(const TDevice& dev) {
+            const std::string prefix(ModeName + "_clone-");
+            std::vector<std::pair<uint64_t, stdfs::path>> clones;
+
+            for (const auto& entry : stdfs::directory_iterator(Range.StateDir)) {
+                const std::string name(entry.path().filename().string());
+
+                if (name.compare(0, prefix.size(), prefix) != 0) {
+                    continue;
+                }
+
+                if (name.find('.') != std::string::npos) {
+                    unlink(entry.path().c_str());
+                    continue;
+                }
+
+                uint64_t offset(0);
+
+                NAC::NStringUtils::FromString(name.size() - prefix.size(), name.data() + prefix.size(), offset);
+                clones.emplace_back(offset, entry.path());
+            }
+
+            size_t restored(0);
+
+            for (const auto& it : clones) {
+                if (it.first >= Watermark) {
+                    TDevice clone(it.second.string(), O_RDONLY);
+
+                    if (!clone || !RestoreClone(dev, clone, it.first)) {
+                        std::cerr << "Can't restore " << it.second.string() << std::endl;
+                        return false;
+                    }
+
+                    ++restored;
+                }
+            }
+
+            if ((restored > 0) && !dev.FSync()) {
+                std::cerr << "Can't sync file" << std::endl;
+                return false;
+            }
+
+            for (const auto& it : clones) {
+                if (unlink(it.second.c_str()) != 0) {
+                    perror("unlink");
+                }
+            }
+
+            if (restored > 0) {
+                std::cerr << Range.Name << ": restored " << restored << " batch(es) from reflinks" << std::endl;
+            }
+
+            return true;
+        }
+
+        bool IsSparse(const uint64_t offset) const {
+            if (Target) {
+                return Target->IsSparse(offset);
+            }
+
+            return (SparseFile && FindSparse(*SparseFile, offset));
+        }
+
+        bool Commit(TBatch&& batch) {
+            std::unique_lock<std::mutex> guard(CommitLock);
+            const uint64_t prevWatermark(Watermark);
+            std::vector<uint64_t> journal;
+            std::vector<uint64_t> clones;
+            std::vector<uint64_t> zeroes;
+            bool appended(false);
+            bool advanced(false);
+
+            Completed[batch.Begin] = std::move(batch);
+
+            while (!Completed.empty() && (Completed.begin()->first == Watermark)) {
+                auto& it = Completed.begin()->second;
+
+                if (Target) {
+                    zeroes.insert(zeroes.end(), it.Zeroes.begin(), it.Zeroes.end());
+
+                } else if (Options.Mode == MODE_ENCRYPT) {
+                    for (const uint64_t offset : it.Zeroes) {
+                        uint64_t tmp(NAC::hton(offset));
+
+                        SparseFile->Append(sizeof(tmp), (const char*)&tmp);
+                        appended = true;
+                    }
+                }
+
+                journal.insert(journal.end(), it.Journal.begin(), it.Journal.end());
+
+                if (it.Cloned) {
+                    clones.push_back(it.Begin);
+                }
+
+                Watermark = it.End;
+                Completed.erase(Completed.begin());
+                advanced = true;
+            }
+
+            if (!advanced) {
+                return true;
+            }
+
+            // Journal slots on the target are reused once a flushed header
+            // covers them, so there is nothing to clean up.
+            if (Target) {
+                if (!Target->Commit(Options.Mode, Watermark, zeroes)) {
+                    return false;
+                }
+
+                BDENC_PROBE(offset, prevWatermark, Watermark - prevWatermark);
+
+                return ((Done() && Cipher) ? Finish() : true);
+            }
+
+            if (appended) {
+                SparseFile->FSync();
+
+                if (!*SparseFile) {
+                    std::cerr << "Failed at " << std::to_string(Watermark) << ": can't save sparse file" << std::endl;
+                    return false;
+                }
+
+                DropCache(SparseFile->Path());
+            }
+
+            {
+                uint64_t tmp(NAC::hton(Watermark));
+
+                OffsetFile->Write(0, sizeof(tmp), (const char*)&tmp);
+                OffsetFile->FSync();
+
+                if (!*OffsetFile) {
+                    std::cerr << "Failed at " << std::to_string(Watermark) << ": can't save offset" << std::endl;
+                    return false;
+                }
+
+                BDENC_PROBE(offset, prevWatermark, Watermark - prevWatermark);
+            }
+
+            for (const uint64_t offset : journal) {
+                if (unlink(JournalPath(offset).c_str()) != 0) {
+                    perror("unlink");
+                }
+            }
+
+            for (const uint64_t offset : clones) {
+                if (unlink(ClonePath(offset).c_str()) != 0) {
+                    perror("unlink");
+                }
+            }
+
+            if (Done() && Cipher) {
+                return Finish();
+            }
+
+            return true;
+        }
+
+    private:
+        bool OpenCipher() {
+            if (Keys.IVMode == IV_MODE_CHAIN) {
+                Cipher.reset(new TChunkCipher(Options.Mode, Keys));
+
+                if (!*Cipher) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        static bool RestoreClone(const TDevice& dev, const TDevice& clone, const uint64_t offset) {
+            if (dev.CloneRange(clone, 0, clone.Size(), offset)) {
+                return true;
+            }
+
+            TAlignedBuffer buf(clone.Size(), std::max<size_t>(4096, dev.SectorSize()));
+
+            return (buf && clone.Read(0, clone.Size(), buf.Data()) && dev.Write(offset, clone.Size(), buf.Data()));
+        }
+
+        bool Finish() {
+            NAC::TBlob block;
+            int len(0);
+
+            block.Reserve(Options.ChunkSize);
+
+            if (!Cipher->Final(block.Data(), len)) {
+                return false;
+            }
+
+            if (len > 0) {
+                const auto tmpPath = Range.StateDir / (ModeName + "_chunk-" + std::to_string(Range.End) + ".final");
+
+                if (!CreateFile(tmpPath.string(), len, block.Data())) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        const TRange Range;
+        const TOptions& Options;
+        const TKeyMaterial& Keys;
+        TTargetState* Target;
+        const std::string ModeName;
+        std::unique_ptr<NAC::TFile> OffsetFile;
+        std::unique_ptr<NAC::TFile> SparseFile;
+        std::unique_ptr<TChunkCipher> Cipher;
+        uint64_t Cursor = 0;
+        uint64_t Ahead = 0;
+        std::atomic<uint64_t> Watermark{0};
+        uint64_t Window = UINT64_MAX;
+        size_t Queued = 0;
+        size_t InFlight = 0;
+        std::mutex CommitLock;
+        std::map<uint64_t, TBatch> Completed;
+        std::vector<uint64_t> Recovered;
+    };
+
+    class TConverter {
+    public:
+        TConverter(const TOptions& options, const stdfs::path& root, const TKeyMaterial& keys, const TDevice& dev, const TMapping* map, TTargetState* target, const TExtentMap* selected, const TExtentMap* allocated, TAffinity& affinity, TBadBlocks& badBlocks)
+            : Options(options)
+            , Root(root)
+            , Keys(keys)
+            , Dev(dev)
+            , Map(map)
+            , Target(target)
+            , Selected(selected)
+            , Allocated(allocated)
+            , Affinity(affinity)
+            , BadBlocks(badBlocks)
+            , ChunkSize(options.ChunkSize)
+            , BatchSize(BatchSizeFor(options.ChunkSize))
+            , Limiter(options.Rate)
+            , Controller(options.MinThreads, options.Threads, options.InitialThreads, options.Adaptive)
+            , Verifier(options.Mode, keys, dev, &badBlocks, options.ChunkSize, (options.DryRun ? 0 : options.VerifySample), [this]() {
+                std::unique_lock<std::mutex> guard(Lock);
+
+                Failed = true;
+                CanClaim.notify_all();
+                PrefetchChanged.notify_all();
+            })
+            , Depth(map ? 0 : options.Readahead)
+            , Queues(options.Threads)
+        {
+            for (size_t i = 0; i < Depth; ++i) {
+                FreeBuffers.emplace_back(BatchSize);
+            }
+
+            Buffers = Depth;
+        }
+
+        bool AddRange(const TRange& range) {
+            std::unique_ptr<TRangeState> state(new TRangeState(range, Options, Keys, Target));
+
+            if (!state->Open() || !state->RecoverClones(Dev)) {
+                return false;
+            }
+
+            if (Target) {
+                state->SetWindow(Target->JournalSlots() * BatchSize);
+            }
+
+            if (state->Done()) {
+                if (!Options.Partitions.empty()) {
+                    std::cerr << range.Name << ": already done" << std::endl;
+                }
+
+                return true;
+            }
+
+            Ranges.emplace_back(std::move(state));
+
+            return true;
+        }
+
+        bool Empty() const {
+            return Ranges.empty();
+        }
+
+        void SetSchedule(TSchedule* schedule) {
+            Schedule = schedule;
+        }
+
+        bool Run() {
+            ToProcess = 0;
+
+            for (const auto& range : Ranges) {
+                ToProcess += range->Left();
+            }
+
+            Progress.reset(new TProgress(ToProcess));
+
+            // Blocks SIGINT and SIGTERM, so it has to come before the
+            // tracer and every other thread that outlives it.
+            TSignalWatcher signals(std::chrono::seconds(Options.StopTimeout));
+
+            if (!signals.Start([this]() {
+                RequestStop();
+            })) {
+                return false;
+            }
+
+            TControlServer control;
+
+            if (!control.Start(Root / "control.sock", [this](const std::string& line) {
+                return Control(line);
+            })) {
+                return false;
+            }
+
+            if (!Recover()) {
+                return false;
+            }
+
+            if (!Options.TracePath.empty()) {
+                if (!Tracer.Open(Options.TracePath, Dev.Size(), ChunkSize)) {
+                    return false;
+                }
+
+                Tracer.Start();
+            }
+
+            Controller.Start();
+            Verifier.Start();
+
+            if (Schedule) {
+                TScheduleSettings fallback;
+
+                fallback.HasRate = true;
+                fallback.Rate = Limiter.GetRate();
+                fallback.Threads = Controller.GetLimit();
+
+                Schedule->Start(fallback, [this](const TScheduleSettings& settings) {
+                    ApplySchedule(settings);
+                });
+            }
+
+            const auto started = std::chrono::steady_clock::now();
+
+            // The prefetcher runs even with --readahead 0, since the depth
+            // can be raised over the control socket.
+            std::thread prefetcher([this]() {
+                Prefetch();
+            });
+
+            RunThreads(Options.Threads, [this](size_t id) {
+                Work(id);
+            });
+
+            {
+                std::unique_lock<std::mutex> guard(Lock);
+
+                Stopped = true;
+                PrefetchChanged.notify_all();
+            }
+
+            if (prefetcher.joinable()) {
+                prefetcher.join();
+            }
+
+            if (Schedule) {
+                Schedule->Stop();
+            }
+
+            control.Stop();
+            signals.Stop();
+            StopSignal = signals.GetSignal();
+            Controller.Stop();
+            Verifier.Stop();
+            Verifier.Report();
+            Tracer.Stop();
+
+            if (Options.Bench != BENCH_STAGE_NONE) {
+                ReportBench(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+            }
+
+            Perf.Report();
+
+            if (Steals > 0) {
+                std::cerr << "Stolen " << Steals << " batch(es)" << std::endl;
+            }
+
+            return !Failed;
+        }
+
+        // True if the run was stopped by a signal or over the control socket
+        // before all ranges were done.
+        bool Interrupted() const {
+            if (!StopRequested) {
+                return false;
+            }
+
+            for (const auto& range : Ranges) {
+                if (!range->Done()) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        int GetStopSignal() const {
+            return StopSignal;
+        }
+
+        uint64_t GetProcessed() const {
+            return Processed;
+        }
+
+        uint64_t GetToProcess() const {
+            return ToProcess;
+        }
+
+    private:
+        // Stops intake; the batches in flight still complete and commit.
+        void RequestStop() {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            StopRequested = true;
+            CanClaim.notify_all();
+        }
+
+        void ApplySchedule(const TScheduleSettings& settings) {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            if (settings.HasRate) {
+                Limiter.SetRate(settings.Rate);
+            }
+
+            if (settings.Threads > 0) {
+                Controller.SetLimit(settings.Threads);
+            }
+
+            Paused = settings.Paused;
+            CanClaim.notify_all();
+        }
+
+        // Writes back every chunk an interrupted run had journaled, in
+        // parallel and with one flush, before any batch is claimed; restart
+        // time depends on how many chunks were in flight, not on the size of
+        // the target. Workers then skip these chunks and only drop their
+        // journal files once the watermark passes them.
+        bool Recover() {
+            if (Target) {
+                return true;
+            }
+
+            const auto started = std::chrono::steady_clock::now();
+            std::vector<std::pair<TRangeState*, uint64_t>> pending;
+
+            for (const auto& range : Ranges) {
+                range->ScanJournal();
+
+                // A chunk that went bad while being written was put back as
+                // it was, and stays so.
+                for (const uint64_t offset : range->GetRecovered()) {
+                    if (!BadBlocks.Overlaps(offset, offset + ChunkSize)) {
+                        pending.emplace_back(range.get(), offset);
+                    }
+                }
+            }
+
+            if (pending.empty()) {
+                return true;
+            }
+
+            std::atomic<size_t> next(0);
+            std::atomic<bool> failed(false);
+
+            RunThreads(std::min(Options.Threads, pending.size()), [&](size_t) {
+                TAlignedBuffer block(ChunkSize);
+
+                if (!block) {
+                    failed = true;
+                    return;
+                }
+
+                for (size_t i = next++; !failed && (i < pending.size()); i = next++) {
+                    const uint64_t offset(pending[i].second);
+
+                    if (!pending[i].first->LoadJournal(offset, block.Data())) {
+                        failed = true;
+
+                    } else if (!Options.DryRun && !Dev.Write(offset, ChunkSize, block.Data())) {
+                        std::cerr << "Failed at " << std::to_string(offset) << ": can't write to file" << std::endl;
+                        failed = true;
+
+                    } else {
+                        BDENC_PROBE(replay, offset, ChunkSize);
+                    }
+                }
+            });
+
+            if (failed) {
+                return false;
+            }
+
+            if (!Options.DryRun && !Dev.FSync()) {
+                std::cerr << "Can't sync file" << std::endl;
+                return false;
+            }
+
+            std::cerr << "Replayed " << pending.size() << " journaled chunk(s) in "
+                << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count() << " ms" << std::endl;
+
+            return true;
+        }
+
+        // Keeps up to --readahead batches read ahead of the claim cursors, so
+        // that workers on sequential ranges find their input already in memory.
+        void Prefetch() {
+            Affinity.Pin();
+
+            std::unique_lock<std::mutex> guard(Lock);
+
+            while (!Failed && !Stopped) {
+                TRangeState* range(nullptr);
+
+                if (!FreeBuffers.empty()) {
+                    for (const auto& it : Ranges) {
+                        if (it->CanPrefetch() && (!range || (it->Lookahead() < range->Lookahead()))) {
+                            range = it.get();
+                        }
+                    }
+                }
+
+                uint64_t begin(0);
+                uint64_t end(0);
+
+                if (!range || !range->PrefetchNext(BatchSize, begin, end)) {
+                    PrefetchChanged.wait(guard);
+                    continue;
+                }
+
+                auto& entry = Prefetched[begin];
+
+                entry.reset(new TPrefetched);
+                entry->Buffer = std::move(FreeBuffers.back());
+                FreeBuffers.pop_back();
+
+                TPrefetched* ptr(entry.get());
+
+                guard.unlock();
+
+                const bool ok(!BadBlocks.Overlaps(begin, end) && (!Selected || Selected->Covers(begin, end)) && (!Allocated || Allocated->Covers(begin, end)) && Dev.Read(begin, end - begin, ptr->Buffer.Data()));
+
+                guard.lock();
+
+                ptr->Ready = true;
+                ptr->Ok = ok;
+                CanClaim.notify_all();
+            }
+        }
+
+        // Called with Lock held right after a claim: swaps a prefetched
+        // buffer for the batch into `in`, waiting for the read to finish.
+        bool TakePrefetched(std::unique_lock<std::mutex>& guard, const uint64_t begin, TAlignedBuffer& in) {
+            auto it = Prefetched.find(begin);
+
+            if (it == Prefetched.end()) {
+                return false;
+            }
+
+            TPrefetched& entry(*it->second);
+
+            CanClaim.wait(guard, [&entry]() {
+                return entry.Ready;
+            });
+
+            const bool ok(entry.Ok);
+
+            if (ok) {
+                std::swap(in, entry.Buffer);
+            }
+
+            ReturnBuffer(std::move(entry.Buffer));
+            Prefetched.erase(it);
+            PrefetchChanged.notify_all();
+
+            return ok;
+        }
+
+        // Called with Lock held; shrinks the pool down to the current depth.
+        void ReturnBuffer(TAlignedBuffer&& buffer) {
+            if (Buffers > Depth) {
+                --Buffers;
+                return;
+            }
+
+            FreeBuffers.push_back(std::move(buffer));
+        }
+
+        void ReportBench(const double seconds) {
+            static const char* stages[] = {"", "read", "cipher", "journal"};
+            const double MiB(1024 * 1024);
+            const uint64_t processed(Processed);
+
+            std::cerr
+                << "Bench (" << stages[Options.Bench] << "): " << processed << " byte(s) in " << seconds << "s, "
+                << (processed / seconds / MiB) << " MiB/s with " << Controller.GetLimit() << " thread(s)" << std::endl;
+
+            for (size_t i = TRACE_STAGE_READ; i < TRACE_STAGE_COUNT; ++i) {
+                const double busy(std::max(1e-9, StageTime[i] / 1e9));
+
+                if ((i == TRACE_STAGE_WRITE) || (i == TRACE_STAGE_SYNC) || ((i == TRACE_STAGE_CONVERT) && (Options.Bench == BENCH_STAGE_READ))) {
+                    continue;
+                }
+
+                std::cerr
+                    << "  " << TraceStageName((TTraceStage)i) << ": " << busy << "s busy, "
+                    << (processed / busy / MiB) << " MiB/s per thread" << std::endl;
+            }
+        }
+
+        std::string Control(const std::string& line) {
+            std::string command;
+            std::string arg;
+
+            ParseControlCommand(line, command, arg);
+
+            std::unique_lock<std::mutex> guard(Lock);
+
+            if (command == "status") {
+                size_t inFlight(0);
+
+                for (const auto& it : Ranges) {
+                    inFlight += it->GetInFlight();
+                }
+
+                return (
+                    std::string("state=") + (Failed ? "failed" : (StopRequested ? "stopping" : (Paused ? "paused" : "running")))
+                    + " done=" + std::to_string(Processed.load())
+                    + " total=" + std::to_string(ToProcess)
+                    + " rate=" + std::to_string(Limiter.GetRate())
+                    + " threads=" + std::to_string(Controller.GetLimit())
+                    + " depth=" + std::to_string(Depth)
+                    + " in-flight=" + std::to_string(inFlight)
+                    + " steals=" + std::to_string(Steals)
+                );
+
+            } else if (command == "pause") {
+                Paused = true;
+                std::cerr << "Paused" << std::endl;
+
+            } else if (command == "resume") {
+                Paused = false;
+                CanClaim.notify_all();
+                std::cerr << "Resumed" << std::endl;
+
+            } else if (command == "set") {
+                std::string name;
+                std::string value;
+
+                ParseControlCommand(arg, name, value);
+
+                uint64_t num(0);
+
+                if (!ParseSize(value.c_str(), num)) {
+                    return "error: invalid value: " + value;
+                }
+
+                if (name == "rate") {
+                    Limiter.SetRate(num);
+
+                } else if (name == "threads") {
+                    const size_t min(Options.Adaptive ? Options.MinThreads : 1);
+
+                    if ((num < min) || (num > Options.Threads)) {
+                        return "error: threads must be between " + std::to_string(min) + " and " + std::to_string(Options.Threads);
+                    }
+
+                    Controller.SetLimit(num);
+
+                } else if (name == "depth") {
+                    if (Map) {
+                        return "error: the mmap backend has no readahead buffers";
+                    }
+
+                    Depth = num;
+
+                    while (Buffers < Depth) {
+                        FreeBuffers.emplace_back(BatchSize);
+                        ++Buffers;
+                    }
+
+                    while ((Buffers > Depth) && !FreeBuffers.empty()) {
+                        FreeBuffers.pop_back();
+                        --Buffers;
+                    }
+
+                    PrefetchChanged.notify_all();
+
+                } else {
+                    return "error: unknown setting: " + name;
+                }
+
+                std::cerr << "Set " << name << " to " << value << std::endl;
+
+            } else if (command == "checkpoint-now") {
+                // Every batch is committed as soon as it completes, so a
+                // checkpoint only has to hold intake until the batches in
+                // flight have been committed.
+                ++Holds;
+
+                CanClaim.wait(guard, [this]() {
+                    if (Failed) {
+                        return true;
+                    }
+
+                    for (const auto& it : Ranges) {
+                        if (it->GetInFlight() > 0) {
+                            return false;
+                        }
+                    }
+
+                    return true;
+                });
+
+                --Holds;
+                CanClaim.notify_all();
+
+                if (Failed) {
+                    return "error: failed";
+                }
+
+                // Headers on the target are only flushed along with data.
+                if (Target && !Target->Sync()) {
+                    return "error: can't sync file";
+                }
+
+            } else if (command == "stop-after-checkpoint") {
+                guard.unlock();
+                RequestStop();
+                std::cerr << "Stopping after the batches in flight" << std::endl;
+
+            } else {
+                return "error: unknown command: " + command;
+            }
+
+            return "ok";
+        }
+
+        // Called with Lock held. Workers take batches from the head of their
+        // own deque and refill it with a few consecutive batches of the least
+        // busy range, which keeps their reads sequential. Once every range is
+        // claimed, idle workers steal from the tail of the longest deque, so
+        // a worker stuck on dense data doesn't hold back the rest of a run.
+        // Batches still complete through their range's Commit(), so stolen
+        // ones are journaled and committed like any other.
+        bool NextBatch(const size_t id, TQueued& job) {
+            auto& own(Queues[id]);
+
+            if (own.empty()) {
+                TRangeState* range(nullptr);
+
+                for (const auto& it : Ranges) {
+                    if (it->Claimable() && (!range || (it->GetPending() < range->GetPending()))) {
+                        range = it.get();
+                    }
+                }
+
+                for (size_t i = 0; range && (i < StealGrain) && range->Claimable(); ++i) {
+                    own.emplace_back();
+                    own.back().Range = range;
+                    own.back().Batch = range->Claim(BatchSize);
+                }
+            }
+
+            if (!own.empty()) {
+                job = std::move(own.front());
+                own.pop_front();
+
+                return true;
+            }
+
+            std::deque<TQueued>* victim(nullptr);
+
+            for (auto& it : Queues) {
+                if (!it.empty() && (!victim || (it.size() > victim->size()))) {
+                    victim = &it;
+                }
+            }
+
+            if (!victim) {
+                return false;
+            }
+
+            job = std::move(victim->back());
+            victim->pop_back();
+            ++Steals;
+
+            return true;
+        }
+
+        void Work(const size_t id) {
+            Affinity.Pin();
+
+            TChunkCipher cipher(Options.Mode, Keys);
+            TAlignedBuffer in(BatchSize);
+            TAlignedBuffer out(BatchSize);
+            TTraceBuffer* trace(Tracer ? Tracer.NewBuffer() : nullptr);
+            TPerfCounters perf(Options.Perf ? &Perf : nullptr);
+
+            if (!cipher || !in || !out) {
+                std::unique_lock<std::mutex> guard(Lock);
+
+                Failed = true;
+                CanClaim.notify_all();
+                PrefetchChanged.notify_all();
+
+                return;
+            }
+
+            // Fault the buffers in from the pinned thread so that they are
+            // allocated on its node.
+            memset(in.Data(), 0, in.Size());
+            memset(out.Data(), 0, out.Size());
+
+            while (true) {
+                TRangeState* range(nullptr);
+                TBatch batch;
+                bool prefetched(false);
+
+                Controller.Acquire();
+
+                {
+                    std::unique_lock<std::mutex> guard(Lock);
+
+                    while (true) {
+                        if (Failed || StopRequested) {
+                            Controller.Release(0, {});
+                            return;
+                        }
+
+                        if (Paused || (Holds > 0)) {
+                            CanClaim.wait(guard);
+                            continue;
+                        }
+
+                        TQueued job;
+
+                        if (NextBatch(id, job)) {
+                            range = job.Range;
+                            batch = std::move(job.Batch);
+                            range->Start();
+                            prefetched = TakePrefetched(guard, batch.Begin, in);
+                            PrefetchChanged.notify_all();
+                            break;
+                        }
+
+                        const bool exhausted(std::all_of(Ranges.begin(), Ranges.end(), [](const std::unique_ptr<TRangeState>& it) {
+                            return it->Exhausted();
+                        }));
+
+                        if (exhausted) {
+                            Controller.Release(0, {});
+                            return;
+                        }
+
+                        CanClaim.wait(guard);
+                    }
+                }
+
+                const uint64_t begin(batch.Begin);
+                const uint64_t size(batch.End - batch.Begin);
+
+                Limiter.Acquire(size);
+
+                TTraceRecord record;
+                const bool stamped(trace || (Options.Bench != BENCH_STAGE_NONE));
+
+                if (stamped) {
+                    record.Offset = batch.Begin;
+                    record.Size = size;
+                    record.Flags = (prefetched ? TRACE_FLAG_PREFETCHED : 0);
+                    record.Stages[TRACE_STAGE_CLAIM] = Tracer.Now();
+                }
+
+                const auto started = std::chrono::steady_clock::now();
+                char* input(Map ? (Map->Data() + begin) : in.Data());
+                const bool ok(
+                    Process(*range, batch, (range->GetCipher() ? *range->GetCipher() : cipher), input, out.Data(), prefetched, (stamped ? &record : nullptr), perf)
+                    && range->Commit(std::move(batch))
+                );
+
+                Controller.Release(size, std::chrono::steady_clock::now() - started);
+
+                // The batch is clean now; keep the mapping from growing into
+                // the whole target.
+                if (Map) {
+                    Map->Advise(begin, size, MADV_DONTNEED);
+                    Dev.Advise(begin, size, POSIX_FADV_DONTNEED);
+                }
+
+                if (stamped && ok) {
+                    record.Stages[TRACE_STAGE_COMMIT] = Tracer.Now();
+
+                    for (size_t i = 1; i < TRACE_STAGE_COUNT; ++i) {
+                        StageTime[i] += record.Stages[i] - record.Stages[i - 1];
+                    }
+
+                    if (trace) {
+                        trace->Push(record);
+                    }
+                }
+
+                {
+                    std::unique_lock<std::mutex> guard(Lock);
+
+                    range->Release();
+                    Failed = Failed || !ok;
+                    CanClaim.notify_all();
+                    PrefetchChanged.notify_all();
+                }
+            }
+        }
+
+        bool Process(const TRangeState& range, TBatch& batch, TChunkCipher& cipher, char* in, char* out, const bool prefetched, TTraceRecord* record, TPerfCounters& perf) {
+            const size_t size(batch.End - batch.Begin);
+            std::vector<std::pair<size_t, size_t>> runs;
+            std::vector<bool> bad(size / ChunkSize, false);
+            std::vector<bool> skipped(size / ChunkSize, false);
+            std::vector<bool> unallocated(size / ChunkSize, false);
+            std::vector<bool> recovered(size / ChunkSize, false);
+            std::vector<bool> replayed(size / ChunkSize, false);
+            bool holes(false);
+
+            // Chunks outside the selection, and those already replayed at
+            // startup, are neither read nor written. Unallocated ones are
+            // zero to enc and not read; dec only skips reading those that enc
+            // did record as zero.
+            for (size_t pos = 0; pos < size; pos += ChunkSize) {
+                const uint64_t offset(batch.Begin + pos);
+
+                if (BadBlocks.Overlaps(offset, offset + ChunkSize)) {
+                    bad[pos / ChunkSize] = true;
+                    holes = true;
+
+                } else if (range.IsRecovered(offset)) {
+                    recovered[pos / ChunkSize] = true;
+                    holes = true;
+
+                } else if (Selected && !Selected->Covers(offset, offset + ChunkSize)) {
+                    skipped[pos / ChunkSize] = true;
+                    holes = true;
+
+                } else if (Allocated && !Allocated->Overlaps(offset, offset + ChunkSize) && ((Options.Mode == MODE_ENCRYPT) || range.IsSparse(offset))) {
+                    unallocated[pos / ChunkSize] = true;
+                    holes = true;
+                }
+            }
+
+            auto hole = [&](const size_t pos) {
+                return (bad[pos / ChunkSize] || skipped[pos / ChunkSize] || unallocated[pos / ChunkSize] || recovered[pos / ChunkSize]);
+            };
+
+            auto read = [&](const uint64_t offset, const size_t len) {
+                return Dev.Read(offset, len, in + (offset - batch.Begin));
+            };
+
+            // Stages that don't happen (e.g. no writes in an all-zero batch)
+            // get the same stamp as the previous one.
+            auto stamp = [&](const TTraceStage stage, const uint32_t flags) {
+                if (record) {
+                    record->Stages[stage] = Tracer.Now();
+                    record->Flags |= flags;
+                }
+            };
+
+            if (Map) {
+                // `in` points into the mapping and faults in as it is read;
+                // ask for the batches after this one to be read ahead.
+                Map->Advise(batch.End, Options.Readahead * BatchSize, MADV_WILLNEED);
+
+                if (Options.Bench == BENCH_STAGE_READ) {
+                    volatile char sink(0);
+
+                    for (size_t pos = 0; pos < size; pos += 4096) {
+                        if (!hole(pos)) {
+                            sink = sink ^ in[pos];
+                        }
+                    }
+                }
+
+            } else if (holes) {
+                // Only the runs between the holes are read; a run that fails
+                // is salvaged chunk by chunk.
+                for (size_t pos = 0; pos < size;) {
+                    if (hole(pos)) {
+                        pos += ChunkSize;
+                        continue;
+                    }
+
+                    size_t end(pos + ChunkSize);
+
+                    while ((end < size) && !hole(end)) {
+                        end += ChunkSize;
+                    }
+
+                    if (!read(batch.Begin + pos, end - pos) && !Salvage(batch.Begin, batch.Begin + pos, batch.Begin + end, bad, "can't read file", read)) {
+                        return false;
+                    }
+
+                    pos = end;
+                }
+
+            } else if (!prefetched && !Dev.Read(batch.Begin, size, in)) {
+                if (!Salvage(batch.Begin, batch.Begin, batch.End, bad, "can't read file", read)) {
+                    return false;
+                }
+            }
+
+            stamp(TRACE_STAGE_READ, 0);
+            BDENC_PROBE(read, batch.Begin, size);
+
+            if (Options.Bench == BENCH_STAGE_READ) {
+                stamp(TRACE_STAGE_CONVERT, 0);
+                stamp(TRACE_STAGE_WRITE, 0);
+                stamp(TRACE_STAGE_SYNC, 0);
+                Progress->Add(size);
+                Processed += size;
+
+                return true;
+            }
+
+            uint32_t flags(0);
+
+            for (size_t pos = 0; pos < size; pos += ChunkSize) {
+                const uint64_t offset(batch.Begin + pos);
+                const char* chunk(in + pos);
+                char* block(out + pos);
+
+                if (bad[pos / ChunkSize]) {
+                    BadBlocks.Skip(ChunkSize);
+                    flags |= TRACE_FLAG_BAD;
+                    continue;
+                }
+
+                if (skipped[pos / ChunkSize]) {
+                    continue;
+                }
+
+                if (recovered[pos / ChunkSize]) {
+                    batch.Journal.push_back(offset);
+                    flags |= TRACE_FLAG_REPLAY;
+                    continue;
+                }
+
+                if (Target && Target->HasJournal(offset)) {
+                    if (!Target->ReadJournal(offset, block)) {
+                        std::cerr << "Can't load journaled chunk at " << std::to_string(offset) << std::endl;
+                        return false;
+                    }
+
+                    replayed[pos / ChunkSize] = true;
+                    BDENC_PROBE(replay, offset, ChunkSize);
+                    flags |= TRACE_FLAG_REPLAY;
+
+                } else {
+                    bool allZeroes(false);
+
+                    perf.Start();
+
+                    if (Options.Mode == MODE_ENCRYPT) {
+                        allZeroes = (unallocated[pos / ChunkSize] || std::all_of(chunk, chunk + ChunkSize, [](const char chr) { return (chr == 0); }));
+
+                    } else {
+                        allZeroes = range.IsSparse(offset);
+                    }
+
+                    perf.Lap(PERF_STAGE_ZERO, ChunkSize);
+
+                    if (allZeroes) {
+                        if (Options.Mode == MODE_ENCRYPT) {
+                            batch.Zeroes.push_back(offset);
+                        }
+
+                        flags |= TRACE_FLAG_ZERO;
+                        BDENC_PROBE(zero, offset, ChunkSize);
+                        continue;
+                    }
+
+                    flags |= TRACE_FLAG_CIPHER;
+                    BDENC_PROBE(cipher_start, offset, ChunkSize);
+
+                    if (!cipher.Process(offset, ChunkSize, chunk, block)) {
+                        std::cerr << "Failed at " << std::to_string(offset) << ": can't process chunk" << std::endl;
+                        return false;
+                    }
+
+                    perf.Lap(PERF_STAGE_CIPHER, ChunkSize);
+                    BDENC_PROBE(cipher_end, offset, ChunkSize);
+
+                    if (Target) {
+                        batch.Journal.push_back(offset);
+
+                    } else if ((Options.Resilience == RESILIENCE_JOURNAL) && (Options.Bench != BENCH_STAGE_CIPHER)) {
+                        if (!range.WriteJournal(offset, block)) {
+                            return false;
+                        }
+
+                        BDENC_PROBE(journal, offset, ChunkSize);
+                        batch.Journal.push_back(offset);
+                    }
+                }
+
+                if (!runs.empty() && ((runs.back().first + runs.back().second) == pos)) {
+                    runs.back().second += ChunkSize;
+
+                } else {
+                    runs.emplace_back(pos, ChunkSize);
+                }
+            }
+
+            // The whole batch goes into one journal slot, which has to be
+            // durable before anything is overwritten.
+            if (Target && !batch.Journal.empty()) {
+                if (!Target->WriteJournal(Options.Mode, batch.Begin, batch.End, batch.Journal, out) || !Target->Sync()) {
+                    std::cerr << "Failed at " << std::to_string(batch.Begin) << ": can't journal batch" << std::endl;
+                    return false;
+                }
+
+                BDENC_PROBE(journal, batch.Begin, size);
+            }
+
+            if ((Options.Resilience == RESILIENCE_REFLINK) && (Options.Bench != BENCH_STAGE_CIPHER) && !runs.empty()) {
+                if (!Clone(range, batch)) {
+                    return false;
+                }
+
+                BDENC_PROBE(journal, batch.Begin, size);
+            }
+
+            stamp(TRACE_STAGE_CONVERT, flags);
+
+            if (!Options.DryRun && !runs.empty()) {
+                auto write = [&](const uint64_t offset, const size_t len) {
+                    return Dev.Write(offset, len, out + (offset - batch.Begin));
+                };
+
+                auto restore = [&](const uint64_t offset, const size_t len) {
+                    return Dev.Write(offset, len, in + (offset - batch.Begin));
+                };
+
+                for (const auto& run : runs) {
+                    BDENC_PROBE(write, batch.Begin + run.first, run.second);
+
+                    if (Map) {
+                        memcpy(in + run.first, out + run.first, run.second);
+
+                    } else if (!write(batch.Begin + run.first, run.second)) {
+                        if (!Salvage(batch.Begin, batch.Begin + run.first, batch.Begin + run.first + run.second, bad, "can't write to file", write, restore)) {
+                            return false;
+                        }
+                    }
+                }
+
+                stamp(TRACE_STAGE_WRITE, 0);
+
+                if (Map ? !Map->Sync(batch.Begin, size) : !(Target ? Target->Sync() : Dev.FSync())) {
+                    std::cerr << "Failed at " << std::to_string(batch.Begin) << ": can't write to file" << std::endl;
+                    return false;
+                }
+
+                stamp(TRACE_STAGE_SYNC, 0);
+                BDENC_PROBE(flush, batch.Begin, size);
+
+                // A replayed chunk's input may already have been overwritten,
+                // so only its written bytes can be checked. The same goes for
+                // every chunk with the mmap backend, where `in` is the target.
+                for (const auto& run : runs) {
+                    for (size_t pos = run.first; pos < (run.first + run.second); pos += ChunkSize) {
+                        if (!bad[pos / ChunkSize]) {
+                            Verifier.Sample(batch.Begin + pos, ((Map || replayed[pos / ChunkSize]) ? nullptr : in + pos), out + pos);
+                        }
+                    }
+                }
+            }
+
+            if (record && (record->Stages[TRACE_STAGE_SYNC] == 0)) {
+                record->Stages[TRACE_STAGE_WRITE] = record->Stages[TRACE_STAGE_SYNC] = record->Stages[TRACE_STAGE_CONVERT];
+            }
+
+            Progress->Add(size);
+            Processed += size;
+            Affinity.Account(size);
+
+            return true;
+        }
+
+        // Reflinks the batch's current data into the range's state directory
+        // before any of it is overwritten.
+        bool Clone(const TRangeState& range, TBatch& batch) {
+            const auto path = range.ClonePath(batch.Begin);
+            const std::string tmpPath(path.string() + ".tmp");
+            TDevice clone(tmpPath, O_WRONLY | O_CREAT | O_TRUNC);
+
+            if (!clone || !clone.CloneRange(Dev, batch.Begin, batch.End - batch.Begin, 0) || !clone.FSync()) {
+                perror("clone");
+                std::cerr << "Failed at " << std::to_string(batch.Begin) << ": can't clone batch" << std::endl;
+                unlink(tmpPath.c_str());
+                return false;
+            }
+
+            if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+                perror("rename");
+                std::cerr << "Failed at " << std::to_string(batch.Begin) << ": can't clone batch" << std::endl;
+                return false;
+            }
+
+            batch.Cloned = true;
+
+            return true;
+        }
+
+        // Retries a failed transfer chunk by chunk and then sector by sector,
+        // recording the sectors that still fail and marking their chunks bad.
+        // Without --skip-errors the first failing chunk is fatal. For writes,
+        // `undo` puts the old data back into the sectors of a bad chunk that
+        // did take the new data, so that every run can skip it as a whole.
+        bool Salvage(
+            const uint64_t batchBegin,
+            const uint64_t begin,
+            const uint64_t end,
+            std::vector<bool>& bad,
+            const char* error,
+            const std::function<bool(uint64_t, size_t)>& io,
+            const std::function<bool(uint64_t, size_t)>& undo = nullptr
+        ) {
+            const size_t step(std::min(ChunkSize, Dev.SectorSize()));
+
+            for (uint64_t chunk = begin; chunk < end; chunk += ChunkSize) {
+                const size_t index((chunk - batchBegin) / ChunkSize);
+
+                if (bad[index] || io(chunk, ChunkSize)) {
+                    continue;
+                }
+
+                if (!Options.SkipErrors) {
+                    std::cerr << "Failed at " << std::to_string(chunk) << ": " << error << std::endl;
+                    return false;
+                }
+
+                uint64_t badBegin(0);
+                uint64_t badSize(0);
+                std::vector<uint64_t> done;
+
+                for (uint64_t sector = chunk; sector < (chunk + ChunkSize); sector += step) {
+                    bool ok(false);
+
+                    for (size_t attempt = 0; !ok && (attempt < SectorRetries); ++attempt) {
+                        ok = io(sector, step);
+                    }
+
+                    if (ok) {
+                        done.push_back(sector);
+                        continue;
+                    }
+
+                    bad[index] = true;
+
+                    if ((badSize > 0) && ((badBegin + badSize) == sector)) {
+                        badSize += step;
+                        continue;
+                    }
+
+                    if ((badSize > 0) && !BadBlocks.Add(badBegin, badSize)) {
+                        return false;
+                    }
+
+                    badBegin = sector;
+                    badSize = step;
+                }
+
+                if ((badSize > 0) && !BadBlocks.Add(badBegin, badSize)) {
+                    return false;
+                }
+
+                if (!bad[index] || !undo) {
+                    continue;
+                }
+
+                for (const uint64_t sector : done) {
+                    if (!undo(sector, step)) {
+                        std::cerr << "Failed at " << std::to_string(sector) << ": can't restore sector of a bad chunk" << std::endl;
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        const TOptions& Options;
+        const stdfs::path Root;
+        const TKeyMaterial& Keys;
+        const TDevice& Dev;
+        const TMapping* Map;
+        TTargetState* Target;
+        TSchedule* Schedule = nullptr;
+        const TExtentMap* Selected;
+        const TExtentMap* Allocated;
+        TAffinity& Affinity;
+        TBadBlocks& BadBlocks;
+        const size_t ChunkSize;
+        const size_t BatchSize;
+        TRateLimiter Limiter;
+        TConcurrencyController Controller;
+        TVerifier Verifier;
+        TTracer Tracer;
+        TPerfCollector Perf;
+        std::vector<std::unique_ptr<TRangeState>> Ranges;
+        std::unique_ptr<TProgress> Progress;
+        std::mutex Lock;
+        std::condition_variable CanClaim;
+        std::condition_variable PrefetchChanged;
+        std::map<uint64_t, std::unique_ptr<TPrefetched>> Prefetched;
+        std::vector<TAlignedBuffer> FreeBuffers;
+        std::atomic<uint64_t> StageTime[TRACE_STAGE_COUNT] = {};
+        size_t Depth;
+        std::vector<std::deque<TQueued>> Queues;
+        uint64_t Steals = 0;
+        size_t Buffers = 0;
+        uint64_t ToProcess = 0;
+        std::atomic<uint64_t> Processed{0};
+        size_t Holds = 0;
+        bool Paused = false;
+        bool StopRequested = false;
+        int StopSignal = 0;
+        bool Stopped = false;
+        bool Failed = false;
+    };
+}
+
+bool BuildRanges(const TOptions& options, const TDevice& dev, const stdfs::path& stateRoot, std::vector<TRange>& ranges) {
+    const size_t chunkSize(options.ChunkSize);
+
+    if (options.Partitions.empty()) {
+        // A qcow2 image may end anywhere, but data clusters are whole chunks.
+        if (((dev.Size() % chunkSize) != 0) && (options.Format != FORMAT_QCOW2)) {
+            std::cerr << "File size (" << dev.Size() << ") must be multiple of chunk size (-s " << chunkSize << ")" << std::endl;
+            return false;
+        }
+
+        TRange range;
+
+        range.Begin = 0;
+        range.End = dev.Size() / chunkSize * chunkSize;
+        range.StateDir = stateRoot;
+        range.Name = options.DevPath;
+
+        ranges.push_back(range);
+
+    } else {
+        std::vector<TPartition> partitions;
+        std::vector<TPartition> selected;
+
+        if (!ReadPartitionTable(dev, partitions)) {
+            std::cerr << "Can't read partition table" << std::endl;
+            return false;
+        }
+
+        if (partitions.empty()) {
+            std::cerr << "No partitions found" << std::endl;
+            return false;
+        }
+
+        if (!SelectPartitions(partitions, options.Partitions, selected)) {
+            return false;
+        }
+
+        for (const auto& partition : selected) {
+            if (((partition.Begin % chunkSize) != 0) || ((partition.End % chunkSize) != 0)) {
+                std::cerr << "Partition " << partition.Number << " (" << partition.Begin << "-" << partition.End << ") is not aligned to chunk size (-s " << chunkSize << ")" << std::endl;
+                return false;
+            }
+
+            TRange range;
+
+            range.Begin = partition.Begin;
+            range.End = partition.End;
+            range.StateDir = stateRoot / ("part-" + std::to_string(partition.Begin));
+            range.Name = "Partition " + std::to_string(partition.Number);
+
+            ranges.push_back(range);
+        }
+    }
+
+    return true;
+}
+
+// Reflinks need a filesystem that supports them, the workdir on the same
+// filesystem as the target and chunks aligned to the filesystem block.
+static bool ProbeReflink(const TDevice& dev, const stdfs::path& root, const uint64_t offset, const size_t chunkSize) {
+    const std::string path((root / ".reflink-probe").string());
+    bool ok(false);
+
+    {
+        TDevice probe(path, O_WRONLY | O_CREAT | O_TRUNC);
+
+        ok = (probe && (dev.Size() >= (offset + chunkSize)) && probe.CloneRange(dev, offset, chunkSize, 0));
+    }
+
+    const int error(errno);
+
+    unlink(path.c_str());
+    errno = error;
+
+    return ok;
+}
+
+int RunConvert(const TOptions& options) {
+    const stdfs::path wd(options.WorkdirPath);
+    const bool bench(options.Bench != BENCH_STAGE_NONE);
+
+    // Taken before any range, journal, clone or state area is looked at, so
+    // that a second run never replays or removes what a live one is using.
+    // Benchmarks only read the workdir.
+    TWorkdirLock lock;
+
+    if (!bench && !lock.Acquire(wd)) {
+        return 1;
+    }
+
+    const bool mapped(options.Backend == BACKEND_MMAP);
+
+    TDevice dev(options.DevPath, (bench ? O_RDONLY : O_RDWR) | (mapped ? 0 : O_DIRECT));
+
+    if (!dev) {
+        std::cerr << "Can't open file" << std::endl;
+        return 1;
+    }
+
+    TMapping map;
+
+    if (mapped) {
+        if (!dev.IsRegular()) {
+            std::cerr << "The mmap backend (--backend mmap) needs a regular file" << std::endl;
+            return 1;
+        }
+
+        if (!map.Map(dev, !bench)) {
+            std::cerr << "Can't map file" << std::endl;
+            return 1;
+        }
+    }
+
+    // Benchmarks keep their state in a scratch directory that is removed
+    // afterwards, so that they never affect a real run.
+    TScratchDir scratch;
+
+    if (bench && !scratch.Create(wd)) {
+        return 1;
+    }
+
+    const stdfs::path root(bench ? scratch.Path() : wd);
+    std::vector<TRange> ranges;
+
+    if (!BuildRanges(options, dev, root, ranges)) {
+        return 1;
+    }
+
+    TKeyMaterial keys;
+
+    if (bench ? !MakeScratchKeyMaterial(wd, options.IVMode, keys) : !LoadKeyMaterial(wd, options.Mode, options.IVMode, keys)) {
+        return 1;
+    }
+
+    // The single CBC stream would run over a skipped chunk on one side and
+    // not on the other, garbling everything after it.
+    if (options.SkipErrors && (keys.IVMode == IV_MODE_CHAIN)) {
+        std::cerr << "Skipping errors (--skip-errors) needs essiv IV mode (--iv essiv)" << std::endl;
+        return 1;
+    }
+
+    // Converting a qcow2 image as raw, or the other way around, would
+    // garble its metadata or the data clusters.
+    if (!bench) {
+        const bool qcow2(IsQcow2Workdir(wd));
+
+        if (qcow2 && (options.Format != FORMAT_QCOW2)) {
+            std::cerr << "Workdir was used with qcow2 format (--format qcow2)" << std::endl;
+            return 1;
+        }
+
+        if (!qcow2 && (options.Format == FORMAT_QCOW2)) {
+            if (stdfs::exists(wd / "enc_offset") || stdfs::exists(wd / "dec_offset")) {
+                std::cerr << "Workdir was used with raw format (--format raw)" << std::endl;
+                return 1;
+            }
+
+            if (!MarkQcow2Workdir(wd)) {
+                return 1;
+            }
+        }
+    }
+
+    // A benchmark starts from the known bad blocks and, for dec, from the
+    // real sparse lists, so that it skips what a real run would skip.
+    if (bench) {
+        std::vector<std::pair<stdfs::path, stdfs::path>> copies;
+
+        copies.emplace_back(wd / "badblocks", root / "badblocks");
+
+        if (options.Mode == MODE_DECRYPT) {
+            for (const auto& range : ranges) {
+                const stdfs::path dir((range.StateDir == root) ? wd : (wd / range.StateDir.filename()));
+
+                copies.emplace_back(dir / "enc_sparse", range.StateDir / "enc_sparse");
+            }
+        }
+
+        for (const auto& it : copies) {
+            if (!stdfs::exists(it.first)) {
+                continue;
+            }
+
+            std::error_code ec;
+
+            stdfs::create_directories(it.second.parent_path(), ec);
+
+            if (!ec) {
+                stdfs::copy_file(it.first, it.second, ec);
+            }
+
+            if (ec) {
+                std::cerr << "Can't copy " << it.first.string() << ": " << ec.message() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // State kept on the target replaces the state files in the workdir and
+    // takes the end of the target away from the data. Benchmarks only skip
+    // the area and keep their scratch state.
+    TTargetState target(dev);
+
+    if (!target.Load()) {
+        return 1;
+    }
+
+    const bool onTarget(target.Exists() || (options.StateOnTarget > 0));
+
+    if (onTarget) {
+        if (!options.Partitions.empty()) {
+            std::cerr << "State on target (--state-on-target) doesn't work with partitions (-p)" << std::endl;
+            return 1;
+        }
+
+        if (target.Exists()) {
+            if ((options.StateOnTarget > 0) && (options.StateOnTarget != target.GetArea())) {
+                std::cerr << "Target already has a " << target.GetArea() << "-byte state area" << std::endl;
+                return 1;
+            }
+
+            if (target.GetChunkSize() != options.ChunkSize) {
+                std::cerr << "State area was created with chunk size (-s " << target.GetChunkSize() << ")" << std::endl;
+                return 1;
+            }
+
+        } else if (!bench) {
+            if (stdfs::exists(wd / "enc_offset") || stdfs::exists(wd / "dec_offset")) {
+                std::cerr << "Workdir already has conversion state, can't move it to the target" << std::endl;
+                return 1;
+            }
+
+            if (!target.Create(options.StateOnTarget, options.ChunkSize, BatchSizeFor(options.ChunkSize), options.OverwriteTail)) {
+                return 1;
+            }
+
+            std::cerr << "Reserved the last " << options.StateOnTarget << " byte(s) of the target for conversion state" << std::endl;
+        }
+
+        if (options.StateOnTarget >= dev.Size()) {
+            std::cerr << "State area (" << options.StateOnTarget << ") must be smaller than the target" << std::endl;
+            return 1;
+        }
+
+        ranges.front().End = dev.Size() - (target.Exists() ? target.GetArea() : options.StateOnTarget);
+
+        if (!bench && !target.Recover(options.Mode)) {
+            return 1;
+        }
+    }
+
+    TOptions effective(options);
+
+    if (options.Resilience == RESILIENCE_REFLINK) {
+        std::string reason;
+
+        if (keys.IVMode != IV_MODE_ESSIV) {
+            reason = "needs essiv IV mode";
+
+        } else if (onTarget && !bench) {
+            reason = "state is on the target";
+
+        } else if (!dev.IsRegular()) {
+            reason = "target is not a regular file";
+
+        } else if (!ProbeReflink(dev, root, ranges.front().Begin, options.ChunkSize)) {
+            reason = strerror(errno);
+        }
+
+        if (!reason.empty()) {
+            std::cerr << "Reflinks unavailable (" << reason << "), falling back to journal" << std::endl;
+            effective.Resilience = RESILIENCE_JOURNAL;
+        }
+    }
+
+    TAffinity affinity;
+
+    if (!affinity.Init(options.Affinity, dev)) {
+        return 1;
+    }
+
+    TBadBlocks badBlocks;
+
+    if (!badBlocks.Open(root / "badblocks")) {
+        return 1;
+    }
+
+    // Only the data clusters of a qcow2 image are converted, in place, so
+    // that it stays a valid image.
+    TExtentMap selected;
+
+    if (options.Format == FORMAT_QCOW2) {
+        if (!ReadQcow2DataMap(dev, options.ChunkSize, selected)) {
+            return 1;
+        }
+
+        std::cerr << "Converting " << selected.Bytes() << " byte(s) of qcow2 data clusters in " << selected.Count() << " extent(s)" << std::endl;
+    }
+
+    TExtentMap allocated;
+
+    if (!options.AllocMap.empty() && !LoadAllocationMap(options.AllocMap, dev.Size(), options.ChunkSize, allocated)) {
+        return 1;
+    }
+
+    TConverter converter(
+        effective, root, keys, dev,
+        (mapped ? &map : nullptr),
+        ((onTarget && !bench) ? &target : nullptr),
+        ((options.Format == FORMAT_QCOW2) ? &selected : nullptr),
+        (options.AllocMap.empty() ? nullptr : &allocated),
+        affinity, badBlocks
+    );
+
+    TSchedule schedule;
+
+    if (!options.SchedulePath.empty()) {
+        if (!schedule.Load(options.SchedulePath)) {
+            return 1;
+        }
+
+        if (schedule.MaxThreads() > options.Threads) {
+            std::cerr << "Schedule asks for " << schedule.MaxThreads() << " thread(s), but at most " << options.Threads << " were started (-t)" << std::endl;
+            return 1;
+        }
+
+        converter.SetSchedule(&schedule);
+    }
+
+    for (const auto& range : ranges) {
+        if (!converter.AddRange(range)) {
+            return 1;
+        }
+    }
+
+    if (converter.Empty()) {
+        std::cerr << "Already done" << std::endl;
+        return 0;
+    }
+
+    const bool ok(converter.Run());
+
+    // Batches leave the last header for the next flush.
+    if (ok && onTarget && !bench && !target.Sync()) {
+        std::cerr << "Can't sync file" << std::endl;
+        return 1;
+    }
+
+    affinity.Report();
+    badBlocks.Report();
+
+    if (!ok) {
+        return 1;
+    }
+
+    if (converter.Interrupted()) {
+        std::cerr << "Stopped after " << converter.GetProcessed() << " of " << converter.GetToProcess() << " byte(s), run again to resume" << std::endl;
+
+        return (converter.GetStopSignal() ? (128 + converter.GetStopSignal()) : 0);
+    }
+
+    if (!bench) {
+        std::cerr << "Success!" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "device.hpp"
+#include "options.hpp"
+
+#include <vector>
+#include <stdint.h>
+
+struct TRange {
+    uint64_t Begin = 0;
+    uint64_t End = 0;
+    stdfs::path StateDir;
+    std::string Name;
+};
+
+// The whole target, or the partitions selected with -p, keeping their state
+// under stateRoot.
+bool BuildRanges(const TOptions& options, const TDevice& dev, const stdfs::path& stateRoot, std::vector<TRange>& ranges);
+
+// Converts the target in place. Every range keeps its own offset, sparse
+// list and journal in its state directory, or, with --state-on-target, in
+// a reserved area at the end of the target; all ranges share one pool of
+// -t workers, which steal batches from each other, and one rate limit.
+int RunConvert(const TOptions& options);
@@ -0,0 +1,734 @@
+#include "copy.hpp"
+#include "affinity.hpp"
+#include "alloc.hpp"
+#include "badblocks.hpp"
+#include "controller.hpp"
+#include "device.hpp"
+#include "perf.hpp"
+#include "qcow2.hpp"
+#include "ratelimit.hpp"
+#include "verify.hpp"
+
+#include <ac-common/file.hpp>
+#include <ac-common/utils/htonll.hpp>
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char FingerprintMagic[8] = {'B', 'D', 'F', 'P', 'R', 'N', 'T', '2'};
+static const size_t FingerprintSize(16);
+static const size_t FingerprintIdentitySize(4 * sizeof(uint64_t));
+static const size_t FingerprintHeaderSize(sizeof(FingerprintMagic) + sizeof(uint64_t) + FingerprintIdentitySize);
+
+namespace {
+    // Bounded queue between the stages of the copy. Closing it wakes up
+    // everyone: Push() fails at once, Pop() once the queue is drained.
+    template<typename T>
+    class TPipe {
+    public:
+        explicit TPipe(const size_t capacity)
+            : Capacity(std::max<size_t>(1, capacity))
+        {
+        }
+
+        bool Push(T&& item) {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            Changed.wait(guard, [this]() {
+                return (Closed || (Items.size() < Capacity));
+            });
+
+            if (Closed) {
+                return false;
+            }
+
+            Items.push_back(std::move(item));
+            Changed.notify_all();
+
+            return true;
+        }
+
+        bool Pop(T& item) {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            Changed.wait(guard, [this]() {
+                return (Closed || !Items.empty());
+            });
+
+            if (Items.empty()) {
+                return false;
+            }
+
+            item = std::move(Items.front());
+            Items.pop_front();
+            Changed.notify_all();
+
+            return true;
+        }
+
+        void Close() {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            Closed = true;
+            Changed.notify_all();
+        }
+
+    private:
+        const size_t Capacity;
+        std::mutex Lock;
+        std::condition_variable Changed;
+        std::deque<T> Items;
+        bool Closed = false;
+    };
+
+    // A batch on its way from the reader through a cipher worker to the
+    // writer. Runs are (first chunk, chunk count) within the batch.
+    struct TCopyJob {
+        uint64_t First = 0;
+        size_t Count = 0;
+        TAlignedBuffer In;
+        TAlignedBuffer Out;
+        std::vector<std::pair<size_t, size_t>> Writes;
+        std::vector<std::pair<size_t, size_t>> Discards;
+        std::vector<std::pair<size_t, bool>> Sampled;
+    };
+}
+
+static bool IsBlockDevice(const std::string& path) {
+    struct stat st;
+
+    return ((stat(path.c_str(), &st) == 0) && S_ISBLK(st.st_mode));
+}
+
+static void Fingerprint(const char* data, const size_t size, char* out) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    SHA256((const unsigned char*)data, size, digest);
+    memcpy(out, digest, FingerprintSize);
+}
+
+// The fingerprint index only describes the output it was written for: the
+// same file (device and inode) as of its last change (ctime, which every
+// write bumps), or the same block device.
+static bool GetOutputIdentity(const TDevice& dev, char* out) {
+    struct stat st;
+
+    if (fstat(dev.GetFd(), &st) != 0) {
+        perror("fstat");
+        return false;
+    }
+
+    uint64_t words[4] = {0, 0, 0, 0};
+
+    if (S_ISBLK(st.st_mode)) {
+        words[1] = st.st_rdev;
+
+    } else {
+        words[0] = st.st_dev;
+        words[1] = st.st_ino;
+        words[2] = st.st_ctim.tv_sec;
+        words[3] = st.st_ctim.tv_nsec;
+    }
+
+    for (size_t i = 0; i < 4; ++i) {
+        const uint64_t tmp(NAC::hton(words[i]));
+
+        memcpy(out + i * sizeof(tmp), &tmp, sizeof(tmp));
+    }
+
+    return true;
+}
+
+static bool IsValidIndex(const NAC::TFile& index, const size_t chunkSize, const uint64_t chunkCount, const char* identity) {
+    if (!index || (index.Size() != (FingerprintHeaderSize + chunkCount * FingerprintSize))) {
+        return false;
+    }
+
+    if (memcmp(index.Data(), FingerprintMagic, sizeof(FingerprintMagic)) != 0) {
+        return false;
+    }
+
+    uint64_t tmp;
+
+    memcpy(&tmp, index.Data() + sizeof(FingerprintMagic), sizeof(tmp));
+
+    return ((NAC::ntoh(tmp) == chunkSize) && (memcmp(index.Data() + sizeof(FingerprintMagic) + sizeof(tmp), identity, FingerprintIdentitySize) == 0));
+}
+
+int RunCopy(const TOptions& options) {
+    const size_t chunkSize(options.ChunkSize);
+    const stdfs::path wd(options.WorkdirPath);
+    const std::string modeName((options.Mode == MODE_ENCRYPT) ? "enc" : "dec");
+
+    // A dry run writes nothing to the workdir, not even the lock file.
+    TWorkdirLock lock;
+
+    if (!options.DryRun && !lock.Acquire(wd)) {
+        return 1;
+    }
+
+    // Block devices on both sides are accessed directly, so that the two
+    // queues don't compete for the page cache.
+    TDevice src(options.DevPath, O_RDONLY | (IsBlockDevice(options.DevPath) ? O_DIRECT : 0));
+
+    if (!src) {
+        std::cerr << "Can't open file" << std::endl;
+        return 1;
+    }
+
+    if ((src.Size() % chunkSize) != 0) {
+        std::cerr << "File size (" << src.Size() << ") must be multiple of chunk size (-s " << chunkSize << ")" << std::endl;
+        return 1;
+    }
+
+    TKeyMaterial keys;
+
+    if (options.DryRun ? !MakeScratchKeyMaterial(wd, options.IVMode, keys) : !LoadKeyMaterial(wd, options.Mode, options.IVMode, keys)) {
+        return 1;
+    }
+
+    if (keys.IVMode != IV_MODE_ESSIV) {
+        std::cerr << "Output (-o) requires essiv IV mode" << std::endl;
+        return 1;
+    }
+
+    if (IsQcow2Workdir(wd)) {
+        std::cerr << "Output (-o) doesn't work with targets converted with qcow2 format (--format qcow2)" << std::endl;
+        return 1;
+    }
+
+    // A dry run only looks at an existing output and doesn't create one;
+    // a missing output is as good as an empty file.
+    const bool outputExisted(stdfs::exists(options.OutputPath));
+    std::unique_ptr<TDevice> dst;
+
+    if (!options.DryRun || outputExisted) {
+        dst.reset(new TDevice(options.OutputPath, (options.DryRun ? O_RDONLY : (O_RDWR | O_CREAT)) | (IsBlockDevice(options.OutputPath) ? O_DIRECT : 0)));
+
+        if (!*dst) {
+            std::cerr << "Can't open output" << std::endl;
+            return 1;
+        }
+    }
+
+    const bool sameSize(outputExisted && (dst->Size() == src.Size()));
+
+    if (!dst || dst->IsRegular()) {
+        if (!sameSize && !options.DryRun && !dst->Truncate(src.Size())) {
+            std::cerr << "Can't resize output" << std::endl;
+            return 1;
+        }
+
+    } else if (dst->Size() < src.Size()) {
+        std::cerr << "Output size (" << dst->Size() << ") is less than file size (" << src.Size() << ")" << std::endl;
+        return 1;
+    }
+
+    src.Advise(0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Samples are read back through a separate O_DIRECT descriptor, which
+    // writes back any dirty pages of the range before reading it.
+    const uint64_t verifySample(options.DryRun ? 0 : options.VerifySample);
+    std::unique_ptr<TDevice> verifyDst;
+
+    if (verifySample > 0) {
+        verifyDst.reset(new TDevice(options.OutputPath, O_RDONLY | O_DIRECT));
+
+        if (!*verifyDst) {
+            std::cerr << "Can't open output for verification" << std::endl;
+            return 1;
+        }
+    }
+
+    TAffinity affinity;
+
+    if (!affinity.Init(options.Affinity, src)) {
+        return 1;
+    }
+
+    const uint64_t chunkCount(src.Size() / chunkSize);
+    const auto indexPath = wd / (modeName + "_fingerprints");
+    const std::string newIndexPath(indexPath.string() + ".tmp");
+    std::unique_ptr<NAC::TFile> prevIndex;
+
+    if (options.Delta && sameSize && stdfs::exists(indexPath)) {
+        char identity[FingerprintIdentitySize];
+
+        if (!GetOutputIdentity(*dst, identity)) {
+            return 1;
+        }
+
+        prevIndex.reset(new NAC::TFile(indexPath.string()));
+
+        if (!IsValidIndex(*prevIndex, chunkSize, chunkCount, identity)) {
+            std::cerr << "Ignoring stale " << indexPath.string() << std::endl;
+            prevIndex.reset();
+        }
+    }
+
+    const auto sparsePath = wd / "enc_sparse";
+    std::unique_ptr<NAC::TFile> sparseFile;
+
+    if ((options.Mode == MODE_DECRYPT) && stdfs::exists(sparsePath) && !stdfs::is_empty(sparsePath)) {
+        sparseFile.reset(new NAC::TFile(sparsePath.string()));
+
+        if (!*sparseFile) {
+            std::cerr << "Can't load sparse file" << std::endl;
+            return 1;
+        }
+    }
+
+    // Chunks that enc skipped as unrecoverable were never converted, so
+    // they are neither read nor written here either.
+    TBadBlocks badBlocks;
+
+    if (!badBlocks.Open(wd / "badblocks")) {
+        return 1;
+    }
+
+    auto bad = [&](const uint64_t offset) {
+        return badBlocks.Overlaps(offset, offset + chunkSize);
+    };
+
+    TExtentMap allocated;
+
+    if (!options.AllocMap.empty() && !LoadAllocationMap(options.AllocMap, src.Size(), chunkSize, allocated)) {
+        return 1;
+    }
+
+    // A dry run leaves the index as it is.
+    std::unique_ptr<TDevice> newIndex;
+
+    if (!options.DryRun) {
+        newIndex.reset(new TDevice(newIndexPath, O_RDWR | O_CREAT | O_TRUNC));
+
+        if (!*newIndex || !newIndex->Truncate(FingerprintHeaderSize + chunkCount * FingerprintSize)) {
+            std::cerr << "Can't create " << newIndexPath << std::endl;
+            unlink(newIndexPath.c_str());
+            return 1;
+        }
+
+        char header[FingerprintHeaderSize] = {};
+        const uint64_t tmp(NAC::hton((uint64_t)chunkSize));
+
+        memcpy(header, FingerprintMagic, sizeof(FingerprintMagic));
+        memcpy(header + sizeof(FingerprintMagic), &tmp, sizeof(tmp));
+
+        if (!newIndex->Write(0, sizeof(header), header)) {
+            std::cerr << "Can't create " << newIndexPath << std::endl;
+            unlink(newIndexPath.c_str());
+            return 1;
+        }
+    }
+
+    // Unallocated chunks read as zeroes; dec only skips those that enc did
+    // record as zero.
+    auto unallocated = [&](const uint64_t offset) {
+        return (
+            !options.AllocMap.empty()
+            && !allocated.Overlaps(offset, offset + chunkSize)
+            && ((options.Mode == MODE_ENCRYPT) || (sparseFile && FindSparse(*sparseFile, offset)))
+        );
+    };
+
+    // Batches are multiples of 64 chunks, so every worker owns whole words
+    // of the zero bitmap.
+    const size_t batchChunks(std::max<size_t>(64, ((1 << 20) / chunkSize + 63) / 64 * 64));
+    const size_t batchSize(batchChunks * chunkSize);
+    const size_t srcDepth(options.SrcDepth ? options.SrcDepth : options.Threads);
+    const size_t dstDepth(options.DstDepth ? options.DstDepth : options.Threads);
+    std::vector<uint64_t> zeroBits((chunkCount + 63) / 64, 0);
+    std::atomic<uint64_t> nextChunk(0);
+    std::atomic<uint64_t> written(0);
+    std::atomic<uint64_t> discarded(0);
+    std::atomic<bool> failed(false);
+    TProgress progress(src.Size());
+    TRateLimiter limiter(options.Rate);
+    TPerfCollector perfCollector;
+    TConcurrencyController controller(options.MinThreads, options.Threads, options.InitialThreads, options.Adaptive);
+
+    // Every batch holds one input and one output buffer from being read
+    // until it is written, so the pools bound the batches in flight.
+    TPipe<TAlignedBuffer> freeIn(srcDepth + options.Threads + dstDepth);
+    TPipe<TAlignedBuffer> freeOut(options.Threads + dstDepth);
+    TPipe<TCopyJob> ready(srcDepth);
+    TPipe<TCopyJob> pending(dstDepth);
+
+    auto fail = [&]() {
+        failed = true;
+        freeIn.Close();
+        freeOut.Close();
+        ready.Close();
+        pending.Close();
+    };
+
+    // Without samples (always so in a dry run) the verifier reads nothing.
+    // A mismatch fails the copy like any other error.
+    TVerifier verifier(options.Mode, keys, (verifyDst ? *verifyDst : src), &badBlocks, chunkSize, verifySample, fail);
+
+    for (size_t i = 0; i < (srcDepth + options.Threads + dstDepth); ++i) {
+        TAlignedBuffer buf(batchSize);
+
+        if (buf) {
+            memset(buf.Data(), 0, buf.Size());
+        }
+
+        freeIn.Push(std::move(buf));
+    }
+
+    for (size_t i = 0; i < (options.Threads + dstDepth); ++i) {
+        TAlignedBuffer buf(batchSize);
+
+        if (buf) {
+            memset(buf.Data(), 0, buf.Size());
+        }
+
+        freeOut.Push(std::move(buf));
+    }
+
+    // Readers keep --src-depth reads in flight, ahead of the cipher workers.
+    auto reader = [&]() {
+        affinity.Pin();
+
+        while (!failed) {
+            const uint64_t first(nextChunk.fetch_add(batchChunks));
+
+            if (first >= chunkCount) {
+                break;
+            }
+
+            TCopyJob job;
+
+            job.First = first;
+            job.Count = std::min<uint64_t>(batchChunks, chunkCount - first);
+
+            if (!freeIn.Pop(job.In)) {
+                break;
+            }
+
+            const uint64_t offset(first * chunkSize);
+
+            limiter.Acquire(job.Count * chunkSize);
+
+            if (options.Readahead > 0) {
+                src.Advise(offset + job.Count * chunkSize, options.Readahead * batchSize, POSIX_FADV_WILLNEED);
+            }
+
+            const size_t size(job.Count * chunkSize);
+            bool ok(job.In);
+
+            for (size_t pos = 0; ok && (pos < size);) {
+                size_t end(pos);
+
+                while ((end < size) && !unallocated(offset + end) && !bad(offset + end)) {
+                    end += chunkSize;
+                }
+
+                ok = ((end == pos) || src.Read(offset + pos, end - pos, job.In.Data() + pos));
+
+                for (pos = end; (pos < size) && (unallocated(offset + pos) || bad(offset + pos)); pos += chunkSize) {
+                    memset(job.In.Data() + pos, 0, chunkSize);
+                }
+            }
+
+            if (!ok) {
+                std::cerr << "Failed at " << std::to_string(offset) << ": can't read file" << std::endl;
+                fail();
+                break;
+            }
+
+            // The source is read exactly once.
+            src.Advise(offset, job.Count * chunkSize, POSIX_FADV_DONTNEED);
+
+            if (!ready.Push(std::move(job))) {
+                break;
+            }
+        }
+    };
+
+    auto worker = [&]() {
+        affinity.Pin();
+
+        TChunkCipher cipher(options.Mode, keys);
+        std::vector<char> fingerprints(batchChunks * FingerprintSize);
+        TPerfCounters perf(options.Perf ? &perfCollector : nullptr);
+
+        if (!cipher) {
+            fail();
+            return;
+        }
+
+        auto process = [&](TCopyJob& job) {
+            const uint64_t first(job.First);
+            const size_t count(job.Count);
+            const uint64_t offset(first * chunkSize);
+            const char* in(job.In.Data());
+            char* out(job.Out.Data());
+
+            // Adjacent chunks of the same kind are written, or punched out,
+            // with one call.
+            auto add = [](std::vector<std::pair<size_t, size_t>>& runs, const size_t i) {
+                if (!runs.empty() && ((runs.back().first + runs.back().second) == i)) {
+                    ++runs.back().second;
+
+                } else {
+                    runs.emplace_back(i, 1);
+                }
+            };
+
+            for (size_t i = 0; i < count; ++i) {
+                const uint64_t chunkOffset(offset + i * chunkSize);
+                const char* chunk(in + i * chunkSize);
+                char* block(out + i * chunkSize);
+                char* fingerprint(fingerprints.data() + i * FingerprintSize);
+                bool allZeroes(false);
+
+                if (bad(chunkOffset)) {
+                    memset(fingerprint, 0, FingerprintSize);
+                    badBlocks.Skip(chunkSize);
+                    continue;
+                }
+
+                perf.Start();
+
+                if (options.Mode == MODE_ENCRYPT) {
+                    allZeroes = std::all_of(chunk, chunk + chunkSize, [](const char chr) { return (chr == 0); });
+
+                } else if (sparseFile) {
+                    allZeroes = FindSparse(*sparseFile, chunkOffset);
+                }
+
+                perf.Lap(PERF_STAGE_ZERO, chunkSize);
+
+                if (allZeroes) {
+                    zeroBits[(first + i) / 64] |= ((uint64_t)1 << ((first + i) % 64));
+                }
+
+                Fingerprint(chunk, chunkSize, fingerprint);
+                perf.Lap(PERF_STAGE_FINGERPRINT, chunkSize);
+
+                const bool unchanged(prevIndex && (0 == memcmp(
+                    prevIndex->Data() + FingerprintHeaderSize + (first + i) * FingerprintSize,
+                    fingerprint,
+                    FingerprintSize
+                )));
+
+                if (unchanged || (allZeroes && !outputExisted)) {
+                    continue;
+                }
+
+                if (allZeroes && options.Discard) {
+                    add(job.Discards, i);
+                    continue;
+                }
+
+                if (allZeroes) {
+                    memset(block, 0, chunkSize);
+
+                } else if (!cipher.Process(chunkOffset, chunkSize, chunk, block)) {
+                    return false;
+
+                } else {
+                    perf.Lap(PERF_STAGE_CIPHER, chunkSize);
+                }
+
+                if (verifier) {
+                    job.Sampled.emplace_back(i, !allZeroes);
+                }
+
+                add(job.Writes, i);
+            }
+
+            if (newIndex && !newIndex->Write(FingerprintHeaderSize + first * FingerprintSize, count * FingerprintSize, fingerprints.data())) {
+                std::cerr << "Failed at " << std::to_string(offset) << ": can't save fingerprints" << std::endl;
+                return false;
+            }
+
+            return true;
+        };
+
+        while (!failed) {
+            TCopyJob job;
+
+            controller.Acquire();
+
+            if (!ready.Pop(job) || !freeOut.Pop(job.Out)) {
+                controller.Release(0, {});
+                break;
+            }
+
+            const auto started = std::chrono::steady_clock::now();
+
+            if (!job.Out || !process(job)) {
+                controller.Release(0, {});
+                fail();
+                break;
+            }
+
+            controller.Release((job.Count * chunkSize), std::chrono::steady_clock::now() - started);
+
+            if (!pending.Push(std::move(job))) {
+                break;
+            }
+        }
+    };
+
+    // Writers keep --dst-depth writes in flight and hand the buffers back.
+    auto writer = [&]() {
+        affinity.Pin();
+
+        TCopyJob job;
+
+        while (!failed && pending.Pop(job)) {
+            const uint64_t offset(job.First * chunkSize);
+
+            for (const auto& run : job.Writes) {
+                const uint64_t runOffset(offset + run.first * chunkSize);
+                const size_t size(run.second * chunkSize);
+
+                if (!options.DryRun && !dst->Write(runOffset, size, job.Out.Data() + run.first * chunkSize)) {
+                    std::cerr << "Failed at " << std::to_string(runOffset) << ": can't write to output" << std::endl;
+                    fail();
+                    return;
+                }
+
+                written += size;
+            }
+
+            for (const auto& run : job.Discards) {
+                const uint64_t runOffset(offset + run.first * chunkSize);
+                const size_t size(run.second * chunkSize);
+
+                if (!options.DryRun && !dst->PunchHole(runOffset, size)) {
+                    std::cerr << "Failed at " << std::to_string(runOffset) << ": can't discard output" << std::endl;
+                    fail();
+                    return;
+                }
+
+                discarded += size;
+            }
+
+            for (const auto& it : job.Sampled) {
+                verifier.Sample(offset + it.first * chunkSize, (it.second ? job.In.Data() + it.first * chunkSize : nullptr), job.Out.Data() + it.first * chunkSize);
+            }
+
+            if (!options.DryRun) {
+                dst->Advise(offset, job.Count * chunkSize, POSIX_FADV_DONTNEED);
+            }
+
+            progress.Add(job.Count * chunkSize);
+            affinity.Account(job.Count * chunkSize);
+
+            freeIn.Push(std::move(job.In));
+            freeOut.Push(std::move(job.Out));
+            job = TCopyJob();
+        }
+    };
+
+    controller.Start();
+    verifier.Start();
+
+    std::thread readers([&]() {
+        RunThreads(srcDepth, [&](size_t) {
+            reader();
+        });
+
+        ready.Close();
+    });
+
+    std::thread writers([&]() {
+        RunThreads(dstDepth, [&](size_t) {
+            writer();
+        });
+    });
+
+    RunThreads(options.Threads, [&](size_t) {
+        worker();
+    });
+
+    pending.Close();
+    readers.join();
+    writers.join();
+
+    controller.Stop();
+    verifier.Stop();
+    verifier.Report();
+    badBlocks.Report();
+    perfCollector.Report();
+
+    affinity.Report();
+
+    if (failed) {
+        if (newIndex) {
+            unlink(newIndexPath.c_str());
+        }
+
+        return 1;
+    }
+
+    if (!options.DryRun) {
+        if (!dst->FSync()) {
+            std::cerr << "Can't sync output" << std::endl;
+            unlink(newIndexPath.c_str());
+            return 1;
+        }
+
+        if (options.Mode == MODE_ENCRYPT) {
+            const bool ok(CreateFileWith(sparsePath.string(), [&](NAC::TFile& file) {
+                for (uint64_t i = 0; i < chunkCount; ++i) {
+                    if (zeroBits[i / 64] & ((uint64_t)1 << (i % 64))) {
+                        const uint64_t tmp(NAC::hton(i * chunkSize));
+
+                        file.Append(sizeof(tmp), (const char*)&tmp);
+                    }
+                }
+
+                return (bool)file;
+            }));
+
+            if (!ok) {
+                return 1;
+            }
+        }
+
+        // Taken after the last write, so that the next run finds it as is
+        // unless something else changed the output since.
+        char identity[FingerprintIdentitySize];
+
+        if (!GetOutputIdentity(*dst, identity) || !newIndex->Write(sizeof(FingerprintMagic) + sizeof(uint64_t), sizeof(identity), identity)) {
+            std::cerr << "Can't save " << indexPath.string() << std::endl;
+            unlink(newIndexPath.c_str());
+            return 1;
+        }
+
+        if (!newIndex->FSync() || (rename(newIndexPath.c_str(), indexPath.c_str()) != 0)) {
+            std::cerr << "Can't save " << indexPath.string() << std::endl;
+            unlink(newIndexPath.c_str());
+            return 1;
+        }
+
+        newIndex->Advise(0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    std::cerr << "Written " << written << " of " << src.Size() << " byte(s)";
+
+    if (options.Discard) {
+        std::cerr << ", discarded " << discarded;
+    }
+
+    std::cerr << std::endl;
+    std::cerr << "Success!" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "options.hpp"
+
+// Writes the converted contents of DevPath to OutputPath and leaves the
+// source intact, so no journal is needed. A fingerprint of every source chunk
+// is kept in the workdir; with Delta, chunks whose fingerprint did not change
+// since the previous run are not converted or written again.
+//
+// Reads, conversion and writes run as separate stages, so the source and the
+// destination each keep their own number of requests in flight (SrcDepth,
+// DstDepth). With Discard, zero chunks of an existing output are punched out
+// rather than written.
+int RunCopy(const TOptions& options);
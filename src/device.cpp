@@ -0,0 +1,279 @@
+#include "device.hpp"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+TAlignedBuffer::TAlignedBuffer(const size_t size, const size_t alignment) {
+    void* addr(nullptr);
+
+    if (posix_memalign(&addr, alignment, size) == 0) {
+        Addr = (char*)addr;
+        Len = size;
+    }
+}
+
+TAlignedBuffer::~TAlignedBuffer() {
+    free(Addr);
+}
+
+TAlignedBuffer::TAlignedBuffer(TAlignedBuffer&& right)
+    : Addr(right.Addr)
+    , Len(right.Len)
+{
+    right.Addr = nullptr;
+    right.Len = 0;
+}
+
+TAlignedBuffer& TAlignedBuffer::operator=(TAlignedBuffer&& right) {
+    if (this != &right) {
+        free(Addr);
+
+        Addr = right.Addr;
+        Len = right.Len;
+
+        right.Addr = nullptr;
+        right.Len = 0;
+    }
+
+    return *this;
+}
+
+TDevice::TDevice(const std::string& path, const int flags, const mode_t perms)
+    : Path_(path)
+{
+    Fd = open(path.c_str(), flags | O_CLOEXEC, perms);
+
+    if (Fd < 0) {
+        perror("open");
+        return;
+    }
+
+    struct stat st;
+
+    if (fstat(Fd, &st) != 0) {
+        perror("fstat");
+        close(Fd);
+        Fd = -1;
+        return;
+    }
+
+    Regular = S_ISREG(st.st_mode);
+
+    if (Regular) {
+        Size_ = st.st_size;
+
+    } else if (S_ISBLK(st.st_mode)) {
+        if (ioctl(Fd, BLKGETSIZE64, &Size_) != 0) {
+            perror("ioctl(BLKGETSIZE64)");
+            close(Fd);
+            Fd = -1;
+            return;
+        }
+
+        int sectorSize(0);
+
+        if ((ioctl(Fd, BLKSSZGET, &sectorSize) == 0) && (sectorSize > 0)) {
+            SectorSize_ = sectorSize;
+        }
+
+    } else {
+        const off_t end(lseek(Fd, 0, SEEK_END));
+
+        if (end < 0) {
+            perror("lseek");
+            close(Fd);
+            Fd = -1;
+            return;
+        }
+
+        Size_ = end;
+    }
+}
+
+TDevice::~TDevice() {
+    if (Fd >= 0) {
+        close(Fd);
+    }
+}
+
+bool TDevice::Truncate(const uint64_t size) {
+    if (ftruncate(Fd, size) != 0) {
+        perror("ftruncate");
+        return false;
+    }
+
+    Size_ = size;
+
+    return true;
+}
+
+bool TDevice::Read(const uint64_t offset, const size_t size, char* out) const {
+    size_t done(0);
+
+    while (done < size) {
+        const ssize_t rv(pread(Fd, out + done, size - done, offset + done));
+
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("pread");
+            return false;
+        }
+
+        if (rv == 0) {
+            return false;
+        }
+
+        done += rv;
+    }
+
+    return true;
+}
+
+bool TDevice::Write(const uint64_t offset, const size_t size, const char* in) const {
+    size_t done(0);
+
+    while (done < size) {
+        const ssize_t rv(pwrite(Fd, in + done, size - done, offset + done));
+
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("pwrite");
+            return false;
+        }
+
+        done += rv;
+    }
+
+    return true;
+}
+
+bool TDevice::FSync() const {
+    if (fsync(Fd) != 0) {
+        perror("fsync");
+        return false;
+    }
+
+    return true;
+}
+
+void TDevice::Advise(const uint64_t offset, const uint64_t size, const int advice) const {
+    posix_fadvise(Fd, offset, size, advice);
+}
+
+bool TDevice::CloneRange(const TDevice& src, const uint64_t srcOffset, const uint64_t size, const uint64_t offset) const {
+    file_clone_range range;
+
+    range.src_fd = src.GetFd();
+    range.src_offset = srcOffset;
+    range.src_length = size;
+    range.dest_offset = offset;
+
+    return (ioctl(Fd, FICLONERANGE, &range) == 0);
+}
+
+bool TDevice::PunchHole(const uint64_t offset, const uint64_t size) const {
+    if (fallocate(Fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) != 0) {
+        perror("fallocate");
+        return false;
+    }
+
+    return true;
+}
+
+TMapping::~TMapping() {
+    if (Addr) {
+        munmap(Addr, Len);
+    }
+}
+
+bool TMapping::Map(const TDevice& dev, const bool writable) {
+    if (dev.Size() == 0) {
+        return false;
+    }
+
+    void* addr(mmap(nullptr, dev.Size(), (PROT_READ | (writable ? PROT_WRITE : 0)), MAP_SHARED, dev.GetFd(), 0));
+
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    Addr = (char*)addr;
+    Len = dev.Size();
+
+    madvise(Addr, Len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Only some filesystems back shared file mappings with huge pages;
+    // elsewhere this is a harmless no-op.
+    madvise(Addr, Len, MADV_HUGEPAGE);
+#endif
+
+    return true;
+}
+
+static void PageRange(const uint64_t offset, const uint64_t size, const uint64_t limit, uint64_t& begin, uint64_t& end) {
+    const uint64_t page(sysconf(_SC_PAGESIZE));
+
+    begin = offset / page * page;
+    end = std::min(limit, offset + size);
+}
+
+void TMapping::Advise(const uint64_t offset, const uint64_t size, const int advice) const {
+    uint64_t begin(0);
+    uint64_t end(0);
+
+    PageRange(offset, size, Len, begin, end);
+
+    if (begin < end) {
+        madvise(Addr + begin, end - begin, advice);
+    }
+}
+
+bool TMapping::Sync(const uint64_t offset, const uint64_t size) const {
+    uint64_t begin(0);
+    uint64_t end(0);
+
+    PageRange(offset, size, Len, begin, end);
+
+    if ((begin < end) && (msync(Addr + begin, end - begin, MS_SYNC) != 0)) {
+        perror("msync");
+        return false;
+    }
+
+    return true;
+}
+
+bool ReadAligned(const TDevice& dev, const uint64_t offset, const size_t size, std::string& out) {
+    static const uint64_t alignment(4096);
+
+    const uint64_t begin(offset / alignment * alignment);
+    const uint64_t end(std::min<uint64_t>(dev.Size(), (offset + size + alignment - 1) / alignment * alignment));
+
+    if ((offset + size) > end) {
+        return false;
+    }
+
+    TAlignedBuffer buf(end - begin, alignment);
+
+    if (!buf || !dev.Read(begin, end - begin, buf.Data())) {
+        return false;
+    }
+
+    out.assign(buf.Data() + (offset - begin), size);
+
+    return true;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+class TAlignedBuffer {
+public:
+    TAlignedBuffer() = default;
+    explicit TAlignedBuffer(const size_t size, const size_t alignment = 4096);
+    ~TAlignedBuffer();
+
+    TAlignedBuffer(TAlignedBuffer&& right);
+    TAlignedBuffer& operator=(TAlignedBuffer&& right);
+
+    TAlignedBuffer(const TAlignedBuffer&) = delete;
+    TAlignedBuffer& operator=(const TAlignedBuffer&) = delete;
+
+    explicit operator bool() const {
+        return Addr;
+    }
+
+    char* Data() const {
+        return Addr;
+    }
+
+    size_t Size() const {
+        return Len;
+    }
+
+private:
+    char* Addr = nullptr;
+    size_t Len = 0;
+};
+
+// Thin positional I/O wrapper around a file or a block device. Unlike
+// NAC::TFile it never maps the target and leaves the caller in charge of
+// buffers, which lets several threads work on one target at once.
+class TDevice {
+public:
+    TDevice() = default;
+    TDevice(const std::string& path, const int flags, const mode_t perms = 0600);
+    ~TDevice();
+
+    TDevice(const TDevice&) = delete;
+    TDevice& operator=(const TDevice&) = delete;
+
+    explicit operator bool() const {
+        return (Fd >= 0);
+    }
+
+    int GetFd() const {
+        return Fd;
+    }
+
+    const std::string& Path() const {
+        return Path_;
+    }
+
+    uint64_t Size() const {
+        return Size_;
+    }
+
+    bool IsRegular() const {
+        return Regular;
+    }
+
+    size_t SectorSize() const {
+        return SectorSize_;
+    }
+
+    bool Truncate(const uint64_t size);
+    bool Read(const uint64_t offset, const size_t size, char* out) const;
+    bool Write(const uint64_t offset, const size_t size, const char* in) const;
+    bool FSync() const;
+
+    // posix_fadvise() hint; a no-op for targets opened with O_DIRECT.
+    void Advise(const uint64_t offset, const uint64_t size, const int advice) const;
+
+    // Shares size bytes of src at srcOffset into this file at offset
+    // (FICLONERANGE). Fails quietly where reflinks are unsupported, e.g.
+    // across filesystems or with unaligned ranges; errno tells why.
+    bool CloneRange(const TDevice& src, const uint64_t srcOffset, const uint64_t size, const uint64_t offset) const;
+
+    // Deallocates a range so that it reads back as zeroes: a hole in a
+    // regular file, an unmapping write-zeroes on a block device. Unlike
+    // BLKDISCARD it never leaves stale data behind.
+    bool PunchHole(const uint64_t offset, const uint64_t size) const;
+
+private:
+    std::string Path_;
+    int Fd = -1;
+    uint64_t Size_ = 0;
+    size_t SectorSize_ = 512;
+    bool Regular = false;
+};
+
+// Reads `size` bytes at any offset by way of an aligned buffer, for small
+// on-disk structures read through an O_DIRECT descriptor.
+bool ReadAligned(const TDevice& dev, const uint64_t offset, const size_t size, std::string& out);
+
+// MAP_SHARED view of a whole regular file. I/O errors on the mapping raise
+// SIGBUS instead of failing a call, so it is only meant for healthy media.
+class TMapping {
+public:
+    TMapping() = default;
+    ~TMapping();
+
+    TMapping(const TMapping&) = delete;
+    TMapping& operator=(const TMapping&) = delete;
+
+    bool Map(const TDevice& dev, const bool writable);
+
+    explicit operator bool() const {
+        return Addr;
+    }
+
+    char* Data() const {
+        return Addr;
+    }
+
+    uint64_t Size() const {
+        return Len;
+    }
+
+    // madvise() hint for a range; rounded out to whole pages.
+    void Advise(const uint64_t offset, const uint64_t size, const int advice) const;
+
+    // msync(MS_SYNC) of a range; rounded out to whole pages.
+    bool Sync(const uint64_t offset, const uint64_t size) const;
+
+private:
+    char* Addr = nullptr;
+    uint64_t Len = 0;
+};
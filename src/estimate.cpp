@@ -0,0 +1,397 @@
+#include "estimate.hpp"
+#include "convert.hpp"
+#include "device.hpp"
+#include "state.hpp"
+
+#include <ac-common/file.hpp>
+#include <ac-common/utils/htonll.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <string.h>
+
+static const size_t EstimateSamples(4096);
+static const size_t EstimateSeqRuns(4);
+static const uint64_t EstimateSeqRunSize(16 << 20);
+static const size_t EstimateJournalFiles(256);
+static const std::chrono::milliseconds EstimateCipherTime(200);
+static const double EstimateZ(1.96);
+
+namespace {
+    using TClock = std::chrono::steady_clock;
+
+    double Seconds(const TClock::time_point since) {
+        return std::chrono::duration<double>(TClock::now() - since).count();
+    }
+
+    std::string FormatDuration(double seconds) {
+        const uint64_t total(seconds + 0.5);
+        std::string out;
+
+        if (total >= 3600) {
+            out += std::to_string(total / 3600) + "h ";
+        }
+
+        if (total >= 60) {
+            out += std::to_string((total / 60) % 60) + "m ";
+        }
+
+        return out + std::to_string(total % 60) + "s";
+    }
+
+    struct TRemaining {
+        uint64_t Begin = 0;
+        uint64_t End = 0;
+        uint64_t SparseChunks = 0;
+        bool HasSparse = false;
+    };
+
+    struct TCosts {
+        double SeqRead = 0;
+        double Cipher = 0;
+        double Journal = 0;
+        double JournalError = 0;
+        double FSync = 0;
+    };
+}
+
+int RunEstimate(const TOptions& options) {
+    const size_t chunkSize(options.ChunkSize);
+    const stdfs::path wd(options.WorkdirPath);
+    const std::string modeName((options.Mode == MODE_ENCRYPT) ? "enc" : "dec");
+    const bool inPlace(options.OutputPath.empty());
+
+    TDevice dev(options.DevPath, O_RDONLY | O_DIRECT);
+
+    if (!dev) {
+        std::cerr << "Can't open file" << std::endl;
+        return 1;
+    }
+
+    // State on the target means journal slots that aren't modelled here,
+    // and the area itself would count as data.
+    TTargetState target(dev);
+
+    if (!target.Load()) {
+        return 1;
+    }
+
+    if (target.Exists()) {
+        std::cerr << "Estimates (--estimate) don't work on a target with conversion state on it" << std::endl;
+        return 1;
+    }
+
+    std::vector<TRange> ranges;
+
+    if (!BuildRanges(options, dev, wd, ranges)) {
+        return 1;
+    }
+
+    // Only what is left of each range counts; a dec run knows its zero
+    // chunks exactly from the sparse list.
+    std::vector<TRemaining> remaining;
+    uint64_t totalBytes(0);
+
+    for (const auto& range : ranges) {
+        TRemaining it;
+        const auto offsetPath = range.StateDir / (modeName + "_offset");
+        const auto sparsePath = range.StateDir / "enc_sparse";
+
+        it.Begin = range.Begin;
+        it.End = range.End;
+
+        if (inPlace && stdfs::exists(offsetPath)) {
+            NAC::TFile file(offsetPath.string());
+            uint64_t offset(0);
+
+            if (file && (file.Size() == sizeof(offset))) {
+                memcpy(&offset, file.Data(), sizeof(offset));
+                it.Begin = std::min(it.End, std::max(it.Begin, NAC::ntoh(offset)));
+            }
+        }
+
+        if ((options.Mode == MODE_DECRYPT) && stdfs::exists(sparsePath)) {
+            it.HasSparse = true;
+
+            if (!stdfs::is_empty(sparsePath)) {
+                NAC::TFile file(sparsePath.string());
+
+                for (size_t i = 0; file && ((i + sizeof(uint64_t)) <= file.Size()); i += sizeof(uint64_t)) {
+                    uint64_t offset;
+
+                    memcpy(&offset, file.Data() + i, sizeof(offset));
+                    offset = NAC::ntoh(offset);
+
+                    if ((offset >= it.Begin) && (offset < it.End)) {
+                        ++it.SparseChunks;
+                    }
+                }
+            }
+        }
+
+        totalBytes += it.End - it.Begin;
+        remaining.push_back(it);
+    }
+
+    if (totalBytes == 0) {
+        std::cerr << "Already done" << std::endl;
+        return 0;
+    }
+
+    TKeyMaterial keys;
+
+    if (!MakeScratchKeyMaterial(wd, options.IVMode, keys)) {
+        return 1;
+    }
+
+    // Chained ranges run one batch at a time each.
+    const size_t parallel(std::max<size_t>(1, ((inPlace && (keys.IVMode == IV_MODE_CHAIN)) ? std::min(options.Threads, ranges.size()) : options.Threads)));
+    const size_t cpuParallel(std::min<size_t>(parallel, std::max(1u, std::thread::hardware_concurrency())));
+    std::atomic<bool> failed(false);
+
+    // Zero fraction from random chunks.
+    uint64_t samples(0);
+    uint64_t zeroSamples(0);
+    bool allKnown(true);
+
+    for (const auto& it : remaining) {
+        allKnown = allKnown && it.HasSparse;
+    }
+
+    if (!allKnown) {
+        std::vector<uint64_t> offsets;
+        std::mt19937_64 rng(std::random_device{}());
+        std::uniform_int_distribution<uint64_t> dis(0, totalBytes / chunkSize - 1);
+
+        for (size_t i = 0; i < EstimateSamples; ++i) {
+            uint64_t pos(dis(rng) * chunkSize);
+
+            for (const auto& it : remaining) {
+                if (pos < (it.End - it.Begin)) {
+                    offsets.push_back(it.Begin + pos);
+                    break;
+                }
+
+                pos -= it.End - it.Begin;
+            }
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<uint64_t> zeroes(0);
+
+        RunThreads(options.Threads, [&](size_t) {
+            TAlignedBuffer buf(chunkSize);
+
+            for (size_t i = next++; !failed && (i < offsets.size()); i = next++) {
+                if (!dev.Read(offsets[i], chunkSize, buf.Data())) {
+                    std::cerr << "Failed at " << std::to_string(offsets[i]) << ": can't read file" << std::endl;
+                    failed = true;
+                    break;
+                }
+
+                if (std::all_of(buf.Data(), buf.Data() + chunkSize, [](const char chr) { return (chr == 0); })) {
+                    ++zeroes;
+                }
+            }
+        });
+
+        samples = offsets.size();
+        zeroSamples = zeroes;
+    }
+
+    if (failed) {
+        return 1;
+    }
+
+    TCosts costs;
+
+    // Sequential reads, a few runs of consecutive batches at random places.
+    {
+        const size_t batchSize(std::max<size_t>(1, (1 << 20) / chunkSize) * chunkSize);
+        const uint64_t runSize(std::min<uint64_t>(EstimateSeqRunSize, dev.Size()) / batchSize * batchSize);
+        std::vector<uint64_t> batches;
+        std::mt19937_64 rng(std::random_device{}());
+
+        for (size_t run = 0; (run < EstimateSeqRuns) && (runSize > 0); ++run) {
+            const uint64_t begin(std::uniform_int_distribution<uint64_t>(0, (dev.Size() - runSize) / chunkSize)(rng) * chunkSize);
+
+            for (uint64_t pos = 0; pos < runSize; pos += batchSize) {
+                batches.push_back(begin + pos);
+            }
+        }
+
+        std::atomic<size_t> next(0);
+        const auto started = TClock::now();
+
+        RunThreads(parallel, [&](size_t) {
+            TAlignedBuffer buf(batchSize);
+
+            for (size_t i = next++; !failed && (i < batches.size()); i = next++) {
+                if (!dev.Read(batches[i], batchSize, buf.Data())) {
+                    std::cerr << "Failed at " << std::to_string(batches[i]) << ": can't read file" << std::endl;
+                    failed = true;
+                }
+            }
+        });
+
+        costs.SeqRead = (batches.size() * batchSize) / std::max(1e-6, Seconds(started));
+    }
+
+    if (failed) {
+        return 1;
+    }
+
+    // Cipher throughput of one thread.
+    {
+        TChunkCipher cipher(options.Mode, keys);
+        std::vector<char> in(chunkSize, 1);
+        std::vector<char> out(chunkSize);
+        uint64_t bytes(0);
+        const auto started = TClock::now();
+
+        if (!cipher) {
+            return 1;
+        }
+
+        while ((TClock::now() - started) < EstimateCipherTime) {
+            for (size_t i = 0; i < 64; ++i) {
+                if (!cipher.Process(bytes, chunkSize, in.data(), out.data())) {
+                    return 1;
+                }
+
+                bytes += chunkSize;
+            }
+        }
+
+        costs.Cipher = bytes / Seconds(started);
+    }
+
+    // Journal files and fsync()s in the workdir, with the run's parallelism.
+    if (inPlace) {
+        std::vector<double> latencies(EstimateJournalFiles);
+        std::atomic<size_t> next(0);
+        const std::vector<char> chunk(chunkSize, 1);
+        const auto started = TClock::now();
+
+        RunThreads(parallel, [&](size_t) {
+            for (size_t i = next++; !failed && (i < latencies.size()); i = next++) {
+                const std::string path((wd / (".estimate-" + std::to_string(i))).string());
+                const auto t0 = TClock::now();
+
+                if (!CreateFile(path, chunkSize, chunk.data())) {
+                    failed = true;
+                    break;
+                }
+
+                unlink(path.c_str());
+                latencies[i] = Seconds(t0);
+            }
+        });
+
+        if (failed) {
+            return 1;
+        }
+
+        const double elapsed(Seconds(started));
+        double mean(0);
+        double var(0);
+
+        for (const double it : latencies) {
+            mean += it;
+        }
+
+        mean /= latencies.size();
+
+        for (const double it : latencies) {
+            var += (it - mean) * (it - mean);
+        }
+
+        var /= (latencies.size() - 1);
+
+        costs.Journal = elapsed / latencies.size();
+        costs.JournalError = EstimateZ * std::sqrt(var / latencies.size()) / std::max<size_t>(1, parallel);
+        costs.FSync = mean;
+    }
+
+    // Zero fraction with a normal-approximation interval, or exact for dec.
+    double zero(0);
+    double zeroLow(0);
+    double zeroHigh(0);
+
+    if (allKnown) {
+        uint64_t sparse(0);
+
+        for (const auto& it : remaining) {
+            sparse += it.SparseChunks;
+        }
+
+        zero = zeroLow = zeroHigh = (double)sparse / (totalBytes / chunkSize);
+
+    } else {
+        zero = (double)zeroSamples / samples;
+
+        const double error(EstimateZ * std::sqrt(zero * (1 - zero) / samples) + 0.5 / samples);
+
+        zeroLow = std::max(0.0, zero - error);
+        zeroHigh = std::min(1.0, zero + error);
+    }
+
+    const double batches((double)totalBytes / (std::max<size_t>(1, (1 << 20) / chunkSize) * chunkSize));
+
+    auto predict = [&](const double zeroFraction, const double journal) {
+        const double dataBytes(totalBytes * (1 - zeroFraction));
+        // The target is read once and written where there is data; writes
+        // are assumed to go as fast as reads.
+        double seconds((totalBytes + dataBytes) / costs.SeqRead);
+
+        seconds += dataBytes / (costs.Cipher * cpuParallel);
+
+        if (inPlace && (options.Resilience == RESILIENCE_REFLINK)) {
+            // A reflinked and fsync()ed clone per batch instead of a journal
+            // file per chunk; assumes reflinks work on the target.
+            seconds += batches * costs.FSync * (1 + 2.0 / parallel);
+
+        } else if (inPlace) {
+            // One journal file per data chunk, one device and one offset
+            // fsync() per batch.
+            seconds += (dataBytes / chunkSize) * journal;
+            seconds += batches * costs.FSync * (1 + 1.0 / parallel);
+        }
+
+        if (options.Rate > 0) {
+            seconds = std::max(seconds, (double)totalBytes / options.Rate);
+        }
+
+        return seconds;
+    };
+
+    const double MiB(1024 * 1024);
+
+    if (allKnown) {
+        std::cerr << "Zero chunks: " << (zero * 100) << "% (from the sparse list)" << std::endl;
+
+    } else {
+        std::cerr
+            << "Sampled " << samples << " chunk(s): " << (zero * 100) << "% zero (95% CI "
+            << (zeroLow * 100) << "-" << (zeroHigh * 100) << "%)" << std::endl;
+    }
+
+    std::cerr << "Sequential read: " << (costs.SeqRead / MiB) << " MiB/s with " << parallel << " thread(s)" << std::endl;
+    std::cerr << "Cipher (" << IVModeName(keys.IVMode) << "): " << (costs.Cipher / MiB) << " MiB/s per thread, " << cpuParallel << " thread(s)" << std::endl;
+
+    if (inPlace) {
+        std::cerr << "Journal: " << (costs.Journal * 1e3) << " ms per chunk, fsync() " << (costs.FSync * 1e3) << " ms" << std::endl;
+    }
+
+    std::cerr
+        << "Estimated runtime for " << totalBytes << " byte(s): " << FormatDuration(predict(zero, costs.Journal))
+        << " (95% CI " << FormatDuration(predict(zeroHigh, std::max(0.0, costs.Journal - costs.JournalError)))
+        << " - " << FormatDuration(predict(zeroLow, costs.Journal + costs.JournalError)) << ")" << std::endl;
+
+    return 0;
+}
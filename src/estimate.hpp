@@ -0,0 +1,8 @@
+#pragma once
+
+#include "options.hpp"
+
+// Predicts the runtime of a conversion without touching the target or the
+// workdir state: samples random chunks for the zero fraction and measures
+// sequential reads, the cipher and journal writes in isolation.
+int RunEstimate(const TOptions& options);
@@ -0,0 +1,63 @@
+#include "extents.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+void TExtentMap::Add(const uint64_t begin, const uint64_t end) {
+    if (begin >= end) {
+        return;
+    }
+
+    // Extents mostly come in order, so most of them just grow the last one.
+    if (!Extents.empty() && (Extents.back().first <= begin) && (begin <= Extents.back().second)) {
+        Extents.back().second = std::max(Extents.back().second, end);
+        return;
+    }
+
+    Extents.emplace_back(begin, end);
+}
+
+void TExtentMap::Finish() {
+    std::sort(Extents.begin(), Extents.end());
+
+    size_t last(0);
+
+    for (size_t i = 1; i < Extents.size(); ++i) {
+        if (Extents[i].first <= Extents[last].second) {
+            Extents[last].second = std::max(Extents[last].second, Extents[i].second);
+
+        } else {
+            Extents[++last] = Extents[i];
+        }
+    }
+
+    if (!Extents.empty()) {
+        Extents.resize(last + 1);
+    }
+}
+
+bool TExtentMap::Overlaps(const uint64_t begin, const uint64_t end) const {
+    auto it = std::upper_bound(Extents.begin(), Extents.end(), std::pair<uint64_t, uint64_t>(begin, UINT64_MAX));
+
+    if ((it != Extents.begin()) && (std::prev(it)->second > begin)) {
+        return true;
+    }
+
+    return ((it != Extents.end()) && (it->first < end));
+}
+
+bool TExtentMap::Covers(const uint64_t begin, const uint64_t end) const {
+    auto it = std::upper_bound(Extents.begin(), Extents.end(), std::pair<uint64_t, uint64_t>(begin, UINT64_MAX));
+
+    return ((it != Extents.begin()) && (std::prev(it)->second >= end));
+}
+
+uint64_t TExtentMap::Bytes() const {
+    uint64_t out(0);
+
+    for (const auto& it : Extents) {
+        out += it.second - it.first;
+    }
+
+    return out;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorted, non-overlapping [begin, end) extents of a target. Extents may be
+// added in any order; Finish() sorts and merges them before any lookup.
+class TExtentMap {
+public:
+    void Add(const uint64_t begin, const uint64_t end);
+    void Finish();
+
+    bool Overlaps(const uint64_t begin, const uint64_t end) const;
+    bool Covers(const uint64_t begin, const uint64_t end) const;
+
+    size_t Count() const {
+        return Extents.size();
+    }
+
+    uint64_t Bytes() const;
+
+private:
+    std::vector<std::pair<uint64_t, uint64_t>> Extents;
+};
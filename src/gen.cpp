@@ -0,0 +1,275 @@
+#include "gen.hpp"
+#include "common.hpp"
+#include "device.hpp"
+
+#include <ac-common/utils/string.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The layout is drawn independently per segment, so that threads can
+// generate segments in any order.
+static const uint64_t GenSegmentChunks(16384);
+static const size_t GenBufferSize(1 << 20);
+
+namespace {
+    struct TGenOptions {
+        std::string Path;
+        uint64_t Size = 0;
+        size_t ChunkSize = 4096;
+        size_t Threads = 1;
+        double Zero = 0.3;
+        double Run = 8;
+        bool Fixed = false;
+        bool Dense = false;
+        uint64_t Seed = 0;
+    };
+
+    uint64_t SplitMix(uint64_t& state) {
+        uint64_t z(state += 0x9e3779b97f4a7c15ull);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+        return z ^ (z >> 31);
+    }
+
+    // Data chunks never contain a whole zero chunk, so the zero fraction of
+    // the image is exactly the one of the layout.
+    void FillChunk(const uint64_t seed, const uint64_t index, char* out, const size_t size) {
+        uint64_t state(seed ^ (index * 0xd1b54a32d192ed03ull));
+
+        for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+            const uint64_t value(SplitMix(state) | 1);
+
+            memcpy(out + i, &value, std::min(sizeof(value), size - i));
+        }
+    }
+
+    class TLayout {
+    public:
+        TLayout(const TGenOptions& options, const uint64_t segment)
+            : Options(options)
+            , State(options.Seed ^ (segment * 0x9e3779b97f4a7c15ull))
+        {
+            // Start in a zero run with probability Zero, so that short
+            // segments keep the requested ratio on average.
+            Zero = (Uniform() <= Options.Zero);
+        }
+
+        // Length in chunks of the next run and whether it is a zero run.
+        uint64_t Next(bool& zero) {
+            if ((Options.Zero == 0) || (Options.Zero == 1)) {
+                zero = (Options.Zero == 1);
+                return GenSegmentChunks;
+            }
+
+            const double mean(Zero ? Options.Run : (Options.Run * (1 - Options.Zero) / Options.Zero));
+            uint64_t len(1);
+
+            if (Options.Fixed) {
+                len = std::max<uint64_t>(1, mean + 0.5);
+
+            } else if (mean > 1) {
+                // Geometric by inversion, rather than with the standard
+                // distributions, whose output differs between libraries.
+                len = 1 + (uint64_t)std::floor(std::log(Uniform()) / std::log(1 - 1 / mean));
+            }
+
+            zero = Zero;
+            Zero = !Zero;
+
+            return len;
+        }
+
+    private:
+        // In (0, 1], from the top 53 bits.
+        double Uniform() {
+            return (double)((SplitMix(State) >> 11) + 1) / (double)(1ull << 53);
+        }
+
+    private:
+        const TGenOptions& Options;
+        uint64_t State;
+        bool Zero = false;
+    };
+}
+
+int RunGen(int argc, char** argv) {
+    TGenOptions options;
+
+    for (int i = 0; i < argc; ++i) {
+        const bool hasValue((i + 1) < argc);
+
+        if ((strcmp(argv[i], "-s") == 0) && hasValue) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.ChunkSize);
+
+        } else if ((strcmp(argv[i], "-t") == 0) && hasValue) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.Threads);
+
+        } else if ((strcmp(argv[i], "--zero") == 0) && hasValue) {
+            ++i;
+            options.Zero = atof(argv[i]);
+
+        } else if ((strcmp(argv[i], "--run") == 0) && hasValue) {
+            ++i;
+            options.Run = atof(argv[i]);
+
+        } else if ((strcmp(argv[i], "--dist") == 0) && hasValue) {
+            ++i;
+
+            if (strcmp(argv[i], "fixed") == 0) {
+                options.Fixed = true;
+
+            } else if (strcmp(argv[i], "geometric") != 0) {
+                std::cerr << "Invalid distribution: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if ((strcmp(argv[i], "--seed") == 0) && hasValue) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.Seed);
+
+        } else if (strcmp(argv[i], "--dense") == 0) {
+            options.Dense = true;
+
+        } else if (options.Size == 0) {
+            if (!ParseSize(argv[i], options.Size)) {
+                std::cerr << "Invalid size: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if (options.Path.empty()) {
+            options.Path = argv[i];
+
+        } else {
+            std::cerr << "Invalid argument: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.Path.empty()) {
+        std::cerr << "Usage: bdenc gen [-s 4096] [-t 1] [--zero 0.3] [--run 8] [--dist geometric|fixed] [--seed 0] [--dense] size /path/to/image" << std::endl;
+        return 1;
+    }
+
+    if ((options.ChunkSize == 0) || ((options.Size % options.ChunkSize) != 0)) {
+        std::cerr << "Size (" << options.Size << ") must be multiple of chunk size (-s " << options.ChunkSize << ")" << std::endl;
+        return 1;
+    }
+
+    if ((options.Zero < 0) || (options.Zero > 1) || (options.Run < 1) || (options.Threads == 0)) {
+        std::cerr << "Zero fraction must be within [0, 1], mean run length and thread count at least 1" << std::endl;
+        return 1;
+    }
+
+    TDevice dev(options.Path, O_WRONLY | O_CREAT);
+
+    if (!dev) {
+        std::cerr << "Can't open " << options.Path << std::endl;
+        return 1;
+    }
+
+    if (dev.IsRegular()) {
+        // Holes read back as zeroes, so a sparse image only writes data.
+        if (!dev.Truncate(0) || !dev.Truncate(options.Size)) {
+            std::cerr << "Can't resize " << options.Path << std::endl;
+            return 1;
+        }
+
+    } else if (dev.Size() < options.Size) {
+        std::cerr << "Device size (" << dev.Size() << ") is less than " << options.Size << std::endl;
+        return 1;
+
+    } else {
+        options.Dense = true;
+    }
+
+    const uint64_t chunkCount(options.Size / options.ChunkSize);
+    const uint64_t segmentCount((chunkCount + GenSegmentChunks - 1) / GenSegmentChunks);
+    const size_t bufferChunks(std::max<size_t>(1, GenBufferSize / options.ChunkSize));
+    std::atomic<uint64_t> nextSegment(0);
+    std::atomic<uint64_t> zeroChunks(0);
+    std::atomic<uint64_t> extents(0);
+    std::atomic<bool> failed(false);
+
+    RunThreads(options.Threads, [&](size_t) {
+        std::vector<char> buffer(bufferChunks * options.ChunkSize);
+
+        while (!failed) {
+            const uint64_t segment(nextSegment++);
+
+            if (segment >= segmentCount) {
+                break;
+            }
+
+            const uint64_t begin(segment * GenSegmentChunks);
+            const uint64_t end(std::min(chunkCount, begin + GenSegmentChunks));
+            TLayout layout(options, segment);
+            uint64_t chunk(begin);
+
+            while (chunk < end) {
+                bool zero(false);
+                const uint64_t runEnd(std::min(end, chunk + layout.Next(zero)));
+
+                ++extents;
+
+                if (zero) {
+                    zeroChunks += runEnd - chunk;
+                }
+
+                while (chunk < runEnd) {
+                    const size_t count(std::min<uint64_t>(bufferChunks, runEnd - chunk));
+                    const size_t size(count * options.ChunkSize);
+
+                    if (zero) {
+                        if (!options.Dense) {
+                            chunk += count;
+                            continue;
+                        }
+
+                        memset(buffer.data(), 0, size);
+
+                    } else {
+                        for (size_t i = 0; i < count; ++i) {
+                            FillChunk(options.Seed, chunk + i, buffer.data() + i * options.ChunkSize, options.ChunkSize);
+                        }
+                    }
+
+                    if (!dev.Write(chunk * options.ChunkSize, size, buffer.data())) {
+                        std::cerr << "Failed at " << std::to_string(chunk * options.ChunkSize) << ": can't write to file" << std::endl;
+                        failed = true;
+                        break;
+                    }
+
+                    chunk += count;
+                }
+
+                if (failed) {
+                    break;
+                }
+            }
+        }
+    });
+
+    if (failed) {
+        return 1;
+    }
+
+    if (!dev.FSync()) {
+        std::cerr << "Can't sync " << options.Path << std::endl;
+        return 1;
+    }
+
+    std::cerr
+        << "Generated " << options.Size << " byte(s): " << zeroChunks << " of " << chunkCount << " chunk(s) zero ("
+        << (chunkCount ? (100.0 * zeroChunks / chunkCount) : 0) << "%) in " << extents << " extent(s)" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// `bdenc gen` writes a synthetic test image: data chunks are pseudo-random,
+// zero chunks come in runs of configurable length. The output only depends
+// on the seed and the layout parameters, not on the thread count.
+int RunGen(int argc, char** argv);
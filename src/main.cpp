@@ -1,155 +1,239 @@
-#include <ac-common/file.hpp>
-#include <ac-common/str.hpp>
-#include <ac-common/utils/string.hpp>
-#include <ac-common/utils/htonll.hpp>
+#include "common.hpp"
+#include "cipher.hpp"
+#include "convert.hpp"
+#include "copy.hpp"
+#include "estimate.hpp"
+#include "gen.hpp"
+#include "options.hpp"
+#include "serve.hpp"
+#include "trace.hpp"
+#include "verify.hpp"
 
-#include <openssl/conf.h>
-#include <openssl/evp.h>
-#include <openssl/err.h>
+#include <ac-common/utils/string.hpp>
 
-#include <sys/types.h>
 #include <iostream>
 #include <string>
-#include <utility>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-#include <random>
-#include <time.h>
 
-#ifdef RELEASE_FILESYSTEM
-#include <filesystem>
+int main(int argc, char** argv) {
+    if ((argc >= 2) && (strcmp(argv[1], "trace-report") == 0)) {
+        return RunTraceReport(argc - 2, argv + 2);
+    }
 
-namespace stdfs = std::filesystem;
+    if ((argc >= 2) && (strcmp(argv[1], "gen") == 0)) {
+        return RunGen(argc - 2, argv + 2);
+    }
 
-#else
-#include <experimental/filesystem>
+    if ((argc >= 2) && (strcmp(argv[1], "serve") == 0)) {
+        return RunServe(argc - 2, argv + 2);
+    }
 
-namespace stdfs = std::experimental::filesystem;
-#endif
+    if (argc < 6) {
+        std::cerr << "Usage: " << argv[0] << " -m enc|dec -w /path/to/workdir [-n] [--estimate] [--bench read|cipher|journal] [--skip-errors] [-s 4096] [--readahead 4] [-t 1] [--adaptive min-max] [-r rate] [-p partitions] [--affinity auto|none|cpulist] [--iv chain|essiv] [--resilience journal|reflink] [--backend pread|mmap] [--format raw|qcow2] [--alloc-map /path/to/map] [--schedule /path/to/schedule] [--state-on-target 64M [--overwrite-tail]] [--verify-sample 1%|N] [--stop-timeout 30] [--trace /path/to/trace] [--perf] [-o /path/to/output [--delta] [--src-depth N] [--dst-depth N] [--discard]] /path/to/file" << std::endl;
+        std::cerr << "       " << argv[0] << " gen [-s 4096] [-t 1] [--zero 0.3] [--run 8] [--dist geometric|fixed] [--seed 0] [--dense] size /path/to/image" << std::endl;
+        std::cerr << "       " << argv[0] << " serve -w /path/to/workdir [-s 4096] [--cache 64M] [--shards 16] /path/to/file" << std::endl;
+        std::cerr << "       " << argv[0] << " trace-report /path/to/trace [--regions 32] [--interval 1]" << std::endl;
+        return 1;
+    }
 
-enum TMode {
-    MODE_ENCRYPT,
-    MODE_DECRYPT,
+    TOptions options;
+    size_t maxThreads(0);
 
-    MODE_DEFAULT,
-};
+    for (size_t i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-m") == 0) {
+            ++i;
 
-template<typename... TArgs>
-bool CreateFile(const std::string& path, TArgs&&... args) {
-    const std::string tmpPath(path + ".tmp.XXXXXXXXXX");
+            if (strcmp(argv[i], "enc") == 0) {
+                options.Mode = MODE_ENCRYPT;
 
-    NAC::TFile file(tmpPath, NAC::TFile::ACCESS_TMP);
+            } else if (strcmp(argv[i], "dec") == 0) {
+                options.Mode = MODE_DECRYPT;
 
-    if (!file) {
-        std::cerr << "Can't create " << path << std::endl;
-        return false;
-    }
+            } else {
+                std::cerr << "Invalid mode: " << argv[i] << std::endl;
+                return 1;
+            }
 
-    file.Append(std::forward<TArgs>(args)...);
-    file.FSync();
+        } else if (strcmp(argv[i], "-w") == 0) {
+            ++i;
+            options.WorkdirPath = argv[i];
 
-    if (!file) {
-        std::cerr << "Can't create " << path << std::endl;
-        return false;
-    }
+        } else if (strcmp(argv[i], "-n") == 0) {
+            options.DryRun = true;
 
-    if (rename(file.Path().c_str(), path.c_str()) != 0) {
-        perror("rename");
-        std::cerr << "Can't create " << path << std::endl;
-        return false;
-    }
+        } else if (strcmp(argv[i], "--estimate") == 0) {
+            options.Estimate = true;
 
-    return true;
-}
-
-bool CreateRandomFile(const size_t size, const std::string& path) {
-    static std::random_device rd;
-    static std::mt19937 g(rd());
-    static std::uniform_int_distribution<unsigned char> dis(0, 255);
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            ++i;
 
-    NAC::TBlob content;
+            if (strcmp(argv[i], "read") == 0) {
+                options.Bench = BENCH_STAGE_READ;
 
-    for (size_t i = 0; i < size; ++i) {
-        char chr(dis(g));
+            } else if (strcmp(argv[i], "cipher") == 0) {
+                options.Bench = BENCH_STAGE_CIPHER;
 
-        content.Append(1, &chr);
-    }
+            } else if (strcmp(argv[i], "journal") == 0) {
+                options.Bench = BENCH_STAGE_JOURNAL;
 
-    return CreateFile(path, content.Size(), content.Data());
-}
+            } else {
+                std::cerr << "Invalid benchmark stage: " << argv[i] << std::endl;
+                return 1;
+            }
 
-template<typename... TArgs>
-int EVPInitWrapper(const TMode mode, TArgs&&... args) {
-    if (mode == MODE_ENCRYPT) {
-        return EVP_EncryptInit_ex(std::forward<TArgs>(args)...);
+        } else if (strcmp(argv[i], "--resilience") == 0) {
+            ++i;
 
-    } else {
-        return EVP_DecryptInit_ex(std::forward<TArgs>(args)...);
-    }
-}
+            if (strcmp(argv[i], "journal") == 0) {
+                options.Resilience = RESILIENCE_JOURNAL;
 
-template<typename... TArgs>
-int EVPUpdateWrapper(const TMode mode, TArgs&&... args) {
-    if (mode == MODE_ENCRYPT) {
-        return EVP_EncryptUpdate(std::forward<TArgs>(args)...);
+            } else if (strcmp(argv[i], "reflink") == 0) {
+                options.Resilience = RESILIENCE_REFLINK;
 
-    } else {
-        return EVP_DecryptUpdate(std::forward<TArgs>(args)...);
-    }
-}
+            } else {
+                std::cerr << "Invalid resilience mode: " << argv[i] << std::endl;
+                return 1;
+            }
 
-template<typename... TArgs>
-int EVPFinalWrapper(const TMode mode, TArgs&&... args) {
-    if (mode == MODE_ENCRYPT) {
-        return EVP_EncryptFinal_ex(std::forward<TArgs>(args)...);
+        } else if (strcmp(argv[i], "--backend") == 0) {
+            ++i;
 
-    } else {
-        return EVP_DecryptFinal_ex(std::forward<TArgs>(args)...);
-    }
-}
+            if (strcmp(argv[i], "pread") == 0) {
+                options.Backend = BACKEND_PREAD;
 
-int main(int argc, char** argv) {
-    if (argc < 6) {
-        std::cerr << "Usage: " << argv[0] << " -m enc|dec -w /path/to/workdir [-n] [-s 4096] /path/to/file" << std::endl;
-        return 1;
-    }
+            } else if (strcmp(argv[i], "mmap") == 0) {
+                options.Backend = BACKEND_MMAP;
 
-    std::string devPath;
-    std::string workdirPath;
-    bool dryRun(false);
-    TMode mode(MODE_DEFAULT);
-    size_t chunkSize(4096);
+            } else {
+                std::cerr << "Invalid backend: " << argv[i] << std::endl;
+                return 1;
+            }
 
-    for (size_t i = 1; i < argc; ++i) {
-        if (strcmp(argv[i], "-m") == 0) {
+        } else if (strcmp(argv[i], "--format") == 0) {
             ++i;
 
-            if (strcmp(argv[i], "enc") == 0) {
-                mode = MODE_ENCRYPT;
+            if (strcmp(argv[i], "raw") == 0) {
+                options.Format = FORMAT_RAW;
 
-            } else if (strcmp(argv[i], "dec") == 0) {
-                mode = MODE_DECRYPT;
+            } else if (strcmp(argv[i], "qcow2") == 0) {
+                options.Format = FORMAT_QCOW2;
 
             } else {
-                std::cerr << "Invalid mode: " << argv[i] << std::endl;
+                std::cerr << "Invalid format: " << argv[i] << std::endl;
                 return 1;
             }
 
-        } else if (strcmp(argv[i], "-w") == 0) {
+        } else if (strcmp(argv[i], "--alloc-map") == 0) {
             ++i;
-            workdirPath = argv[i];
+            options.AllocMap = argv[i];
 
-        } else if (strcmp(argv[i], "-n") == 0) {
-            dryRun = true;
+        } else if (strcmp(argv[i], "--schedule") == 0) {
+            ++i;
+            options.SchedulePath = argv[i];
+
+        } else if (strcmp(argv[i], "--state-on-target") == 0) {
+            ++i;
+
+            if (!ParseSize(argv[i], options.StateOnTarget) || (options.StateOnTarget == 0)) {
+                std::cerr << "Invalid state area size: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if (strcmp(argv[i], "--overwrite-tail") == 0) {
+            options.OverwriteTail = true;
+
+        } else if (strcmp(argv[i], "--skip-errors") == 0) {
+            options.SkipErrors = true;
 
         } else if (strcmp(argv[i], "-s") == 0) {
             ++i;
-            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], chunkSize);
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.ChunkSize);
+
+        } else if (strcmp(argv[i], "--readahead") == 0) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.Readahead);
+
+        } else if (strcmp(argv[i], "-t") == 0) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.Threads);
+
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            ++i;
+
+            const char* dash(strchr(argv[i], '-'));
+
+            if (!dash) {
+                std::cerr << "Invalid thread bounds: " << argv[i] << std::endl;
+                return 1;
+            }
+
+            NAC::NStringUtils::FromString(dash - argv[i], argv[i], options.MinThreads);
+            NAC::NStringUtils::FromString(strlen(dash + 1), dash + 1, maxThreads);
+            options.Adaptive = true;
+
+        } else if (strcmp(argv[i], "-r") == 0) {
+            ++i;
+
+            if (!ParseSize(argv[i], options.Rate)) {
+                std::cerr << "Invalid rate: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if (strcmp(argv[i], "-p") == 0) {
+            ++i;
+            options.Partitions = argv[i];
+
+        } else if (strcmp(argv[i], "--affinity") == 0) {
+            ++i;
+            options.Affinity = argv[i];
+
+        } else if (strcmp(argv[i], "--iv") == 0) {
+            ++i;
+
+            if (!ParseIVMode(argv[i], options.IVMode)) {
+                std::cerr << "Invalid IV mode: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if (strcmp(argv[i], "--verify-sample") == 0) {
+            ++i;
+
+            if (!ParseVerifySample(argv[i], options.VerifySample)) {
+                std::cerr << "Invalid verification sample: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if (strcmp(argv[i], "--stop-timeout") == 0) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.StopTimeout);
+
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            ++i;
+            options.TracePath = argv[i];
+
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            options.Perf = true;
+
+        } else if (strcmp(argv[i], "-o") == 0) {
+            ++i;
+            options.OutputPath = argv[i];
+
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            options.Delta = true;
+
+        } else if (strcmp(argv[i], "--src-depth") == 0) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.SrcDepth);
+
+        } else if (strcmp(argv[i], "--dst-depth") == 0) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.DstDepth);
+
+        } else if (strcmp(argv[i], "--discard") == 0) {
+            options.Discard = true;
 
-        } else if (devPath.empty()) {
-            devPath = argv[i];
+        } else if (options.DevPath.empty()) {
+            options.DevPath = argv[i];
 
         } else {
             std::cerr << "Invalid argument: " << argv[i] << std::endl;
@@ -157,319 +241,132 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (devPath.empty()) {
+    if (options.DevPath.empty()) {
         std::cerr << "No file specified" << std::endl;
         return 1;
     }
 
-    if (workdirPath.empty()) {
+    if (options.WorkdirPath.empty()) {
         std::cerr << "No workdir specified" << std::endl;
         return 1;
     }
 
-    if (mode == MODE_DEFAULT) {
+    if (options.Mode == MODE_DEFAULT) {
         std::cerr << "No mode specified" << std::endl;
         return 1;
     }
 
-    const std::string modeName((mode == MODE_ENCRYPT) ? "enc" : "dec");
-    const std::string inverseModeName((mode == MODE_ENCRYPT) ? "dec" : "enc");
-
-    static const size_t blockSize(16);
-    static const size_t keySize(32);
-
-    if ((chunkSize % blockSize) != 0) {
-        std::cerr << "Chunk size (-s) must be multiple of " << blockSize << std::endl;
+    if (options.Threads == 0) {
+        std::cerr << "Thread count (-t) must be positive" << std::endl;
         return 1;
     }
 
-    NAC::TFile dev(devPath, NAC::TFile::ACCESS_RDWR_DIRECT);
+    options.InitialThreads = options.Threads;
 
-    if (!dev) {
-        std::cerr << "Can't open file" << std::endl;
-        return 1;
+    if (options.Adaptive) {
+        if ((options.MinThreads == 0) || (maxThreads < options.MinThreads)) {
+            std::cerr << "Thread bounds (--adaptive) must be positive and ordered" << std::endl;
+            return 1;
+        }
+
+        options.Threads = maxThreads;
+
+    } else {
+        options.MinThreads = options.Threads;
     }
 
-    if ((dev.Size() % chunkSize) != 0) {
-        std::cerr << "File size (" << dev.Size() << ") must be multiple of chunk size (-s " << chunkSize << ")" << std::endl;
+    if ((options.Bench != BENCH_STAGE_NONE) && !options.OutputPath.empty()) {
+        std::cerr << "Benchmark (--bench) runs in place, without output (-o)" << std::endl;
         return 1;
     }
 
-    const stdfs::path wd(workdirPath);
-    const auto ivPath = wd / ".iv";
-    const auto keyPath = wd / ".key";
+    // A dry run is the whole pipeline short of writing the target, with
+    // its state kept out of the workdir.
+    if (options.DryRun && options.OutputPath.empty() && (options.Bench == BENCH_STAGE_NONE)) {
+        options.Bench = BENCH_STAGE_JOURNAL;
+    }
 
-    if (
-        !stdfs::exists(ivPath)
-        || !stdfs::exists(keyPath)
-    ) {
-        if (mode == MODE_DECRYPT) {
-            std::cerr << "Key and/or iv absent" << std::endl;
-            return 1;
-        }
+    options.DryRun = options.DryRun || (options.Bench != BENCH_STAGE_NONE);
 
-        if (!CreateRandomFile(blockSize, ivPath.string())) {
+    if (options.Backend == BACKEND_MMAP) {
+        if (!options.OutputPath.empty()) {
+            std::cerr << "The mmap backend (--backend mmap) only works in place, without output (-o)" << std::endl;
             return 1;
         }
 
-        if (!CreateRandomFile(keySize, keyPath.string())) {
+        // A failed page fault kills the process with SIGBUS, so there is
+        // nothing to salvage from.
+        if (options.SkipErrors) {
+            std::cerr << "The mmap backend (--backend mmap) can't skip errors (--skip-errors)" << std::endl;
             return 1;
         }
     }
 
-    NAC::TFile iv(ivPath.string());
-    NAC::TFile key(keyPath.string());
-
-    if (!iv || !key || (iv.Size() != blockSize) || (key.Size() != keySize)) {
-        std::cerr << "Can't load key and/or iv" << std::endl;
+    // Unreadable chunks of the source are not skipped when copying to an
+    // output; known bad extents from an in-place run still are.
+    if (options.SkipErrors && !options.OutputPath.empty()) {
+        std::cerr << "Skipping errors (--skip-errors) only works in place, without output (-o)" << std::endl;
         return 1;
     }
 
-    EVP_CIPHER_CTX* ctx(EVP_CIPHER_CTX_new());
-
-    if (!ctx) {
-        ERR_print_errors_fp(stderr);
-        return 1;
-    }
-
-    if (1 != EVPInitWrapper(mode, ctx, EVP_aes_256_cbc(), nullptr, (const unsigned char*)key.Data(), (const unsigned char*)iv.Data())) {
-        ERR_print_errors_fp(stderr);
+    if ((options.StateOnTarget > 0) && !options.OutputPath.empty()) {
+        std::cerr << "State on target (--state-on-target) only works in place, without output (-o)" << std::endl;
         return 1;
     }
 
-    if (1 != EVP_CIPHER_CTX_set_padding(ctx, 0)) {
-        ERR_print_errors_fp(stderr);
+    if (options.OverwriteTail && (options.StateOnTarget == 0)) {
+        std::cerr << "Overwriting the tail (--overwrite-tail) needs --state-on-target" << std::endl;
         return 1;
     }
 
-    {
-        const auto detectedBlockSize = EVP_CIPHER_CTX_block_size(ctx);
-
-        if (detectedBlockSize != blockSize) {
-            std::cerr << "Detected block size (" << detectedBlockSize << ") is not equal to expected block size (" << blockSize << ")" << std::endl;
+    // qcow2 metadata lives all over the file, so neither partitions nor a
+    // reserved area at its end make sense there.
+    if (options.Format == FORMAT_QCOW2) {
+        if (!options.OutputPath.empty() || options.Estimate) {
+            std::cerr << "qcow2 format (--format qcow2) only works in place, without output (-o) or --estimate" << std::endl;
             return 1;
         }
-    }
 
-    uint64_t offset(0);
-    const auto offsetPath = wd / (modeName + "_offset");
-
-    if (!stdfs::exists(offsetPath)) {
-        uint64_t tmp(NAC::hton(offset));
-
-        if (!CreateFile(offsetPath.string(), sizeof(tmp), (const char*)&tmp)) {
+        if (!options.Partitions.empty() || (options.StateOnTarget > 0)) {
+            std::cerr << "qcow2 format (--format qcow2) doesn't work with partitions (-p) or --state-on-target" << std::endl;
             return 1;
         }
     }
 
-    NAC::TFile offsetFile(offsetPath.string(), NAC::TFile::ACCESS_RDWR);
-
-    if (!offsetFile || (offsetFile.Size() != sizeof(offset))) {
-        std::cerr << "Can't load offset file" << std::endl;
+    // The estimate models neither the journal slots of a state area nor the
+    // chunks an allocation map leaves out.
+    if (options.Estimate && ((options.StateOnTarget > 0) || !options.AllocMap.empty())) {
+        std::cerr << "Estimates (--estimate) don't work with --state-on-target or --alloc-map" << std::endl;
         return 1;
     }
 
-    memcpy(&offset, offsetFile.Data(), offsetFile.Size());
-    offset = NAC::ntoh(offset);
-
-    if (offset >= dev.Size()) {
-        std::cerr << "Already done" << std::endl;
-        return 0;
+    if (!options.SchedulePath.empty() && (!options.OutputPath.empty() || options.Estimate)) {
+        std::cerr << "Schedules (--schedule) only work in place, without output (-o) or --estimate" << std::endl;
+        return 1;
     }
 
-    const auto sparsePath = wd / (((mode == MODE_ENCRYPT) ? modeName : inverseModeName) + "_sparse");
-
-    if (!stdfs::exists(sparsePath)) {
-        if (!CreateFile(sparsePath.string(), 0, nullptr)) {
-            return 1;
-        }
+    if (options.Delta && options.OutputPath.empty()) {
+        std::cerr << "Delta mode (--delta) requires output (-o)" << std::endl;
+        return 1;
     }
 
-    NAC::TFile sparseFile(sparsePath.string(), ((mode == MODE_ENCRYPT) ? NAC::TFile::ACCESS_WRONLY : NAC::TFile::ACCESS_RDONLY));
-    size_t sparseOffset(0);
-
-    if (!sparseFile && ((mode == MODE_ENCRYPT) || (stdfs::exists(sparsePath) && !stdfs::is_empty(sparsePath)))) {
-        std::cerr << "Can't load sparse file" << std::endl;
+    if ((options.SrcDepth || options.DstDepth || options.Discard) && options.OutputPath.empty()) {
+        std::cerr << "Queue depths (--src-depth, --dst-depth) and --discard require output (-o)" << std::endl;
         return 1;
     }
 
-    if (mode == MODE_ENCRYPT) {
-        sparseFile.SeekToEnd();
+    if ((options.ChunkSize % BlockSize) != 0) {
+        std::cerr << "Chunk size (-s) must be multiple of " << BlockSize << std::endl;
+        return 1;
     }
 
-    NAC::TBlob zeros;
-    zeros.Reserve(chunkSize);
-
-    memset(zeros.Data(), 0, chunkSize);
-
-    auto chunks = dev.Chunks(chunkSize);
-    chunks.Seek(offset);
-
-    NAC::TBlob block;
-    block.Reserve(chunkSize);
-
-    const size_t toProcess(dev.Size() - offset);
-    size_t processed(0);
-    size_t prevProcessed(processed);
-    const time_t t0(time(nullptr));
-    time_t prevTime(t0);
-
-    while (auto chunk = chunks.Next()) {
-        const auto tmpPath = wd / (modeName + "_chunk-" + std::to_string(offset));
-        bool allZeroes(false);
-
-        if (stdfs::exists(tmpPath)) {
-            NAC::TFile tmp(tmpPath.string());
-
-            if (!tmp || (tmp.Size() != chunkSize)) {
-                std::cerr << "Can't load " << tmpPath.string() << std::endl;
-                return 1;
-            }
-
-            if (!dryRun) {
-                dev.Write(offset, tmp.Size(), tmp.Data());
-                dev.FSync();
-
-                if (!dev) {
-                    std::cerr << "Failed at " << std::to_string(offset) << ": can't write to file" << std::endl;
-                    return 1;
-                }
-            }
-
-        } else {
-            if (mode == MODE_ENCRYPT) {
-                allZeroes = (0 == memcmp(chunk.Data(), zeros.Data(), chunk.Size()));
-
-            } else if (sparseFile) {
-                while (sparseOffset < sparseFile.Size()) {
-                    uint64_t tmp;
-
-                    memcpy(&tmp, sparseFile.Data() + sparseOffset, sizeof(tmp));
-                    tmp = NAC::ntoh(tmp);
-
-                    if (tmp < offset) {
-                        sparseOffset += sizeof(tmp);
-
-                    } else {
-                        allZeroes = (tmp == offset);
-                        break;
-                    }
-                }
-            }
-
-            if (allZeroes) {
-                if (mode == MODE_ENCRYPT) {
-                    uint64_t tmp(NAC::hton(offset));
-
-                    sparseFile.Append(sizeof(tmp), (const char*)&tmp);
-                    sparseFile.FSync();
-
-                    if (!sparseFile) {
-                        std::cerr << "Failed at " << std::to_string(offset) << ": can't save sparse file" << std::endl;
-                        return 1;
-                    }
-                }
-
-            } else {
-                int len(0);
-
-                if (1 != EVPUpdateWrapper(mode, ctx, (unsigned char*)block.Data(), &len, (const unsigned char*)chunk.Data(), chunk.Size())) {
-                    ERR_print_errors_fp(stderr);
-                    return 1;
-                }
-
-                if (len != chunkSize) {
-                    std::cerr << "Chunk size mismatch for offset " << offset << ": " << len << " != " << chunkSize << std::endl;
-                    return 1;
-                }
-
-                if (!CreateFile(tmpPath.string(), len, block.Data())) {
-                    return 1;
-                }
-
-                if (!dryRun) {
-                    dev.Write(offset, len, block.Data());
-                    dev.FSync();
-
-                    if (!dev) {
-                        std::cerr << "Failed at " << std::to_string(offset) << ": can't write to file" << std::endl;
-                        return 1;
-                    }
-                }
-            }
-        }
-
-        offset += chunkSize;
-
-        {
-            uint64_t tmp(NAC::hton(offset));
-
-            offsetFile.Write(0, sizeof(tmp), (const char*)&tmp);
-            offsetFile.FSync();
-
-            if (!offsetFile) {
-                std::cerr << "Failed at " << std::to_string(offset) << ": can't save offset" << std::endl;
-                return 1;
-            }
-        }
-
-        if (!allZeroes) {
-            if (unlink(tmpPath.c_str()) != 0) {
-                perror("unlink");
-            }
-        }
-
-        processed += chunkSize;
-
-        if ((processed - prevProcessed) >= (1 * 1024 * 1024 * 1024)) {
-            prevProcessed = processed;
-
-            const time_t t1(time(nullptr));
-
-            if ((t1 >= prevTime) && ((t1 - prevTime) >= 60)) {
-                prevTime = t1;
-
-                long double left((long double)(toProcess - processed) / ((long double)processed / (long double)(t1 - t0)));
-                std::string unit("second(s)");
-
-                if (left > 100) {
-                    left /= 60;
-                    unit = "minute(s)";
-
-                    if (left > 90) {
-                        left /= 60;
-                        unit = "hour(s)";
-
-                        if (left > 30) {
-                            left /= 24;
-                            unit = "day(s)";
-                        }
-                    }
-                }
-
-                std::cerr << left << " " << unit << " left" << std::endl;
-            }
-        }
+    if (options.Estimate) {
+        return RunEstimate(options);
     }
 
-    {
-        int len(0);
-
-        if (1 != EVPFinalWrapper(mode, ctx, (unsigned char*)block.Data(), &len)) {
-            ERR_print_errors_fp(stderr);
-            return 1;
-        }
-
-        if (len > 0) {
-            const auto tmpPath = wd / (modeName + "_chunk-" + std::to_string(offset) + ".final");
-
-            if (!CreateFile(tmpPath.string(), len, block.Data())) {
-                return 1;
-            }
-        }
+    if (!options.OutputPath.empty()) {
+        return RunCopy(options);
     }
 
-    std::cerr << "Success!" << std::endl;
-
-    return 0;
+    return RunConvert(options);
 }
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "cipher.hpp"
+
+#include <string>
+#include <stdint.h>
+
+// How far --bench (and -n) run the in-place pipeline; each stage includes
+// the previous ones. The target is never written.
+enum TBenchStage {
+    BENCH_STAGE_NONE,
+    BENCH_STAGE_READ,
+    BENCH_STAGE_CIPHER,
+    BENCH_STAGE_JOURNAL,
+};
+
+// How chunks in flight are protected against a crash: a copy of each
+// converted chunk, or a reflink of each batch's old data.
+enum TResilience {
+    RESILIENCE_JOURNAL,
+    RESILIENCE_REFLINK,
+};
+
+// How in-place conversion reaches the target: O_DIRECT pread/pwrite, or a
+// shared mapping of a regular file.
+enum TBackend {
+    BACKEND_PREAD,
+    BACKEND_MMAP,
+};
+
+// How the target is laid out: converted as a whole, or only the data
+// clusters of a qcow2 image.
+enum TFormat {
+    FORMAT_RAW,
+    FORMAT_QCOW2,
+};
+
+struct TOptions {
+    std::string DevPath;
+    std::string WorkdirPath;
+    std::string OutputPath;
+    std::string Partitions;
+    std::string Affinity = "auto";
+    std::string TracePath;
+    std::string AllocMap;
+    std::string SchedulePath;
+    bool DryRun = false;
+    bool Delta = false;
+    bool SkipErrors = false;
+    bool Perf = false;
+    bool Estimate = false;
+    bool Discard = false;
+    TMode Mode = MODE_DEFAULT;
+    TIVMode IVMode = IV_MODE_DEFAULT;
+    TBenchStage Bench = BENCH_STAGE_NONE;
+    TResilience Resilience = RESILIENCE_JOURNAL;
+    TBackend Backend = BACKEND_PREAD;
+    TFormat Format = FORMAT_RAW;
+    size_t ChunkSize = 4096;
+    size_t Readahead = 4;
+    size_t SrcDepth = 0;
+    size_t DstDepth = 0;
+    size_t Threads = 1;
+    size_t MinThreads = 1;
+    size_t InitialThreads = 1;
+    bool Adaptive = false;
+    uint64_t Rate = 0;
+    uint64_t VerifySample = 0;
+    uint64_t StateOnTarget = 0;
+    bool OverwriteTail = false;
+    size_t StopTimeout = 30;
+};
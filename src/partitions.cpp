@@ -0,0 +1,374 @@
+#include "partitions.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+static const uint64_t GPTSignature(0x5452415020494645ULL); // "EFI PART"
+
+template<typename T>
+static T LE(const std::string& data, const size_t pos) {
+    T out;
+
+    memcpy(&out, data.data() + pos, sizeof(out));
+
+    if (sizeof(T) == 8) {
+        return le64toh(out);
+
+    } else if (sizeof(T) == 4) {
+        return le32toh(out);
+
+    } else {
+        return le16toh(out);
+    }
+}
+
+static std::string FormatGUID(const std::string& data, const size_t pos) {
+    char out[37];
+
+    snprintf(
+        out, sizeof(out),
+        "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+        LE<uint32_t>(data, pos),
+        LE<uint16_t>(data, pos + 4),
+        LE<uint16_t>(data, pos + 6),
+        (unsigned char)data[pos + 8], (unsigned char)data[pos + 9],
+        (unsigned char)data[pos + 10], (unsigned char)data[pos + 11],
+        (unsigned char)data[pos + 12], (unsigned char)data[pos + 13],
+        (unsigned char)data[pos + 14], (unsigned char)data[pos + 15]
+    );
+
+    return out;
+}
+
+static std::string FormatLabel(const std::string& data, const size_t pos, const size_t size) {
+    std::string out;
+
+    for (size_t i = 0; (i + 1) < size; i += 2) {
+        const uint16_t chr(LE<uint16_t>(data, pos + i));
+
+        if (chr == 0) {
+            break;
+        }
+
+        if (chr < 0x80) {
+            out += (char)chr;
+
+        } else if (chr < 0x800) {
+            out += (char)(0xC0 | (chr >> 6));
+            out += (char)(0x80 | (chr & 0x3F));
+
+        } else {
+            out += (char)(0xE0 | (chr >> 12));
+            out += (char)(0x80 | ((chr >> 6) & 0x3F));
+            out += (char)(0x80 | (chr & 0x3F));
+        }
+    }
+
+    return out;
+}
+
+// CRC32 as used by GPT (IEEE 802.3, reflected).
+static uint32_t CRC32(const char* data, const size_t size) {
+    uint32_t crc(0xFFFFFFFF);
+
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= (unsigned char)data[i];
+
+        for (size_t bit = 0; bit < 8; ++bit) {
+            crc = ((crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0));
+        }
+    }
+
+    return ~crc;
+}
+
+// Reads the GPT header at lba and its entry array, checking both CRCs.
+// found is set when the header has the GPT signature at all.
+static bool ReadGPTAt(const TDevice& dev, const uint64_t sectorSize, const uint64_t lba, std::string& entries, uint32_t& entryCount, uint32_t& entrySize, bool& found) {
+    std::string header;
+
+    if (!ReadAligned(dev, lba * sectorSize, sectorSize, header) || (LE<uint64_t>(header, 0) != GPTSignature)) {
+        return false;
+    }
+
+    found = true;
+
+    const uint32_t headerSize(LE<uint32_t>(header, 12));
+
+    if ((headerSize < 92) || (headerSize > sectorSize)) {
+        return false;
+    }
+
+    const uint32_t headerCRC(LE<uint32_t>(header, 16));
+
+    memset(&header[16], 0, 4);
+
+    if ((CRC32(header.data(), headerSize) != headerCRC) || (LE<uint64_t>(header, 24) != lba)) {
+        return false;
+    }
+
+    const uint64_t entriesLBA(LE<uint64_t>(header, 72));
+
+    entryCount = LE<uint32_t>(header, 80);
+    entrySize = LE<uint32_t>(header, 84);
+
+    if ((entrySize < 128) || (entryCount > 16384)) {
+        return false;
+    }
+
+    if (!ReadAligned(dev, entriesLBA * sectorSize, (size_t)entryCount * entrySize, entries)) {
+        return false;
+    }
+
+    return (CRC32(entries.data(), entries.size()) == LE<uint32_t>(header, 88));
+}
+
+static bool ReadGPT(const TDevice& dev, const uint64_t sectorSize, std::vector<TPartition>& partitions) {
+    std::string entries;
+    uint32_t entryCount(0);
+    uint32_t entrySize(0);
+    bool found(false);
+
+    if (!ReadGPTAt(dev, sectorSize, 1, entries, entryCount, entrySize, found)) {
+        const bool primaryFound(found);
+
+        if ((dev.Size() / sectorSize) < 2) {
+            return false;
+        }
+
+        found = false;
+
+        if (!ReadGPTAt(dev, sectorSize, dev.Size() / sectorSize - 1, entries, entryCount, entrySize, found)) {
+            if (primaryFound || found) {
+                std::cerr << "Both GPT copies are invalid (sector size " << sectorSize << ")" << std::endl;
+            }
+
+            return false;
+        }
+
+        std::cerr << "Primary GPT is invalid, using the backup" << std::endl;
+    }
+
+    static const std::string unused(16, '\0');
+
+    for (uint32_t i = 0; i < entryCount; ++i) {
+        const size_t pos(i * entrySize);
+
+        if (entries.compare(pos, 16, unused) == 0) {
+            continue;
+        }
+
+        TPartition partition;
+
+        partition.Number = i + 1;
+        partition.GUID = FormatGUID(entries, pos + 16);
+        partition.Begin = LE<uint64_t>(entries, pos + 32) * sectorSize;
+        partition.End = (LE<uint64_t>(entries, pos + 40) + 1) * sectorSize;
+        partition.Label = FormatLabel(entries, pos + 56, 72);
+
+        partitions.push_back(partition);
+    }
+
+    return true;
+}
+
+static bool IsExtended(const unsigned char type) {
+    return ((type == 0x05) || (type == 0x0F) || (type == 0x85));
+}
+
+static bool ReadMBR(const TDevice& dev, std::vector<TPartition>& partitions) {
+    static const uint64_t sectorSize(512);
+    std::string mbr;
+
+    if (!ReadAligned(dev, 0, sectorSize, mbr) || ((unsigned char)mbr[510] != 0x55) || ((unsigned char)mbr[511] != 0xAA)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < 4; ++i) {
+        const size_t pos(446 + i * 16);
+        const unsigned char type(mbr[pos + 4]);
+        const uint64_t begin(LE<uint32_t>(mbr, pos + 8));
+        const uint64_t count(LE<uint32_t>(mbr, pos + 12));
+
+        if ((type == 0) || (count == 0)) {
+            continue;
+        }
+
+        // A protective entry covers the whole disk, GPT included.
+        if (type == 0xEE) {
+            std::cerr << "Target has a protective MBR but no valid GPT" << std::endl;
+            return false;
+        }
+
+        if (!IsExtended(type)) {
+            TPartition partition;
+
+            partition.Number = i + 1;
+            partition.Begin = begin * sectorSize;
+            partition.End = (begin + count) * sectorSize;
+
+            partitions.push_back(partition);
+
+            continue;
+        }
+
+        uint64_t ebr(begin);
+        size_t number(5);
+
+        while (ebr != 0) {
+            std::string data;
+
+            if (!ReadAligned(dev, ebr * sectorSize, sectorSize, data) || ((unsigned char)data[510] != 0x55) || ((unsigned char)data[511] != 0xAA)) {
+                std::cerr << "Can't read extended boot record at sector " << ebr << std::endl;
+                return false;
+            }
+
+            const uint64_t logicalBegin(LE<uint32_t>(data, 446 + 8));
+            const uint64_t logicalCount(LE<uint32_t>(data, 446 + 12));
+            const uint64_t next(LE<uint32_t>(data, 446 + 16 + 8));
+
+            if (logicalCount > 0) {
+                TPartition partition;
+
+                partition.Number = number++;
+                partition.Begin = (ebr + logicalBegin) * sectorSize;
+                partition.End = partition.Begin + logicalCount * sectorSize;
+
+                partitions.push_back(partition);
+            }
+
+            if ((next == 0) || (number > 256)) {
+                break;
+            }
+
+            ebr = begin + next;
+        }
+    }
+
+    return true;
+}
+
+bool ReadPartitionTable(const TDevice& dev, std::vector<TPartition>& partitions) {
+    partitions.clear();
+
+    uint64_t sectorSizes[] = {512, 4096};
+
+    if (!dev.IsRegular()) {
+        int sectorSize(0);
+
+        if ((ioctl(dev.GetFd(), BLKSSZGET, &sectorSize) == 0) && (sectorSize > 0)) {
+            sectorSizes[0] = sectorSize;
+            sectorSizes[1] = sectorSize;
+        }
+    }
+
+    for (const uint64_t sectorSize : sectorSizes) {
+        if (ReadGPT(dev, sectorSize, partitions)) {
+            break;
+        }
+    }
+
+    if (partitions.empty() && !ReadMBR(dev, partitions)) {
+        return false;
+    }
+
+    for (const auto& partition : partitions) {
+        if ((partition.Begin >= partition.End) || (partition.End > dev.Size())) {
+            std::cerr << "Partition " << partition.Number << " is out of bounds" << std::endl;
+            return false;
+        }
+    }
+
+    std::sort(partitions.begin(), partitions.end(), [](const TPartition& a, const TPartition& b) {
+        return (a.Begin < b.Begin);
+    });
+
+    return true;
+}
+
+bool SelectPartitions(const std::vector<TPartition>& partitions, const std::string& selector, std::vector<TPartition>& selected) {
+    std::vector<bool> used(partitions.size(), false);
+    size_t pos(0);
+
+    while (pos <= selector.size()) {
+        size_t end(selector.find(',', pos));
+
+        if (end == std::string::npos) {
+            end = selector.size();
+        }
+
+        const std::string token(selector.substr(pos, end - pos));
+        bool found(false);
+
+        pos = end + 1;
+
+        if (token.empty()) {
+            continue;
+        }
+
+        const bool isNumber(std::all_of(token.begin(), token.end(), [](const char chr) { return ((chr >= '0') && (chr <= '9')); }));
+
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            const auto& partition = partitions[i];
+
+            if (
+                (token == "all")
+                || (isNumber && (std::to_string(partition.Number) == token))
+                || (!partition.GUID.empty() && (strcasecmp(partition.GUID.c_str(), token.c_str()) == 0))
+                || (!partition.Label.empty() && (partition.Label == token))
+            ) {
+                used[i] = true;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            std::cerr << "No such partition: " << token << std::endl;
+            std::cerr << "Available partitions:" << std::endl;
+
+            for (const auto& partition : partitions) {
+                std::cerr << "  " << partition.Number << ": " << partition.Begin << "-" << partition.End;
+
+                if (!partition.Label.empty()) {
+                    std::cerr << " \"" << partition.Label << "\"";
+                }
+
+                if (!partition.GUID.empty()) {
+                    std::cerr << " " << partition.GUID;
+                }
+
+                std::cerr << std::endl;
+            }
+
+            return false;
+        }
+    }
+
+    selected.clear();
+
+    for (size_t i = 0; i < partitions.size(); ++i) {
+        if (used[i]) {
+            selected.push_back(partitions[i]);
+        }
+    }
+
+    std::sort(selected.begin(), selected.end(), [](const TPartition& a, const TPartition& b) {
+        return (a.Begin < b.Begin);
+    });
+
+    // Overlapping ranges would be converted twice.
+    for (size_t i = 1; i < selected.size(); ++i) {
+        if (selected[i].Begin < selected[i - 1].End) {
+            std::cerr << "Partitions " << selected[i - 1].Number << " and " << selected[i].Number << " overlap" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
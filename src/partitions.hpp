@@ -0,0 +1,24 @@
+#pragma once
+
+#include "device.hpp"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct TPartition {
+    size_t Number = 0;
+    uint64_t Begin = 0;
+    uint64_t End = 0;
+    std::string Label;
+    std::string GUID;
+};
+
+// Reads a GPT (the backup one if the primary fails its CRCs, falling back to
+// MBR with logical partitions) from the target.
+// An empty result means that the target has no partition table.
+bool ReadPartitionTable(const TDevice& dev, std::vector<TPartition>& partitions);
+
+// Selector is a comma-separated list of partition numbers, GPT labels,
+// GPT unique GUIDs, or "all".
+bool SelectPartitions(const std::vector<TPartition>& partitions, const std::string& selector, std::vector<TPartition>& selected);
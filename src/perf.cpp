@@ -0,0 +1,174 @@
+#include "perf.hpp"
+
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* PerfStageNames[PERF_STAGE_COUNT] = {
+    "zero",
+    "cipher",
+    "fingerprint",
+};
+
+static int OpenCounter(const uint32_t type, const uint64_t config, const int group) {
+    perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+TPerfCounters::TPerfCounters(TPerfCollector* collector)
+    : Collector(collector)
+{
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        Index[i] = -1;
+    }
+
+    if (!Collector) {
+        return;
+    }
+
+    auto add = [this](const TPerfCounter counter, const uint32_t type, const uint64_t config) {
+        const int fd(OpenCounter(type, config, Leader));
+
+        if (fd == -1) {
+            return false;
+        }
+
+        if (Leader == -1) {
+            Leader = fd;
+        }
+
+        Index[counter] = Fds.size();
+        Fds.push_back(fd);
+
+        return true;
+    };
+
+    if (add(PERF_COUNTER_CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES)) {
+        add(PERF_COUNTER_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        add(PERF_COUNTER_LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    }
+
+    add(PERF_COUNTER_TASK_CLOCK, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+
+    if (Leader == -1) {
+        perror("perf_event_open");
+    }
+}
+
+TPerfCounters::~TPerfCounters() {
+    if (Collector && (Leader >= 0)) {
+        Collector->Merge(Totals, (Index[PERF_COUNTER_CYCLES] >= 0));
+    }
+
+    for (const int fd : Fds) {
+        close(fd);
+    }
+}
+
+// The group reads as {nr, time_enabled, time_running, values[nr]}.
+bool TPerfCounters::Read(uint64_t* values) {
+    uint64_t buf[3 + PERF_COUNTER_COUNT];
+    const ssize_t size((3 + Fds.size()) * sizeof(uint64_t));
+
+    if (read(Leader, buf, size) != size) {
+        return false;
+    }
+
+    const uint64_t enabled(buf[1]);
+    const uint64_t running(buf[2]);
+    const bool scale((running > 0) && (running < enabled));
+
+    Totals.Multiplexed = Totals.Multiplexed || scale;
+
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        const uint64_t value((Index[i] >= 0) ? buf[3 + Index[i]] : 0);
+
+        values[i] = (scale ? (uint64_t)((long double)value * enabled / running) : value);
+    }
+
+    return true;
+}
+
+void TPerfCounters::Lap(const TPerfStage stage, const uint64_t bytes) {
+    if (Leader < 0) {
+        return;
+    }
+
+    uint64_t now[PERF_COUNTER_COUNT];
+
+    if (!Read(now)) {
+        return;
+    }
+
+    Totals.Bytes[stage] += bytes;
+
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        Totals.Values[stage][i] += now[i] - Last[i];
+        Last[i] = now[i];
+    }
+}
+
+void TPerfCollector::Merge(const TPerfTotals& totals, const bool hardware) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    for (size_t stage = 0; stage < PERF_STAGE_COUNT; ++stage) {
+        Totals.Bytes[stage] += totals.Bytes[stage];
+
+        for (size_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            Totals.Values[stage][i] += totals.Values[stage][i];
+        }
+    }
+
+    Totals.Multiplexed = Totals.Multiplexed || totals.Multiplexed;
+    Hardware = Hardware || hardware;
+    Merged = true;
+}
+
+void TPerfCollector::Report() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    if (!Merged) {
+        return;
+    }
+
+    const double GiB(1024 * 1024 * 1024);
+
+    std::cerr
+        << "Perf counters" << (Hardware ? "" : " (software only)")
+        << (Totals.Multiplexed ? " (multiplexed, scaled estimates)" : "") << ":" << std::endl;
+
+    for (size_t stage = 0; stage < PERF_STAGE_COUNT; ++stage) {
+        const uint64_t* values(Totals.Values[stage]);
+        const double bytes(Totals.Bytes[stage]);
+
+        if (bytes == 0) {
+            continue;
+        }
+
+        std::cerr
+            << "  " << std::setw(11) << PerfStageNames[stage] << ": " << (uint64_t)bytes << " byte(s), "
+            << (values[PERF_COUNTER_TASK_CLOCK] / 1e6) << " ms, "
+            << (values[PERF_COUNTER_TASK_CLOCK] / 1e6 / (bytes / GiB)) << " ms/GiB";
+
+        if (Hardware) {
+            std::cerr
+                << ", " << (values[PERF_COUNTER_CYCLES] / bytes) << " cycles/byte, "
+                << (values[PERF_COUNTER_CYCLES] ? ((double)values[PERF_COUNTER_INSTRUCTIONS] / values[PERF_COUNTER_CYCLES]) : 0) << " IPC, "
+                << (uint64_t)(values[PERF_COUNTER_LLC_MISSES] / (bytes / GiB)) << " LLC misses/GiB";
+        }
+
+        std::cerr << std::endl;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+enum TPerfStage {
+    PERF_STAGE_ZERO,
+    PERF_STAGE_CIPHER,
+    PERF_STAGE_FINGERPRINT,
+
+    PERF_STAGE_COUNT,
+};
+
+enum TPerfCounter {
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_LLC_MISSES,
+    PERF_COUNTER_TASK_CLOCK,
+
+    PERF_COUNTER_COUNT,
+};
+
+struct TPerfTotals {
+    uint64_t Bytes[PERF_STAGE_COUNT] = {};
+    uint64_t Values[PERF_STAGE_COUNT][PERF_COUNTER_COUNT] = {};
+    bool Multiplexed = false;
+};
+
+// Sums the counters of all threads and prints them at exit.
+class TPerfCollector {
+public:
+    void Merge(const TPerfTotals& totals, const bool hardware);
+    void Report();
+
+private:
+    std::mutex Lock;
+    TPerfTotals Totals;
+    bool Hardware = false;
+    bool Merged = false;
+};
+
+// perf_event_open() counters of the calling thread, user space only. Falls
+// back to the task clock where hardware counters are unavailable (most VMs).
+// When the kernel multiplexes the group, counts are scaled up by the share
+// of time it was scheduled, and the report says so.
+// Lap() charges everything since the previous Start()/Lap() to a stage; the
+// totals are merged into the collector on destruction. Without a collector
+// every call is a no-op.
+class TPerfCounters {
+public:
+    explicit TPerfCounters(TPerfCollector* collector);
+    ~TPerfCounters();
+
+    TPerfCounters(const TPerfCounters&) = delete;
+    TPerfCounters& operator=(const TPerfCounters&) = delete;
+
+    void Start() {
+        if (Leader >= 0) {
+            Read(Last);
+        }
+    }
+
+    void Lap(const TPerfStage stage, const uint64_t bytes);
+
+private:
+    bool Read(uint64_t* values);
+
+private:
+    TPerfCollector* Collector;
+    int Leader = -1;
+    std::vector<int> Fds;
+    int Index[PERF_COUNTER_COUNT];
+    uint64_t Last[PERF_COUNTER_COUNT] = {};
+    TPerfTotals Totals;
+};
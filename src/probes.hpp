@@ -0,0 +1,21 @@
+#pragma once
+
+// USDT probes (provider "bdenc") for bpftrace, perf and SystemTap, e.g.
+//
+//   bpftrace -e 'usdt:/usr/bin/bdenc:bdenc:flush { @[arg1] = count(); }'
+//
+// Every probe carries an offset and a size. A disabled probe is a single
+// nop; without <sys/sdt.h> (systemtap-sdt-dev) they compile to nothing,
+// which CMake warns about.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BDENC_HAVE_SDT
+#endif
+#endif
+
+#ifdef BDENC_HAVE_SDT
+#define BDENC_PROBE(name, offset, size) DTRACE_PROBE2(bdenc, name, (uint64_t)(offset), (uint64_t)(size))
+#else
+#define BDENC_PROBE(name, offset, size) do { (void)(offset); (void)(size); } while (0)
+#endif
@@ -0,0 +1,195 @@
+#include "qcow2.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <string>
+#include <endian.h>
+#include <string.h>
+
+static const uint32_t Qcow2Magic(0x514649FB); // "QFI\xfb"
+static const uint64_t Qcow2OffsetMask(0x00FFFFFFFFFFFE00ULL);
+static const uint64_t Qcow2Compressed(1ULL << 62);
+static const uint64_t Qcow2Corrupt(1ULL << 1);
+static const uint64_t Qcow2ExternalData(1ULL << 2);
+static const uint64_t Qcow2ExtendedL2(1ULL << 4);
+static const uint64_t Qcow2KnownFeatures((1ULL << 5) - 1);
+static const uint32_t Qcow2MaxL1Entries(4 * 1024 * 1024);
+static const uint32_t Qcow2MaxSnapshots(65536);
+
+template<typename T>
+static T BE(const std::string& data, const size_t pos) {
+    T out;
+
+    memcpy(&out, data.data() + pos, sizeof(out));
+
+    if (sizeof(T) == 8) {
+        return be64toh(out);
+
+    } else if (sizeof(T) == 4) {
+        return be32toh(out);
+
+    } else {
+        return be16toh(out);
+    }
+}
+
+// Table entries point at whole clusters inside the file.
+static bool IsValidCluster(const TDevice& dev, const uint64_t offset, const uint64_t clusterSize) {
+    return (((offset % clusterSize) == 0) && (offset < dev.Size()));
+}
+
+static bool AddL2Table(const TDevice& dev, const uint64_t offset, const uint64_t clusterSize, TExtentMap& map) {
+    std::string table;
+
+    if (!ReadAligned(dev, offset, clusterSize, table)) {
+        std::cerr << "Can't read qcow2 L2 table at " << offset << std::endl;
+        return false;
+    }
+
+    for (size_t pos = 0; pos < clusterSize; pos += 8) {
+        const uint64_t entry(BE<uint64_t>(table, pos));
+        const uint64_t host(entry & Qcow2OffsetMask);
+
+        if (entry & Qcow2Compressed) {
+            std::cerr << "Compressed qcow2 clusters aren't supported" << std::endl;
+            return false;
+        }
+
+        if (host == 0) {
+            continue;
+        }
+
+        if (!IsValidCluster(dev, host, clusterSize)) {
+            std::cerr << "Invalid qcow2 data cluster " << host << " in L2 table at " << offset << std::endl;
+            return false;
+        }
+
+        // The last cluster may be cut short by the end of the file.
+        map.Add(host, std::min<uint64_t>(host + clusterSize, dev.Size()));
+    }
+
+    return true;
+}
+
+// L2 tables shared with snapshots are walked only once.
+static bool AddL1Table(const TDevice& dev, const uint64_t offset, const uint32_t entries, const uint64_t clusterSize, std::set<uint64_t>& tables, TExtentMap& map) {
+    if (entries == 0) {
+        return true;
+    }
+
+    std::string table;
+
+    if ((entries > Qcow2MaxL1Entries) || !ReadAligned(dev, offset, (size_t)entries * 8, table)) {
+        std::cerr << "Can't read qcow2 L1 table at " << offset << std::endl;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < entries; ++i) {
+        const uint64_t l2(BE<uint64_t>(table, i * 8) & Qcow2OffsetMask);
+
+        if ((l2 == 0) || !tables.insert(l2).second) {
+            continue;
+        }
+
+        if (!IsValidCluster(dev, l2, clusterSize)) {
+            std::cerr << "Invalid qcow2 L2 table " << l2 << " in L1 table at " << offset << std::endl;
+            return false;
+        }
+
+        if (!AddL2Table(dev, l2, clusterSize, map)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ReadQcow2DataMap(const TDevice& dev, const size_t chunkSize, TExtentMap& map) {
+    std::string header;
+
+    if (!ReadAligned(dev, 0, 104, header) || (BE<uint32_t>(header, 0) != Qcow2Magic)) {
+        std::cerr << "Not a qcow2 image" << std::endl;
+        return false;
+    }
+
+    const uint32_t version(BE<uint32_t>(header, 4));
+    const uint32_t clusterBits(BE<uint32_t>(header, 20));
+
+    if ((version < 2) || (version > 3) || (clusterBits < 9) || (clusterBits > 21)) {
+        std::cerr << "Unsupported qcow2 header (version " << version << ", cluster bits " << clusterBits << ")" << std::endl;
+        return false;
+    }
+
+    const uint64_t clusterSize(1ULL << clusterBits);
+
+    if ((clusterSize % chunkSize) != 0) {
+        std::cerr << "qcow2 cluster size (" << clusterSize << ") must be multiple of chunk size (-s " << chunkSize << ")" << std::endl;
+        return false;
+    }
+
+    // Version 2 has no feature bits; the dirty bit only concerns refcounts.
+    const uint64_t features((version >= 3) ? BE<uint64_t>(header, 72) : 0);
+
+    if (features & Qcow2Corrupt) {
+        std::cerr << "qcow2 image is marked corrupt" << std::endl;
+        return false;
+    }
+
+    if ((features & (Qcow2ExternalData | Qcow2ExtendedL2)) || (features & ~Qcow2KnownFeatures)) {
+        std::cerr << "qcow2 image uses unsupported features (" << features << ")" << std::endl;
+        return false;
+    }
+
+    std::set<uint64_t> tables;
+
+    if (!AddL1Table(dev, BE<uint64_t>(header, 40), BE<uint32_t>(header, 36), clusterSize, tables, map)) {
+        return false;
+    }
+
+    const uint32_t snapshots(BE<uint32_t>(header, 60));
+    uint64_t offset(BE<uint64_t>(header, 64));
+
+    if (snapshots > Qcow2MaxSnapshots) {
+        std::cerr << "Invalid qcow2 snapshot count (" << snapshots << ")" << std::endl;
+        return false;
+    }
+
+    // Snapshot entries are a fixed part, extra data, ID and name, padded to
+    // 8 bytes.
+    for (uint32_t i = 0; i < snapshots; ++i) {
+        std::string entry;
+
+        if (!ReadAligned(dev, offset, 40, entry)) {
+            std::cerr << "Can't read qcow2 snapshot table at " << offset << std::endl;
+            return false;
+        }
+
+        if (!AddL1Table(dev, BE<uint64_t>(entry, 0), BE<uint32_t>(entry, 8), clusterSize, tables, map)) {
+            return false;
+        }
+
+        const uint64_t size(40 + BE<uint32_t>(entry, 36) + BE<uint16_t>(entry, 12) + BE<uint16_t>(entry, 14));
+
+        offset += (size + 7) / 8 * 8;
+    }
+
+    map.Finish();
+
+    return true;
+}
+
+bool IsQcow2Workdir(const stdfs::path& wd) {
+    return stdfs::exists(wd / ".qcow2");
+}
+
+bool MarkQcow2Workdir(const stdfs::path& wd) {
+    const auto path = wd / ".qcow2";
+
+    if (!CreateFile(path.string(), 0, nullptr)) {
+        std::cerr << "Can't create " << path.string() << std::endl;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.hpp"
+#include "device.hpp"
+#include "extents.hpp"
+
+#include <stddef.h>
+
+// Collects the host extents of the data clusters a qcow2 image maps through
+// its active L1 table and the L1 tables of its snapshots. The rest of the
+// file (header, L1/L2 and refcount tables, snapshot table, free clusters)
+// has to stay as it is for the image to stay valid. Clusters must consist of
+// whole chunks; compressed clusters, external data files and extended L2
+// entries aren't supported.
+bool ReadQcow2DataMap(const TDevice& dev, const size_t chunkSize, TExtentMap& map);
+
+// Workdirs that converted a qcow2 image are marked, since only the data
+// clusters of their target hold ciphertext and everything else has to treat
+// it as a qcow2 image too.
+bool IsQcow2Workdir(const stdfs::path& wd);
+bool MarkQcow2Workdir(const stdfs::path& wd);
@@ -0,0 +1,41 @@
+#include "ratelimit.hpp"
+
+#include <algorithm>
+
+TRateLimiter::TRateLimiter(const uint64_t rate)
+    : Rate(rate)
+    , Next(std::chrono::steady_clock::now())
+{
+}
+
+void TRateLimiter::SetRate(const uint64_t rate) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    Rate = rate;
+    Next = std::chrono::steady_clock::now();
+    ++Generation;
+    RateChanged.notify_all();
+}
+
+uint64_t TRateLimiter::GetRate() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    return Rate;
+}
+
+void TRateLimiter::Acquire(const uint64_t size) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    while (Rate > 0) {
+        const auto start = std::max(Next, std::chrono::steady_clock::now());
+        const uint64_t generation(Generation);
+
+        Next = start + std::chrono::nanoseconds((uint64_t)((long double)size * 1000000000 / Rate));
+
+        // SetRate() drops every reservation, so a woken caller makes a new
+        // one at the new rate.
+        if (!RateChanged.wait_until(guard, start, [&]() { return (Generation != generation); })) {
+            return;
+        }
+    }
+}
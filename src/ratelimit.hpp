@@ -0,0 +1,26 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+// Paces callers so that all of them together stay within Rate bytes per
+// second. A zero rate means unlimited. A new rate applies to callers that
+// are already waiting, too.
+class TRateLimiter {
+public:
+    explicit TRateLimiter(const uint64_t rate = 0);
+
+    void SetRate(const uint64_t rate);
+    uint64_t GetRate();
+
+    void Acquire(const uint64_t size);
+
+private:
+    std::mutex Lock;
+    std::condition_variable RateChanged;
+    uint64_t Rate;
+    uint64_t Generation = 0;
+    std::chrono::steady_clock::time_point Next;
+};
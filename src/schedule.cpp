@@ -0,0 +1,295 @@
+#include "schedule.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char* DayNames[7] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+static bool ParseDay(const std::string& str, int& day) {
+    for (int i = 0; i < 7; ++i) {
+        if (strcasecmp(str.c_str(), DayNames[i]) == 0) {
+            day = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// "*", or a comma-separated list of days and day ranges, e.g. "mon-fri,sun".
+// Bit i stands for tm_wday i.
+static bool ParseDays(const std::string& str, unsigned& days) {
+    if (str == "*") {
+        days = 0x7F;
+        return true;
+    }
+
+    std::istringstream list(str);
+    std::string item;
+
+    days = 0;
+
+    while (std::getline(list, item, ',')) {
+        const size_t dash(item.find('-'));
+        int first(0);
+        int last(0);
+
+        if (!ParseDay(item.substr(0, dash), first) || ((dash != std::string::npos) ? !ParseDay(item.substr(dash + 1), last) : !ParseDay(item, last))) {
+            return false;
+        }
+
+        for (int day = first;; day = (day + 1) % 7) {
+            days |= (1u << day);
+
+            if (day == last) {
+                break;
+            }
+        }
+    }
+
+    return (days != 0);
+}
+
+// "HH:MM" as minutes since midnight; 24:00 ends the day.
+static bool ParseTime(const std::string& str, int& minutes) {
+    unsigned hours(0);
+    unsigned mins(0);
+    char tail(0);
+
+    if ((sscanf(str.c_str(), "%u:%u%c", &hours, &mins, &tail) != 2) || (mins > 59) || (hours > 24) || ((hours == 24) && (mins > 0))) {
+        return false;
+    }
+
+    minutes = hours * 60 + mins;
+
+    return true;
+}
+
+// POSIX TZ strings such as "UTC-3" carry their offset; names have to exist
+// in the zone database, or glibc silently falls back to UTC.
+static bool IsValidZone(const std::string& zone) {
+    if (std::any_of(zone.begin(), zone.end(), [](const char chr) { return isdigit((unsigned char)chr); })) {
+        return true;
+    }
+
+    const char* dir(getenv("TZDIR"));
+
+    return stdfs::exists(stdfs::path(dir ? dir : "/usr/share/zoneinfo") / zone);
+}
+
+TSchedule::~TSchedule() {
+    Stop();
+}
+
+bool TSchedule::ParseLine(const std::string& line, TWindow& window) const {
+    std::istringstream fields(line);
+    std::string days;
+    std::string field;
+
+    fields >> days;
+
+    if (days == "default") {
+        window.Always = true;
+
+    } else {
+        std::string times;
+
+        fields >> times;
+
+        const size_t dash(times.find('-'));
+
+        if (!ParseDays(days, window.Days) || (dash == std::string::npos) || !ParseTime(times.substr(0, dash), window.Begin) || !ParseTime(times.substr(dash + 1), window.End)) {
+            return false;
+        }
+    }
+
+    while (fields >> field) {
+        const size_t eq(field.find('='));
+        const std::string name(field.substr(0, eq));
+        const std::string value((eq == std::string::npos) ? "" : field.substr(eq + 1));
+        uint64_t num(0);
+
+        if ((field == "pause") || (field == "paused")) {
+            window.Settings.Paused = true;
+
+        } else if ((name == "rate") && ParseSize(value.c_str(), num)) {
+            window.Settings.HasRate = true;
+            window.Settings.Rate = num;
+
+        } else if ((name == "threads") && ParseSize(value.c_str(), num) && (num > 0)) {
+            window.Settings.Threads = num;
+
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool TSchedule::Load(const std::string& path) {
+    std::ifstream file(path);
+
+    if (!file) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    size_t number(0);
+
+    while (std::getline(file, line)) {
+        ++number;
+
+        line = line.substr(0, line.find('#'));
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+
+        if (line.empty()) {
+            continue;
+        }
+
+        if (line.compare(0, 9, "timezone ") == 0) {
+            const std::string zone(line.substr(line.find_first_not_of(' ', 9)));
+
+            if (!IsValidZone(zone)) {
+                std::cerr << path << ":" << number << ": unknown timezone: " << zone << std::endl;
+                return false;
+            }
+
+            setenv("TZ", zone.c_str(), 1);
+            tzset();
+
+            continue;
+        }
+
+        TWindow window;
+
+        window.Name = line;
+
+        if (!ParseLine(line, window)) {
+            std::cerr << path << ":" << number << ": invalid window: " << line << std::endl;
+            return false;
+        }
+
+        Windows.push_back(window);
+    }
+
+    if (file.bad()) {
+        std::cerr << "Can't read " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+size_t TSchedule::MaxThreads() const {
+    size_t out(0);
+
+    for (const auto& window : Windows) {
+        out = std::max(out, window.Settings.Threads);
+    }
+
+    return out;
+}
+
+void TSchedule::Start(const TScheduleSettings& fallback, TApply apply) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    Fallback.Name = "outside the schedule";
+    Fallback.Settings = fallback;
+    Apply = std::move(apply);
+
+    Update();
+
+    Thread = std::thread([this]() {
+        Loop();
+    });
+}
+
+void TSchedule::Stop() {
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        Stopped = true;
+        Changed.notify_all();
+    }
+
+    if (Thread.joinable()) {
+        Thread.join();
+    }
+}
+
+const TSchedule::TWindow* TSchedule::Find(const struct tm& now) const {
+    const int minute(now.tm_hour * 60 + now.tm_min);
+    const int yesterday((now.tm_wday + 6) % 7);
+
+    for (const auto& window : Windows) {
+        if (window.Always) {
+            continue;
+        }
+
+        const bool today(window.Days & (1u << now.tm_wday));
+
+        if (window.Begin < window.End) {
+            if (today && (window.Begin <= minute) && (minute < window.End)) {
+                return &window;
+            }
+
+        } else if ((today && (minute >= window.Begin)) || ((window.Days & (1u << yesterday)) && (minute < window.End))) {
+            return &window;
+        }
+    }
+
+    for (const auto& window : Windows) {
+        if (window.Always) {
+            return &window;
+        }
+    }
+
+    return &Fallback;
+}
+
+// Called with Lock held.
+void TSchedule::Update() {
+    const time_t now(time(nullptr));
+    struct tm local;
+
+    localtime_r(&now, &local);
+
+    const TWindow* window(Find(local));
+
+    if (window == Current) {
+        return;
+    }
+
+    char stamp[64];
+
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M %Z", &local);
+    std::cerr << "Schedule: " << stamp << ", " << window->Name << std::endl;
+
+    Current = window;
+    Apply(window->Settings);
+}
+
+void TSchedule::Loop() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    while (true) {
+        const auto next = std::chrono::time_point_cast<std::chrono::minutes>(std::chrono::system_clock::now()) + std::chrono::minutes(1);
+
+        if (Changed.wait_until(guard, next, [this]() { return Stopped; })) {
+            return;
+        }
+
+        Update();
+    }
+}
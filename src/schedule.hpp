@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// What a schedule window sets; a zero Threads and an unset rate leave the
+// current values alone.
+struct TScheduleSettings {
+    bool HasRate = false;
+    uint64_t Rate = 0;
+    size_t Threads = 0;
+    bool Paused = false;
+};
+
+// Time-of-day windows from a schedule file, one per line:
+//
+//     timezone Europe/Berlin
+//     mon-fri 09:00-18:00 rate=50M threads=2
+//     sat,sun 00:00-24:00 rate=0
+//     * 12:00-13:00 pause
+//     default rate=0
+//
+// Days are mon..sun, as ranges, lists or "*". A window that ends before it
+// starts runs past midnight into the next day. The first matching window
+// wins and "default" applies outside all of them; without one, the settings
+// given at Start() do. Times are wall-clock times in the given zone (the
+// local one by default), so DST changes are followed. rate=0 is unlimited
+// and "pause" holds intake. Settings changed over the control socket last
+// until the next transition.
+class TSchedule {
+public:
+    using TApply = std::function<void(const TScheduleSettings&)>;
+
+    TSchedule() = default;
+    ~TSchedule();
+
+    bool Load(const std::string& path);
+
+    size_t MaxThreads() const;
+
+    // Applies the current window, then re-evaluates it every minute and
+    // logs every transition.
+    void Start(const TScheduleSettings& fallback, TApply apply);
+    void Stop();
+
+private:
+    struct TWindow {
+        std::string Name;
+        unsigned Days = 0;
+        int Begin = 0;
+        int End = 0;
+        bool Always = false;
+        TScheduleSettings Settings;
+    };
+
+    bool ParseLine(const std::string& line, TWindow& window) const;
+    const TWindow* Find(const struct tm& now) const;
+    void Update();
+    void Loop();
+
+private:
+    std::vector<TWindow> Windows;
+    TWindow Fallback;
+    TApply Apply;
+    const TWindow* Current = nullptr;
+    std::mutex Lock;
+    std::condition_variable Changed;
+    bool Stopped = false;
+    std::thread Thread;
+};
@@ -0,0 +1,405 @@
+#include "serve.hpp"
+#include "cache.hpp"
+#include "cipher.hpp"
+#include "badblocks.hpp"
+#include "common.hpp"
+#include "device.hpp"
+#include "qcow2.hpp"
+#include "state.hpp"
+
+#include <ac-common/file.hpp>
+#include <ac-common/utils/htonll.hpp>
+#include <ac-common/utils/string.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <string.h>
+
+static const uint64_t ServeMaxRequest(64 * 1024 * 1024);
+
+namespace {
+    struct TServeOptions {
+        std::string DevPath;
+        std::string WorkdirPath;
+        size_t ChunkSize = 4096;
+        uint64_t CacheSize = 64 * 1024 * 1024;
+        size_t Shards = 16;
+    };
+
+    bool LoadOffset(const stdfs::path& path, uint64_t& offset) {
+        offset = 0;
+
+        if (!stdfs::exists(path)) {
+            return true;
+        }
+
+        NAC::TFile file(path.string());
+
+        if (!file || (file.Size() != sizeof(offset))) {
+            std::cerr << "Can't load " << path.string() << std::endl;
+            return false;
+        }
+
+        memcpy(&offset, file.Data(), sizeof(offset));
+        offset = NAC::ntoh(offset);
+
+        return true;
+    }
+
+    class TServer {
+    public:
+        TServer(const TServeOptions& options, const TKeyMaterial& keys, const TDevice& dev, const uint64_t size, const NAC::TFile& sparse, const TTargetState* target, const TBadBlocks& badBlocks)
+            : Dev(dev)
+            , Size(size)
+            , Sparse(sparse)
+            , Target(target)
+            , BadBlocks(badBlocks)
+            , ChunkSize(options.ChunkSize)
+            , Cache(options.CacheSize, options.ChunkSize, options.Shards)
+            , Decrypt(MODE_DECRYPT, keys)
+            , Encrypt(MODE_ENCRYPT, keys)
+            , Raw(options.ChunkSize)
+        {
+        }
+
+        explicit operator bool() const {
+            return (Decrypt && Encrypt && Raw);
+        }
+
+        void Run() {
+            std::string line;
+
+            while (std::getline(std::cin, line)) {
+                std::istringstream request(line);
+                std::string command;
+                uint64_t offset(0);
+                uint64_t size(0);
+
+                request >> command;
+
+                if ((command == "read") || (command == "write")) {
+                    if (!(request >> offset >> size)) {
+                        Reply("error: expected " + command + " OFFSET SIZE");
+                        continue;
+                    }
+
+                    if ((offset > Size) || (size > (Size - offset)) || (size > ServeMaxRequest)) {
+                        // The payload still has to be consumed to stay in sync.
+                        if (command == "write") {
+                            std::cin.ignore(size);
+                        }
+
+                        Reply("error: out of range");
+                        continue;
+                    }
+                }
+
+                if (command == "read") {
+                    std::vector<char> data(size);
+                    std::string error;
+
+                    if (!Read(offset, size, data.data(), error)) {
+                        Reply("error: " + error);
+                        continue;
+                    }
+
+                    std::cout << "ok " << size << "\n";
+                    std::cout.write(data.data(), data.size());
+                    std::cout.flush();
+
+                } else if (command == "write") {
+                    std::vector<char> data(size);
+
+                    if (!std::cin.read(data.data(), data.size())) {
+                        break;
+                    }
+
+                    std::string error;
+
+                    if (!Write(offset, size, data.data(), error)) {
+                        Reply("error: " + error);
+                        continue;
+                    }
+
+                    Reply("ok");
+
+                } else if (command == "flush") {
+                    Reply(Dev.FSync() ? "ok" : "error: can't sync file");
+
+                } else if (command == "stats") {
+                    Reply("ok " + Cache.Stats());
+
+                } else {
+                    Reply("error: unknown command: " + command);
+                }
+            }
+
+            std::cerr << "Cache: " << Cache.Stats() << std::endl;
+        }
+
+    private:
+        void Reply(const std::string& line) {
+            std::cout << line << "\n";
+            std::cout.flush();
+        }
+
+        bool IsSparse(const uint64_t offset) const {
+            return (Target ? Target->IsSparse(offset) : FindSparse(Sparse, offset));
+        }
+
+        // Bad chunks were skipped by enc and hold no ciphertext.
+        bool IsBad(const uint64_t offset) const {
+            return BadBlocks.Overlaps(offset, offset + ChunkSize);
+        }
+
+        // Zero chunks were never encrypted, so they are neither decrypted
+        // nor cached.
+        bool ReadChunk(const uint64_t index, char* out) {
+            const uint64_t offset(index * ChunkSize);
+            uint64_t ticket(0);
+
+            if (IsSparse(offset)) {
+                memset(out, 0, ChunkSize);
+                return true;
+            }
+
+            if (Cache.Get(index, out, ticket)) {
+                return true;
+            }
+
+            if (!Dev.Read(offset, ChunkSize, Raw.Data()) || !Decrypt.Process(offset, ChunkSize, Raw.Data(), out)) {
+                return false;
+            }
+
+            Cache.Put(index, out, ticket);
+
+            return true;
+        }
+
+        bool Read(uint64_t offset, uint64_t size, char* out, std::string& error) {
+            std::unique_ptr<char[]> chunk(new char[ChunkSize]);
+
+            while (size > 0) {
+                const uint64_t pos(offset % ChunkSize);
+                const uint64_t len(std::min<uint64_t>(size, ChunkSize - pos));
+
+                if (IsBad(offset / ChunkSize * ChunkSize)) {
+                    error = "chunk at " + std::to_string(offset / ChunkSize * ChunkSize) + " is bad";
+                    return false;
+                }
+
+                if (!ReadChunk(offset / ChunkSize, chunk.get())) {
+                    error = "can't read " + std::to_string(offset);
+                    return false;
+                }
+
+                memcpy(out, chunk.get() + pos, len);
+                out += len;
+                offset += len;
+                size -= len;
+            }
+
+            return true;
+        }
+
+        // Partial chunks are read, patched and encrypted again as a whole.
+        bool Write(uint64_t offset, uint64_t size, const char* in, std::string& error) {
+            std::unique_ptr<char[]> chunk(new char[ChunkSize]);
+
+            // Sparse chunks stay zero on the target and are skipped by
+            // decryption, so they can't take data; neither can bad ones.
+            // This is checked up front so that a rejected request writes
+            // nothing.
+            for (uint64_t pos = 0; pos < size;) {
+                const uint64_t begin(offset + pos);
+                const uint64_t len(std::min<uint64_t>(size - pos, ChunkSize - (begin % ChunkSize)));
+
+                if (IsBad(begin / ChunkSize * ChunkSize)) {
+                    error = "chunk at " + std::to_string(begin / ChunkSize * ChunkSize) + " is bad";
+                    return false;
+                }
+
+                if (IsSparse(begin / ChunkSize * ChunkSize) && !std::all_of(in + pos, in + pos + len, [](const char chr) { return (chr == 0); })) {
+                    error = "chunk at " + std::to_string(begin / ChunkSize * ChunkSize) + " is sparse";
+                    return false;
+                }
+
+                pos += len;
+            }
+
+            while (size > 0) {
+                const uint64_t index(offset / ChunkSize);
+                const uint64_t pos(offset % ChunkSize);
+                const uint64_t len(std::min<uint64_t>(size, ChunkSize - pos));
+
+                if (!IsSparse(index * ChunkSize)) {
+                    if ((len < ChunkSize) && !ReadChunk(index, chunk.get())) {
+                        error = "can't read " + std::to_string(index * ChunkSize);
+                        return false;
+                    }
+
+                    memcpy(chunk.get() + pos, in, len);
+                    Cache.Invalidate(index);
+
+                    if (!Encrypt.Process(index * ChunkSize, ChunkSize, chunk.get(), Raw.Data()) || !Dev.Write(index * ChunkSize, ChunkSize, Raw.Data())) {
+                        error = "can't write " + std::to_string(index * ChunkSize);
+                        return false;
+                    }
+                }
+
+                in += len;
+                offset += len;
+                size -= len;
+            }
+
+            return true;
+        }
+
+    private:
+        const TDevice& Dev;
+        const uint64_t Size;
+        const NAC::TFile& Sparse;
+        const TTargetState* Target;
+        const TBadBlocks& BadBlocks;
+        const size_t ChunkSize;
+        TChunkCache Cache;
+        TChunkCipher Decrypt;
+        TChunkCipher Encrypt;
+        TAlignedBuffer Raw;
+    };
+}
+
+int RunServe(int argc, char** argv) {
+    TServeOptions options;
+
+    for (int i = 0; i < argc; ++i) {
+        const bool hasValue((i + 1) < argc);
+
+        if ((strcmp(argv[i], "-w") == 0) && hasValue) {
+            ++i;
+            options.WorkdirPath = argv[i];
+
+        } else if ((strcmp(argv[i], "-s") == 0) && hasValue) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.ChunkSize);
+
+        } else if ((strcmp(argv[i], "--cache") == 0) && hasValue) {
+            ++i;
+
+            if (!ParseSize(argv[i], options.CacheSize)) {
+                std::cerr << "Invalid cache size: " << argv[i] << std::endl;
+                return 1;
+            }
+
+        } else if ((strcmp(argv[i], "--shards") == 0) && hasValue) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], options.Shards);
+
+        } else if (options.DevPath.empty()) {
+            options.DevPath = argv[i];
+
+        } else {
+            std::cerr << "Invalid argument: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.DevPath.empty() || options.WorkdirPath.empty()) {
+        std::cerr << "Usage: bdenc serve -w /path/to/workdir [-s 4096] [--cache 64M] [--shards 16] /path/to/file" << std::endl;
+        return 1;
+    }
+
+    if ((options.ChunkSize == 0) || ((options.ChunkSize % 4096) != 0)) {
+        std::cerr << "Chunk size (-s) must be multiple of 4096" << std::endl;
+        return 1;
+    }
+
+    const stdfs::path wd(options.WorkdirPath);
+    TKeyMaterial keys;
+
+    if (!LoadKeyMaterial(wd, MODE_DECRYPT, IV_MODE_DEFAULT, keys)) {
+        return 1;
+    }
+
+    // Only the data clusters of a qcow2 image hold ciphertext.
+    if (IsQcow2Workdir(wd)) {
+        std::cerr << "Serving doesn't work with targets converted with qcow2 format (--format qcow2)" << std::endl;
+        return 1;
+    }
+
+    // Chained chunks depend on everything before them.
+    if (keys.IVMode != IV_MODE_ESSIV) {
+        std::cerr << "Serving needs a target encrypted with --iv essiv" << std::endl;
+        return 1;
+    }
+
+    TDevice dev(options.DevPath, O_RDWR | O_DIRECT);
+
+    if (!dev) {
+        std::cerr << "Can't open file" << std::endl;
+        return 1;
+    }
+
+    if ((dev.Size() % options.ChunkSize) != 0) {
+        std::cerr << "File size (" << dev.Size() << ") must be multiple of chunk size (-s " << options.ChunkSize << ")" << std::endl;
+        return 1;
+    }
+
+    // State may be kept on the target instead of in the workdir.
+    TTargetState target(dev);
+    uint64_t size(dev.Size());
+    uint64_t encOffset(0);
+    uint64_t decOffset(0);
+
+    if (!target.Load()) {
+        return 1;
+    }
+
+    if (target.Exists()) {
+        if (target.GetChunkSize() != options.ChunkSize) {
+            std::cerr << "State area was created with chunk size (-s " << target.GetChunkSize() << ")" << std::endl;
+            return 1;
+        }
+
+        size = target.DataEnd();
+        encOffset = target.GetOffset(MODE_ENCRYPT);
+        decOffset = target.GetOffset(MODE_DECRYPT);
+
+    } else if (!LoadOffset(wd / "enc_offset", encOffset) || !LoadOffset(wd / "dec_offset", decOffset)) {
+        return 1;
+    }
+
+    if ((encOffset < size) || (decOffset > 0)) {
+        std::cerr << "Target is not fully encrypted" << std::endl;
+        return 1;
+    }
+
+    const auto sparsePath = wd / "enc_sparse";
+    NAC::TFile sparse(sparsePath.string());
+
+    if (!sparse && stdfs::exists(sparsePath) && !stdfs::is_empty(sparsePath)) {
+        std::cerr << "Can't load sparse file" << std::endl;
+        return 1;
+    }
+
+    TBadBlocks badBlocks;
+
+    if (!badBlocks.Open(wd / "badblocks")) {
+        return 1;
+    }
+
+    TServer server(options, keys, dev, size, sparse, (target.Exists() ? &target : nullptr), badBlocks);
+
+    if (!server) {
+        return 1;
+    }
+
+    server.Run();
+
+    return 0;
+}
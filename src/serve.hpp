@@ -0,0 +1,13 @@
+#pragma once
+
+// `bdenc serve` gives random access to the plaintext of an essiv-encrypted
+// target without decrypting it in place. Requests come on stdin, one per
+// line, and replies go to stdout:
+//
+//     read OFFSET SIZE         -> "ok SIZE\n" followed by SIZE bytes
+//     write OFFSET SIZE\n DATA -> "ok\n"
+//     flush                    -> "ok\n"
+//     stats                    -> "ok hits=... misses=... ...\n"
+//
+// or "error: ...\n". Decrypted chunks are kept in a TChunkCache.
+int RunServe(int argc, char** argv);
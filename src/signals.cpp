@@ -0,0 +1,107 @@
+#include "signals.hpp"
+
+#include <iostream>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+static const std::chrono::milliseconds SignalPollInterval(100);
+
+static void FillSignals(sigset_t& set) {
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+}
+
+TSignalWatcher::TSignalWatcher(const std::chrono::seconds timeout)
+    : Timeout(timeout)
+{
+}
+
+TSignalWatcher::~TSignalWatcher() {
+    Stop();
+}
+
+bool TSignalWatcher::Start(std::function<void()> onStop) {
+    sigset_t set;
+
+    FillSignals(set);
+
+    const int rv(pthread_sigmask(SIG_BLOCK, &set, nullptr));
+
+    if (rv != 0) {
+        std::cerr << "pthread_sigmask: " << strerror(rv) << std::endl;
+        return false;
+    }
+
+    OnStop = std::move(onStop);
+    Thread = std::thread([this]() {
+        Loop();
+    });
+
+    return true;
+}
+
+void TSignalWatcher::Stop() {
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        Stopped = true;
+        Changed.notify_all();
+    }
+
+    if (Thread.joinable()) {
+        Thread.join();
+    }
+}
+
+void TSignalWatcher::Loop() {
+    sigset_t set;
+    timespec interval;
+
+    FillSignals(set);
+    interval.tv_sec = 0;
+    interval.tv_nsec = std::chrono::nanoseconds(SignalPollInterval).count();
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            if (Stopped) {
+                return;
+            }
+        }
+
+        const int signal(sigtimedwait(&set, nullptr, &interval));
+
+        if (signal > 0) {
+            Signal = signal;
+            break;
+        }
+    }
+
+    std::cerr << "Caught " << strsignal(Signal) << ", finishing the batches in flight (up to " << Timeout.count() << "s)" << std::endl;
+
+    OnStop();
+
+    const auto deadline = std::chrono::steady_clock::now() + Timeout;
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        {
+            std::unique_lock<std::mutex> guard(Lock);
+
+            if (Stopped) {
+                return;
+            }
+        }
+
+        if (sigtimedwait(&set, nullptr, &interval) > 0) {
+            std::cerr << "Caught another signal, exiting without waiting; run again to resume" << std::endl;
+            _exit(128 + Signal);
+        }
+    }
+
+    std::cerr << "Timed out waiting for the batches in flight, exiting; run again to resume" << std::endl;
+    _exit(128 + Signal);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// Turns SIGINT and SIGTERM into a graceful stop. The signals are blocked in
+// the calling thread (so Start() must precede any other thread) and picked
+// up by a watcher thread, which calls onStop once. If the run has not
+// finished Timeout later, or a second signal arrives, the process exits
+// right away; the journal makes that as safe as a crash.
+class TSignalWatcher {
+public:
+    explicit TSignalWatcher(const std::chrono::seconds timeout);
+    ~TSignalWatcher();
+
+    bool Start(std::function<void()> onStop);
+    void Stop();
+
+    // The signal that requested the stop, or 0.
+    int GetSignal() const {
+        return Signal;
+    }
+
+private:
+    void Loop();
+
+private:
+    const std::chrono::seconds Timeout;
+    std::function<void()> OnStop;
+    std::mutex Lock;
+    std::condition_variable Changed;
+    bool Stopped = false;
+    int Signal = 0;
+    std::thread Thread;
+};
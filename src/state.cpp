@@ -0,0 +1,536 @@
+#include "state.hpp"
+
+#include <ac-common/utils/htonll.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string.h>
+
+static const char StateMagic[] = "BDSTATE1";
+static const char JournalMagic[] = "BDJRNL01";
+static const size_t StateBlock(4096);
+static const size_t StateTailCapacity((StateBlock - 128) / 16);
+static const size_t StateBlockCapacity((StateBlock - 16) / 16);
+
+static uint64_t GetBE(const char* block, const size_t pos) {
+    uint64_t tmp;
+
+    memcpy(&tmp, block + pos, sizeof(tmp));
+
+    return NAC::ntoh(tmp);
+}
+
+static void PutBE(char* block, const size_t pos, const uint64_t value) {
+    const uint64_t tmp(NAC::hton(value));
+
+    memcpy(block + pos, &tmp, sizeof(tmp));
+}
+
+// The checksum field at offset 8 counts as zero.
+static uint64_t BlockChecksum(char* block, const size_t size, const uint64_t seed) {
+    const uint64_t stored(GetBE(block, 8));
+
+    PutBE(block, 8, 0);
+
+    const uint64_t sum(Checksum(block, size, seed));
+
+    PutBE(block, 8, stored);
+
+    return sum;
+}
+
+bool TTargetState::Load() {
+    TAlignedBuffer headers(2 * StateBlock);
+
+    // Areas are only created on block-aligned targets.
+    if ((Dev.Size() < (2 * StateBlock)) || ((Dev.Size() % StateBlock) != 0) || !headers) {
+        return true;
+    }
+
+    if (!Dev.Read(Dev.Size() - 2 * StateBlock, 2 * StateBlock, headers.Data())) {
+        std::cerr << "Can't read state area" << std::endl;
+        return false;
+    }
+
+    char* best(nullptr);
+
+    for (size_t i = 0; i < 2; ++i) {
+        char* block(headers.Data() + i * StateBlock);
+
+        if (
+            (memcmp(block, StateMagic, 8) == 0)
+            && (GetBE(block, 8) == BlockChecksum(block, StateBlock, 0))
+            && (!best || (GetBE(block, 16) > GetBE(best, 16)))
+        ) {
+            best = block;
+            DurableBlock = i;
+        }
+    }
+
+    if (!best) {
+        return true;
+    }
+
+    Seq = GetBE(best, 16);
+    Area = GetBE(best, 24);
+    ChunkSize = GetBE(best, 32);
+    BatchSize = GetBE(best, 40);
+    Epoch = GetBE(best, 48);
+    Offsets[0] = Durable[0] = GetBE(best, 56);
+    Offsets[1] = Durable[1] = GetBE(best, 64);
+    UsedBlocks = GetBE(best, 72);
+
+    const uint64_t tail(GetBE(best, 80));
+
+    if (
+        (Area > Dev.Size()) || (Area < (3 * StateBlock)) || (ChunkSize == 0) || ((ChunkSize % StateBlock) != 0)
+        || (BatchSize < ChunkSize) || (tail > StateTailCapacity)
+    ) {
+        std::cerr << "Invalid state area header" << std::endl;
+        return false;
+    }
+
+    Layout();
+
+    if ((UsedBlocks > ExtentBlocks) || !LoadExtents(UsedBlocks)) {
+        std::cerr << "Can't load sparse extents from state area" << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < tail; ++i) {
+        Extents.emplace_back(GetBE(best, 128 + i * 16), GetBE(best, 128 + i * 16 + 8));
+    }
+
+    return true;
+}
+
+bool TTargetState::Create(const uint64_t area, const size_t chunkSize, const size_t batchSize, const bool overwrite) {
+    if (((area % StateBlock) != 0) || ((area % chunkSize) != 0) || (area >= Dev.Size())) {
+        std::cerr << "State area (" << area << ") must be multiple of " << StateBlock << " and of chunk size (-s " << chunkSize << "), and smaller than the target" << std::endl;
+        return false;
+    }
+
+    std::random_device rd;
+
+    Area = area;
+    ChunkSize = chunkSize;
+    BatchSize = batchSize;
+    Epoch = ((uint64_t)rd() << 32) | rd();
+    Seq = 0;
+
+    Layout();
+
+    if (Slots.size() < 2) {
+        std::cerr << "State area (" << area << ") has no room for a journal of " << batchSize << "-byte batches" << std::endl;
+        Area = 0;
+        return false;
+    }
+
+    // Nothing keeps what was there, and dec can't bring it back.
+    if (!overwrite && !IsAreaEmpty()) {
+        Area = 0;
+        return false;
+    }
+
+    // Clears headers left from an earlier area that could outrank ours.
+    TAlignedBuffer zero(2 * StateBlock);
+
+    if (!zero) {
+        return false;
+    }
+
+    memset(zero.Data(), 0, zero.Size());
+
+    if (!Dev.Write(Dev.Size() - 2 * StateBlock, 2 * StateBlock, zero.Data())) {
+        std::cerr << "Can't write state area" << std::endl;
+        return false;
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        Dirty = true;
+    }
+
+    return Sync();
+}
+
+bool TTargetState::IsAreaEmpty() const {
+    static const uint64_t step(1024 * 1024);
+    TAlignedBuffer buf(step);
+
+    if (!buf) {
+        return false;
+    }
+
+    for (uint64_t offset = DataEnd(); offset < Dev.Size(); offset += step) {
+        const uint64_t size(std::min<uint64_t>(step, Dev.Size() - offset));
+
+        if (!Dev.Read(offset, size, buf.Data())) {
+            std::cerr << "Can't read state area" << std::endl;
+            return false;
+        }
+
+        if (!std::all_of(buf.Data(), buf.Data() + size, [](const char chr) { return (chr == 0); })) {
+            std::cerr << "The last " << Area << " byte(s) of the target are not empty (at " << offset << "), pass --overwrite-tail to reserve them anyway" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void TTargetState::Layout() {
+    ExtentBlocks = std::max<uint64_t>(1, Area / 4 / StateBlock);
+
+    const uint64_t fixed((ExtentBlocks + 2) * StateBlock);
+
+    Slots.assign(((Area > fixed) ? ((Area - fixed) / SlotSize()) : 0), TSlot());
+}
+
+bool TTargetState::LoadExtents(const uint64_t blocks) {
+    if (blocks == 0) {
+        return true;
+    }
+
+    TAlignedBuffer buf(blocks * StateBlock);
+
+    if (!buf || !Dev.Read(ExtentsBegin(), buf.Size(), buf.Data())) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < blocks; ++i) {
+        char* block(buf.Data() + i * StateBlock);
+        const uint64_t count(GetBE(block, 0));
+
+        if ((count > StateBlockCapacity) || (GetBE(block, 8) != BlockChecksum(block, StateBlock, Epoch + i))) {
+            return false;
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            Extents.emplace_back(GetBE(block, 16 + j * 16), GetBE(block, 16 + j * 16 + 8));
+        }
+    }
+
+    Flushed = Extents.size();
+
+    return true;
+}
+
+bool TTargetState::WriteHeader() {
+    TAlignedBuffer buf(StateBlock);
+
+    if (!buf) {
+        return false;
+    }
+
+    char* block(buf.Data());
+    const size_t tail(Extents.size() - Flushed);
+
+    memset(block, 0, StateBlock);
+    memcpy(block, StateMagic, 8);
+    PutBE(block, 16, Seq);
+    PutBE(block, 24, Area);
+    PutBE(block, 32, ChunkSize);
+    PutBE(block, 40, BatchSize);
+    PutBE(block, 48, Epoch);
+    PutBE(block, 56, Offsets[0]);
+    PutBE(block, 64, Offsets[1]);
+    PutBE(block, 72, UsedBlocks);
+    PutBE(block, 80, tail);
+
+    for (size_t i = 0; i < tail; ++i) {
+        PutBE(block, 128 + i * 16, Extents[Flushed + i].first);
+        PutBE(block, 128 + i * 16 + 8, Extents[Flushed + i].second);
+    }
+
+    PutBE(block, 8, BlockChecksum(block, StateBlock, 0));
+
+    if (!Dev.Write(HeaderOffset(1 - DurableBlock), StateBlock, block)) {
+        std::cerr << "Can't write state area header" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t TTargetState::GetOffset(const TMode mode) const {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    return Offsets[mode == MODE_DECRYPT];
+}
+
+bool TTargetState::IsSparse(const uint64_t offset) const {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    auto it = std::upper_bound(Extents.begin(), Extents.end(), std::pair<uint64_t, uint64_t>(offset, UINT64_MAX));
+
+    if (it == Extents.begin()) {
+        return false;
+    }
+
+    --it;
+
+    return (offset < (it->first + it->second));
+}
+
+bool TTargetState::Recover(const TMode mode) {
+    const uint64_t offset(GetOffset(mode));
+    TAlignedBuffer buf(SlotSize());
+
+    if (!buf) {
+        return false;
+    }
+
+    for (size_t i = 0; i < Slots.size(); ++i) {
+        const uint64_t pos(RingBegin() + i * SlotSize());
+        char* block(buf.Data());
+
+        if (!Dev.Read(pos, StateBlock, block)) {
+            std::cerr << "Can't read journal ring" << std::endl;
+            return false;
+        }
+
+        const uint64_t begin(GetBE(block, 32));
+        const uint64_t count(GetBE(block, 48));
+
+        if (
+            (memcmp(block, JournalMagic, 8) != 0) || (GetBE(block, 16) != Epoch) || (GetBE(block, 24) != (uint64_t)mode)
+            || (begin < offset) || (count == 0) || ((count * ChunkSize) > BatchSize)
+        ) {
+            continue;
+        }
+
+        // A torn slot was never followed by an in-place write.
+        if (!Dev.Read(pos + StateBlock, count * ChunkSize, block + StateBlock) || (GetBE(block, 8) != BlockChecksum(block, StateBlock + count * ChunkSize, Epoch))) {
+            continue;
+        }
+
+        Slots[i].Used = true;
+        Slots[i].Mode = mode;
+        Slots[i].End = GetBE(block, 40);
+
+        for (size_t j = 0; j < count; ++j) {
+            TRecovered& it = Recovered[GetBE(block, 128 + j * 8)];
+
+            it.Slot = i;
+            it.Index = j;
+        }
+    }
+
+    if (!Recovered.empty()) {
+        std::cerr << "Recovered " << Recovered.size() << " journaled chunk(s) from the state area" << std::endl;
+    }
+
+    return true;
+}
+
+bool TTargetState::HasJournal(const uint64_t offset) const {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    return (Recovered.count(offset) > 0);
+}
+
+bool TTargetState::ReadJournal(const uint64_t offset, char* out) const {
+    std::unique_lock<std::mutex> guard(Lock);
+    auto it = Recovered.find(offset);
+
+    if (it == Recovered.end()) {
+        return false;
+    }
+
+    const uint64_t pos(RingBegin() + it->second.Slot * SlotSize() + StateBlock + it->second.Index * ChunkSize);
+
+    guard.unlock();
+
+    return Dev.Read(pos, ChunkSize, out);
+}
+
+bool TTargetState::WriteJournal(const TMode mode, const uint64_t begin, const uint64_t end, const std::vector<uint64_t>& offsets, const char* data) {
+    const uint64_t size(StateBlock + offsets.size() * ChunkSize);
+    TAlignedBuffer buf(size);
+
+    if (!buf || ((offsets.size() * ChunkSize) > BatchSize)) {
+        return false;
+    }
+
+    char* block(buf.Data());
+
+    memset(block, 0, StateBlock);
+    memcpy(block, JournalMagic, 8);
+    PutBE(block, 16, Epoch);
+    PutBE(block, 24, mode);
+    PutBE(block, 32, begin);
+    PutBE(block, 40, end);
+    PutBE(block, 48, offsets.size());
+
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        PutBE(block, 128 + i * 8, offsets[i]);
+        memcpy(block + StateBlock + i * ChunkSize, data + (offsets[i] - begin), ChunkSize);
+    }
+
+    PutBE(block, 8, BlockChecksum(block, size, Epoch));
+
+    std::unique_lock<std::mutex> guard(Lock);
+    size_t slot(Slots.size());
+
+    while (true) {
+        for (size_t i = 0; i < Slots.size(); ++i) {
+            if (!Slots[i].Used) {
+                slot = i;
+                break;
+            }
+        }
+
+        if (slot < Slots.size()) {
+            break;
+        }
+
+        // Every slot waits for a flushed header; make one, then wait for
+        // the batches still in flight.
+        guard.unlock();
+
+        if (!Sync()) {
+            return false;
+        }
+
+        guard.lock();
+
+        if (std::none_of(Slots.begin(), Slots.end(), [](const TSlot& it) { return !it.Used; })) {
+            SlotFreed.wait_for(guard, std::chrono::milliseconds(10));
+        }
+    }
+
+    Slots[slot].Used = true;
+    Slots[slot].Mode = mode;
+    Slots[slot].End = end;
+
+    guard.unlock();
+
+    if (!Dev.Write(RingBegin() + slot * SlotSize(), size, block)) {
+        std::cerr << "Failed at " << std::to_string(begin) << ": can't write journal ring" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool TTargetState::Commit(const TMode mode, const uint64_t offset, const std::vector<uint64_t>& zeroes) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    for (const uint64_t it : zeroes) {
+        if ((Extents.size() > Flushed) && ((Extents.back().first + Extents.back().second) == it)) {
+            Extents.back().second += ChunkSize;
+            continue;
+        }
+
+        if ((Extents.size() - Flushed) == StateTailCapacity) {
+            if (UsedBlocks == ExtentBlocks) {
+                std::cerr << "Failed at " << std::to_string(it) << ": state area is out of room for sparse extents" << std::endl;
+                return false;
+            }
+
+            TAlignedBuffer buf(StateBlock);
+
+            if (!buf) {
+                return false;
+            }
+
+            char* block(buf.Data());
+
+            memset(block, 0, StateBlock);
+            PutBE(block, 0, StateTailCapacity);
+
+            for (size_t i = 0; i < StateTailCapacity; ++i) {
+                PutBE(block, 16 + i * 16, Extents[Flushed + i].first);
+                PutBE(block, 16 + i * 16 + 8, Extents[Flushed + i].second);
+            }
+
+            PutBE(block, 8, BlockChecksum(block, StateBlock, Epoch + UsedBlocks));
+
+            // The block has to be durable before a header refers to it.
+            if (!Dev.Write(ExtentsBegin() + UsedBlocks * StateBlock, StateBlock, block) || !Dev.FSync()) {
+                std::cerr << "Failed at " << std::to_string(it) << ": can't write sparse extents" << std::endl;
+                return false;
+            }
+
+            ++UsedBlocks;
+            Flushed = Extents.size();
+        }
+
+        Extents.emplace_back(it, ChunkSize);
+    }
+
+    Offsets[mode == MODE_DECRYPT] = offset;
+    Dirty = true;
+
+    return true;
+}
+
+bool TTargetState::Sync() {
+    std::unique_lock<std::mutex> syncGuard(SyncLock);
+    uint64_t written[2];
+    bool wrote(false);
+
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        written[0] = Offsets[0];
+        written[1] = Offsets[1];
+
+        if (Dirty) {
+            ++Seq;
+
+            if (!WriteHeader()) {
+                return false;
+            }
+
+            Dirty = false;
+            wrote = true;
+        }
+    }
+
+    if (!Dev.FSync()) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> guard(Lock);
+
+    // The next header goes to the other block, keeping this one intact.
+    if (wrote) {
+        DurableBlock = 1 - DurableBlock;
+    }
+
+    Durable[0] = std::max(Durable[0], written[0]);
+    Durable[1] = std::max(Durable[1], written[1]);
+    FreeSlots();
+
+    return true;
+}
+
+void TTargetState::FreeSlots() {
+    bool freed(false);
+
+    for (auto& it : Slots) {
+        if (it.Used && (it.End <= Durable[it.Mode == MODE_DECRYPT])) {
+            it.Used = false;
+            freed = true;
+        }
+    }
+
+    if (!freed) {
+        return;
+    }
+
+    for (auto it = Recovered.begin(); it != Recovered.end();) {
+        if (Slots[it->second.Slot].Used) {
+            ++it;
+
+        } else {
+            it = Recovered.erase(it);
+        }
+    }
+
+    SlotFreed.notify_all();
+}
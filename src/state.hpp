@@ -0,0 +1,149 @@
+#pragma once
+
+#include "common.hpp"
+#include "device.hpp"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+// Conversion state kept in a reserved area at the end of the target, so that
+// one device flush covers both data and state. From the start of the area:
+//
+//     sparse extents   full blocks of (begin, length) pairs, never rewritten
+//     journal ring     slots of a 4 KiB header and up to one batch of chunks
+//     two headers      the newest valid one wins
+//
+// The header holds both offsets and the sparse extents that don't fill a
+// block yet. Every write is O_DIRECT and 4 KiB-aligned.
+//
+// Ordering: a batch's journal slot is flushed before the batch is written
+// in place. The header with the advanced offset is only written by the next
+// Sync(), into the block that doesn't hold the last flushed header, and
+// journal slots are reused only once that flush covers it. A torn header
+// write thus leaves the previous durable header intact, and a crash may lose
+// the latest offset but never a batch that was partly written. A full extent
+// block is flushed before the header that references it.
+class TTargetState {
+public:
+    explicit TTargetState(const TDevice& dev)
+        : Dev(dev)
+    {
+    }
+
+    TTargetState(const TTargetState&) = delete;
+    TTargetState& operator=(const TTargetState&) = delete;
+
+    // Reads the headers and sparse extents, if there are any.
+    bool Load();
+
+    bool Exists() const {
+        return (Area > 0);
+    }
+
+    // Reserves the last `area` bytes of the target and writes empty state.
+    // Refuses if the area holds anything but zeroes, unless `overwrite`.
+    bool Create(const uint64_t area, const size_t chunkSize, const size_t batchSize, const bool overwrite);
+
+    uint64_t GetArea() const {
+        return Area;
+    }
+
+    size_t GetChunkSize() const {
+        return ChunkSize;
+    }
+
+    // Where converted data ends and the area begins.
+    uint64_t DataEnd() const {
+        return (Dev.Size() - Area);
+    }
+
+    size_t JournalSlots() const {
+        return Slots.size();
+    }
+
+    uint64_t GetOffset(const TMode mode) const;
+    bool IsSparse(const uint64_t offset) const;
+
+    // Scans the journal ring for batches of `mode` above its offset, which
+    // may have been partly written when the previous run stopped.
+    bool Recover(const TMode mode);
+
+    bool HasJournal(const uint64_t offset) const;
+    bool ReadJournal(const uint64_t offset, char* out) const;
+
+    // Journals the chunks at `offsets` of a batch whose converted data is in
+    // `data`. Durable after the next Sync().
+    bool WriteJournal(const TMode mode, const uint64_t begin, const uint64_t end, const std::vector<uint64_t>& offsets, const char* data);
+
+    // Records a new offset and the zero chunks below it, in order. Written
+    // and made durable by the next Sync().
+    bool Commit(const TMode mode, const uint64_t offset, const std::vector<uint64_t>& zeroes);
+
+    // Writes the header if it changed and flushes the target; frees the
+    // journal slots the header covers.
+    bool Sync();
+
+private:
+    struct TSlot {
+        bool Used = false;
+        TMode Mode = MODE_DEFAULT;
+        uint64_t End = 0;
+    };
+
+    struct TRecovered {
+        size_t Slot = 0;
+        size_t Index = 0;
+    };
+
+    uint64_t ExtentsBegin() const {
+        return DataEnd();
+    }
+
+    uint64_t RingBegin() const {
+        return (ExtentsBegin() + ExtentBlocks * 4096);
+    }
+
+    uint64_t SlotSize() const {
+        return (4096 + BatchSize);
+    }
+
+    uint64_t HeaderOffset(const size_t block) const {
+        return (Dev.Size() - (2 - block) * 4096);
+    }
+
+    void Layout();
+    bool IsAreaEmpty() const;
+    bool LoadExtents(const uint64_t blocks);
+    // Called with Lock held.
+    bool WriteHeader();
+
+    // Called with Lock held.
+    void FreeSlots();
+
+private:
+    const TDevice& Dev;
+    uint64_t Area = 0;
+    size_t ChunkSize = 0;
+    size_t BatchSize = 0;
+    uint64_t Epoch = 0;
+    uint64_t Seq = 0;
+    uint64_t Offsets[2] = {0, 0};
+    uint64_t Durable[2] = {0, 0};
+    size_t DurableBlock = 0;
+    bool Dirty = false;
+    uint64_t ExtentBlocks = 0;
+    uint64_t UsedBlocks = 0;
+
+    // Held across a header write and the flush that makes it durable.
+    std::mutex SyncLock;
+    mutable std::mutex Lock;
+    std::condition_variable SlotFreed;
+    std::vector<std::pair<uint64_t, uint64_t>> Extents;
+    size_t Flushed = 0;
+    std::vector<TSlot> Slots;
+    std::map<uint64_t, TRecovered> Recovered;
+};
@@ -0,0 +1,375 @@
+#include "trace.hpp"
+
+#include <ac-common/file.hpp>
+#include <ac-common/utils/htonll.hpp>
+#include <ac-common/utils/string.hpp>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <fcntl.h>
+#include <string.h>
+
+static const char TraceMagic[8] = {'B', 'D', 'T', 'R', 'A', 'C', 'E', '1'};
+static const size_t TraceHeaderSize(sizeof(TraceMagic) + 2 * sizeof(uint64_t));
+static const size_t TraceRecordSize((2 + TRACE_STAGE_COUNT) * sizeof(uint64_t));
+static const size_t TraceRingSize(4096);
+static const std::chrono::milliseconds TraceFlushInterval(200);
+
+static const char* TraceStageNames[TRACE_STAGE_COUNT] = {
+    "claim",
+    "read",
+    "convert",
+    "write",
+    "sync",
+    "commit",
+};
+
+static void PutU64(char*& out, const uint64_t value) {
+    const uint64_t tmp(NAC::hton(value));
+
+    memcpy(out, &tmp, sizeof(tmp));
+    out += sizeof(tmp);
+}
+
+static uint64_t GetU64(const char*& in) {
+    uint64_t tmp;
+
+    memcpy(&tmp, in, sizeof(tmp));
+    in += sizeof(tmp);
+
+    return NAC::ntoh(tmp);
+}
+
+const char* TraceStageName(const TTraceStage stage) {
+    return TraceStageNames[stage];
+}
+
+TTraceBuffer::TTraceBuffer()
+    : Ring(TraceRingSize)
+{
+}
+
+void TTraceBuffer::Push(const TTraceRecord& record) {
+    const uint64_t head(Head.load(std::memory_order_relaxed));
+
+    if ((head - Tail.load(std::memory_order_acquire)) >= Ring.size()) {
+        ++Dropped;
+        return;
+    }
+
+    Ring[head % Ring.size()] = record;
+    Head.store(head + 1, std::memory_order_release);
+}
+
+void TTraceBuffer::Drain(std::vector<TTraceRecord>& out) {
+    const uint64_t tail(Tail.load(std::memory_order_relaxed));
+    const uint64_t head(Head.load(std::memory_order_acquire));
+
+    for (uint64_t i = tail; i < head; ++i) {
+        out.push_back(Ring[i % Ring.size()]);
+    }
+
+    Tail.store(head, std::memory_order_release);
+}
+
+TTracer::~TTracer() {
+    Stop();
+}
+
+bool TTracer::Open(const std::string& path, const uint64_t targetSize, const uint64_t chunkSize) {
+    File.reset(new TDevice(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+    if (!*File) {
+        std::cerr << "Can't create " << path << std::endl;
+        File.reset();
+        return false;
+    }
+
+    char header[TraceHeaderSize];
+    char* out(header + sizeof(TraceMagic));
+
+    memcpy(header, TraceMagic, sizeof(TraceMagic));
+    PutU64(out, targetSize);
+    PutU64(out, chunkSize);
+
+    if (!File->Write(0, sizeof(header), header)) {
+        std::cerr << "Can't create " << path << std::endl;
+        File.reset();
+        return false;
+    }
+
+    Position = sizeof(header);
+    T0 = std::chrono::steady_clock::now();
+
+    return true;
+}
+
+TTraceBuffer* TTracer::NewBuffer() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    Buffers.emplace_back(new TTraceBuffer);
+
+    return Buffers.back().get();
+}
+
+void TTracer::Start() {
+    if (File) {
+        Thread = std::thread([this]() {
+            Loop();
+        });
+    }
+}
+
+bool TTracer::Stop() {
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        Stopped = true;
+        Changed.notify_all();
+    }
+
+    if (!Thread.joinable()) {
+        return !Failed;
+    }
+
+    Thread.join();
+
+    uint64_t dropped(0);
+
+    for (const auto& buffer : Buffers) {
+        dropped += buffer->GetDropped();
+    }
+
+    if (dropped > 0) {
+        std::cerr << "Trace dropped " << dropped << " record(s)" << std::endl;
+    }
+
+    if (!Failed && !File->FSync()) {
+        Failed = true;
+    }
+
+    if (Failed) {
+        std::cerr << "Can't write trace to " << File->Path() << std::endl;
+    }
+
+    return !Failed;
+}
+
+void TTracer::Loop() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    while (true) {
+        const bool stopped(Changed.wait_for(guard, TraceFlushInterval, [this]() {
+            return Stopped;
+        }));
+
+        if (!Failed && !Flush()) {
+            Failed = true;
+        }
+
+        if (stopped) {
+            return;
+        }
+    }
+}
+
+// Called with Lock held, which only guards the buffer list.
+bool TTracer::Flush() {
+    std::vector<TTraceRecord> records;
+
+    for (const auto& buffer : Buffers) {
+        buffer->Drain(records);
+    }
+
+    if (records.empty()) {
+        return true;
+    }
+
+    std::vector<char> data(records.size() * TraceRecordSize);
+    char* out(data.data());
+
+    for (const auto& record : records) {
+        PutU64(out, record.Offset);
+        PutU64(out, ((uint64_t)record.Size << 32) | record.Flags);
+
+        for (size_t i = 0; i < TRACE_STAGE_COUNT; ++i) {
+            PutU64(out, record.Stages[i]);
+        }
+    }
+
+    if (!File->Write(Position, data.size(), data.data())) {
+        return false;
+    }
+
+    Position += data.size();
+
+    return true;
+}
+
+namespace {
+    double Percentile(std::vector<uint64_t>& values, const double p) {
+        if (values.empty()) {
+            return 0;
+        }
+
+        const size_t index(std::min(values.size() - 1, (size_t)(p * values.size())));
+
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+
+        return values[index] / 1e6;
+    }
+}
+
+int RunTraceReport(int argc, char** argv) {
+    std::string path;
+    size_t regions(32);
+    double interval(1);
+
+    for (int i = 0; i < argc; ++i) {
+        if ((strcmp(argv[i], "--regions") == 0) && ((i + 1) < argc)) {
+            ++i;
+            NAC::NStringUtils::FromString(strlen(argv[i]), argv[i], regions);
+
+        } else if ((strcmp(argv[i], "--interval") == 0) && ((i + 1) < argc)) {
+            ++i;
+            interval = atof(argv[i]);
+
+        } else if (path.empty()) {
+            path = argv[i];
+
+        } else {
+            std::cerr << "Invalid argument: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    if (path.empty() || (regions == 0) || (interval <= 0)) {
+        std::cerr << "Usage: bdenc trace-report /path/to/trace [--regions 32] [--interval 1]" << std::endl;
+        return 1;
+    }
+
+    NAC::TFile file(path);
+
+    if (!file || (file.Size() < TraceHeaderSize) || (memcmp(file.Data(), TraceMagic, sizeof(TraceMagic)) != 0)) {
+        std::cerr << "Can't load " << path << std::endl;
+        return 1;
+    }
+
+    const char* in(file.Data() + sizeof(TraceMagic));
+    const uint64_t targetSize(GetU64(in));
+    const uint64_t chunkSize(GetU64(in));
+    const size_t count((file.Size() - TraceHeaderSize) / TraceRecordSize);
+    std::vector<TTraceRecord> records(count);
+
+    for (auto& record : records) {
+        record.Offset = GetU64(in);
+
+        const uint64_t sizeAndFlags(GetU64(in));
+
+        record.Size = sizeAndFlags >> 32;
+        record.Flags = sizeAndFlags & 0xffffffff;
+
+        for (size_t i = 0; i < TRACE_STAGE_COUNT; ++i) {
+            record.Stages[i] = GetU64(in);
+        }
+    }
+
+    if (records.empty()) {
+        std::cerr << "No records in " << path << std::endl;
+        return 0;
+    }
+
+    uint64_t bytes(0);
+    uint64_t first(records.front().Stages[TRACE_STAGE_CLAIM]);
+    uint64_t last(0);
+
+    for (const auto& record : records) {
+        bytes += record.Size;
+        first = std::min(first, record.Stages[TRACE_STAGE_CLAIM]);
+        last = std::max(last, record.Stages[TRACE_STAGE_COMMIT]);
+    }
+
+    const double seconds(std::max<uint64_t>(1, last - first) / 1e9);
+
+    std::cout
+        << records.size() << " batch(es), " << bytes << " byte(s) in " << seconds << "s ("
+        << (bytes / seconds / (1024 * 1024)) << " MiB/s), target " << targetSize
+        << " byte(s), chunk " << chunkSize << std::endl;
+
+    std::cout << std::endl << std::fixed << std::setprecision(3)
+        << std::setw(10) << "stage (ms)" << std::setw(12) << "p50" << std::setw(12) << "p90"
+        << std::setw(12) << "p99" << std::setw(12) << "p99.9" << std::setw(12) << "max" << std::endl;
+
+    auto printStage = [&](const char* name, const size_t from, const size_t to) {
+        std::vector<uint64_t> values;
+
+        values.reserve(records.size());
+
+        for (const auto& record : records) {
+            values.push_back(record.Stages[to] - std::min(record.Stages[to], record.Stages[from]));
+        }
+
+        std::cout << std::setw(10) << name;
+
+        for (const double p : {0.5, 0.9, 0.99, 0.999, 1.0}) {
+            std::cout << std::setw(12) << Percentile(values, p);
+        }
+
+        std::cout << std::endl;
+    };
+
+    for (size_t i = 1; i < TRACE_STAGE_COUNT; ++i) {
+        printStage(TraceStageNames[i], i - 1, i);
+    }
+
+    printStage("total", TRACE_STAGE_CLAIM, TRACE_STAGE_COMMIT);
+
+    // Throughput over time, by commit time.
+    {
+        const uint64_t step(interval * 1e9);
+        std::vector<uint64_t> buckets((last - first) / step + 1, 0);
+
+        for (const auto& record : records) {
+            buckets[(record.Stages[TRACE_STAGE_COMMIT] - std::min(first, record.Stages[TRACE_STAGE_COMMIT])) / step] += record.Size;
+        }
+
+        std::cout << std::endl << std::setw(10) << "time (s)" << std::setw(12) << "MiB/s" << std::endl;
+
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            std::cout << std::setw(10) << (i * interval) << std::setw(12) << (buckets[i] / interval / (1024 * 1024)) << std::endl;
+        }
+    }
+
+    // Slow regions: batch latency (claim to commit) by target offset.
+    {
+        const uint64_t regionSize(std::max<uint64_t>(1, (targetSize + regions - 1) / regions));
+        std::vector<std::vector<uint64_t>> latencies(regions);
+        double worst(0);
+
+        for (const auto& record : records) {
+            const size_t region(std::min<uint64_t>(regions - 1, record.Offset / regionSize));
+
+            latencies[region].push_back(record.Stages[TRACE_STAGE_COMMIT] - record.Stages[TRACE_STAGE_CLAIM]);
+        }
+
+        std::vector<double> p99(regions, 0);
+
+        for (size_t i = 0; i < regions; ++i) {
+            p99[i] = Percentile(latencies[i], 0.99);
+            worst = std::max(worst, p99[i]);
+        }
+
+        std::cout << std::endl << std::setw(20) << "region" << std::setw(10) << "batches" << std::setw(12) << "p99 (ms)" << std::endl;
+
+        for (size_t i = 0; i < regions; ++i) {
+            const size_t width((worst > 0) ? (size_t)(40 * p99[i] / worst) : 0);
+
+            std::cout
+                << std::setw(20) << (i * regionSize) << std::setw(10) << latencies[i].size()
+                << std::setw(12) << p99[i] << " " << std::string(width, '#') << std::endl;
+        }
+    }
+
+    return 0;
+}
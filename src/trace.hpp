@@ -0,0 +1,103 @@
+#pragma once
+
+#include "device.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+enum TTraceStage {
+    TRACE_STAGE_CLAIM,
+    TRACE_STAGE_READ,
+    TRACE_STAGE_CONVERT,
+    TRACE_STAGE_WRITE,
+    TRACE_STAGE_SYNC,
+    TRACE_STAGE_COMMIT,
+
+    TRACE_STAGE_COUNT,
+};
+
+enum TTraceFlag {
+    TRACE_FLAG_ZERO = 1,
+    TRACE_FLAG_CIPHER = 2,
+    TRACE_FLAG_REPLAY = 4,
+    TRACE_FLAG_BAD = 8,
+    TRACE_FLAG_PREFETCHED = 16,
+};
+
+// One record per batch. Stage timestamps are nanoseconds since the start of
+// the trace and mark the end of each stage; the claim stamp is the start.
+struct TTraceRecord {
+    uint64_t Offset = 0;
+    uint32_t Size = 0;
+    uint32_t Flags = 0;
+    uint64_t Stages[TRACE_STAGE_COUNT] = {};
+};
+
+// Single-producer ring owned by one worker; the tracer thread drains it.
+// Records are dropped (and counted) rather than blocking the worker.
+class TTraceBuffer {
+public:
+    TTraceBuffer();
+
+    void Push(const TTraceRecord& record);
+    void Drain(std::vector<TTraceRecord>& out);
+
+    uint64_t GetDropped() const {
+        return Dropped;
+    }
+
+private:
+    std::vector<TTraceRecord> Ring;
+    std::atomic<uint64_t> Head{0};
+    std::atomic<uint64_t> Tail{0};
+    std::atomic<uint64_t> Dropped{0};
+};
+
+class TTracer {
+public:
+    TTracer() = default;
+    ~TTracer();
+
+    bool Open(const std::string& path, const uint64_t targetSize, const uint64_t chunkSize);
+
+    explicit operator bool() const {
+        return (bool)File;
+    }
+
+    uint64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - T0).count();
+    }
+
+    // The buffer lives as long as the tracer.
+    TTraceBuffer* NewBuffer();
+
+    void Start();
+    bool Stop();
+
+private:
+    void Loop();
+    bool Flush();
+
+private:
+    std::unique_ptr<TDevice> File;
+    uint64_t Position = 0;
+    std::chrono::steady_clock::time_point T0;
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::vector<std::unique_ptr<TTraceBuffer>> Buffers;
+    bool Stopped = false;
+    bool Failed = false;
+    std::thread Thread;
+};
+
+const char* TraceStageName(const TTraceStage stage);
+
+// `bdenc trace-report /path/to/trace [--regions 32] [--interval 1]`
+int RunTraceReport(int argc, char** argv);
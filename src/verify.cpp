@@ -0,0 +1,180 @@
+#include "verify.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t VerifyQueueSize(64);
+
+TVerifier::TVerifier(
+    const TMode mode,
+    const TKeyMaterial& keys,
+    const TDevice& dev,
+    const TBadBlocks* badBlocks,
+    const size_t chunkSize,
+    const uint64_t every,
+    std::function<void()> onFailure
+)
+    : InverseMode((mode == MODE_ENCRYPT) ? MODE_DECRYPT : MODE_ENCRYPT)
+    , Keys(keys)
+    , Dev(dev)
+    , BadBlocks(badBlocks)
+    , ChunkSize(chunkSize)
+    , Every(every)
+    , OnFailure(std::move(onFailure))
+{
+}
+
+TVerifier::~TVerifier() {
+    Stop();
+}
+
+void TVerifier::Start() {
+    if (Every > 0) {
+        Thread = std::thread([this]() {
+            Loop();
+        });
+    }
+}
+
+void TVerifier::Stop() {
+    {
+        std::unique_lock<std::mutex> guard(Lock);
+
+        Stopped = true;
+        Changed.notify_all();
+    }
+
+    if (Thread.joinable()) {
+        Thread.join();
+    }
+}
+
+void TVerifier::Sample(const uint64_t offset, const char* input, const char* output) {
+    if ((Every == 0) || (((Counter++) % Every) != 0)) {
+        return;
+    }
+
+    TSample sample;
+
+    sample.Offset = offset;
+    sample.Output.reset(new char[ChunkSize]);
+    memcpy(sample.Output.get(), output, ChunkSize);
+
+    if (input && (Keys.IVMode == IV_MODE_ESSIV)) {
+        sample.HasInput = true;
+        sample.Input.reset(new char[ChunkSize]);
+        memcpy(sample.Input.get(), input, ChunkSize);
+    }
+
+    std::unique_lock<std::mutex> guard(Lock);
+
+    if (Queue.size() >= VerifyQueueSize) {
+        ++Dropped;
+        return;
+    }
+
+    Queue.emplace_back(std::move(sample));
+    Changed.notify_all();
+}
+
+void TVerifier::Loop() {
+    TChunkCipher cipher(InverseMode, Keys);
+    TAlignedBuffer readBack(ChunkSize, std::max<size_t>(4096, Dev.SectorSize()));
+    std::unique_ptr<char[]> inverse(new char[ChunkSize]);
+
+    if (!cipher || !readBack) {
+        Failed_ = true;
+        OnFailure();
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(Lock);
+
+    while (true) {
+        Changed.wait(guard, [this]() {
+            return (Stopped || !Queue.empty());
+        });
+
+        if (Queue.empty()) {
+            break;
+        }
+
+        TSample sample(std::move(Queue.front()));
+
+        Queue.pop_front();
+        guard.unlock();
+
+        if (!Failed_ && !Check(cipher, sample, readBack.Data(), inverse.get())) {
+            Failed_ = true;
+            OnFailure();
+        }
+
+        guard.lock();
+    }
+}
+
+bool TVerifier::Check(TChunkCipher& cipher, const TSample& sample, char* readBack, char* inverse) {
+    if (BadBlocks && BadBlocks->Overlaps(sample.Offset, sample.Offset + ChunkSize)) {
+        return true;
+    }
+
+    if (!Dev.Read(sample.Offset, ChunkSize, readBack)) {
+        std::cerr << "Verification failed at " << sample.Offset << ": can't read back" << std::endl;
+        return false;
+    }
+
+    if (memcmp(readBack, sample.Output.get(), ChunkSize) != 0) {
+        std::cerr << "Verification failed at " << sample.Offset << ": read back data differs from written data" << std::endl;
+        return false;
+    }
+
+    if (sample.HasInput) {
+        if (!cipher.Process(sample.Offset, ChunkSize, readBack, inverse)) {
+            return false;
+        }
+
+        if (memcmp(inverse, sample.Input.get(), ChunkSize) != 0) {
+            std::cerr << "Verification failed at " << sample.Offset << ": read back data does not convert back to its input" << std::endl;
+            return false;
+        }
+    }
+
+    ++Verified;
+
+    return true;
+}
+
+void TVerifier::Report() const {
+    if (Every == 0) {
+        return;
+    }
+
+    std::cerr << "Verified " << Verified << " sampled chunk(s), dropped " << Dropped << " sample(s)" << std::endl;
+}
+
+bool ParseVerifySample(const char* str, uint64_t& every) {
+    char* end(nullptr);
+    const double value(strtod(str, &end));
+
+    if ((end == str) || (value <= 0)) {
+        return false;
+    }
+
+    if (*end == '%') {
+        if ((end[1] != '\0') || (value > 100)) {
+            return false;
+        }
+
+        every = (uint64_t)(100 / value + 0.5);
+
+    } else if (*end == '\0') {
+        every = (uint64_t)value;
+
+    } else {
+        return false;
+    }
+
+    return (every > 0);
+}
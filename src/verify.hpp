@@ -0,0 +1,84 @@
+#pragma once
+
+#include "badblocks.hpp"
+#include "cipher.hpp"
+#include "device.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+
+// Re-reads every Nth written chunk with O_DIRECT in a background thread and
+// checks it against what was written. With essiv the read-back chunk is also
+// run through the inverse cipher and compared to the original input.
+// Samples that arrive while the queue is full are dropped rather than
+// stalling the workers.
+class TVerifier {
+public:
+    TVerifier(
+        const TMode mode,
+        const TKeyMaterial& keys,
+        const TDevice& dev,
+        const TBadBlocks* badBlocks,
+        const size_t chunkSize,
+        const uint64_t every,
+        std::function<void()> onFailure
+    );
+    ~TVerifier();
+
+    explicit operator bool() const {
+        return (Every > 0);
+    }
+
+    void Start();
+    void Stop();
+
+    // Must be called after the chunk has been written and flushed. Input may
+    // be nullptr if the chunk was not converted (e.g. zero-filled).
+    void Sample(const uint64_t offset, const char* input, const char* output);
+
+    bool Failed() const {
+        return Failed_;
+    }
+
+    void Report() const;
+
+private:
+    struct TSample {
+        uint64_t Offset = 0;
+        bool HasInput = false;
+        std::unique_ptr<char[]> Input;
+        std::unique_ptr<char[]> Output;
+    };
+
+    void Loop();
+    bool Check(TChunkCipher& cipher, const TSample& sample, char* readBack, char* inverse);
+
+private:
+    const TMode InverseMode;
+    const TKeyMaterial& Keys;
+    const TDevice& Dev;
+    const TBadBlocks* BadBlocks;
+    const size_t ChunkSize;
+    const uint64_t Every;
+    std::function<void()> OnFailure;
+
+    std::atomic<uint64_t> Counter{0};
+    std::atomic<uint64_t> Verified{0};
+    std::atomic<uint64_t> Dropped{0};
+    std::atomic<bool> Failed_{false};
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::deque<TSample> Queue;
+    bool Stopped = false;
+    std::thread Thread;
+};
+
+// Accepts "1%" (a percentage of written chunks) or "100" (every 100th).
+bool ParseVerifySample(const char* str, uint64_t& every);